@@ -1,5 +1,9 @@
 #!/bin/bash
 
+# set to 1 to answer cniplist lookups from the built-in prefix table
+# instead of ipset, the table is fed by ipgroup -n (make ipgroup)
+CNIPLIST_BUILTIN=${CNIPLIST_BUILTIN:-0}
+
 echo 1 > /proc/sys/net/ipv4/ip_forward
 
 iptables -F
@@ -29,6 +33,8 @@ rm -f /tmp/cniplist.set
 ipset create gfwlist iphash
 ipset create udproxylist iphash
 ipset add udproxylist 8.8.8.8
+# drop verdicts cached for the old sets, if natcap is still loaded
+[ -e /dev/natcap_ctl ] && echo dst_cache_flush >>/dev/natcap_ctl
 
 # load && run
 # server is 1.2.3.4 for example
@@ -52,4 +58,8 @@ server_persist_timeout=86400
 sproxy=1
 server 1.2.3.4:65535-e
 EOF
+if [ "$CNIPLIST_BUILTIN" = 1 ]; then
+./ipgroup -n cniplist.set >>/dev/natcap_ctl
+echo cniplist_commit >>/dev/natcap_ctl
+fi
 }
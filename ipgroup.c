@@ -0,0 +1,289 @@
+/*
+ * ipgroup: merge, invert and aggregate IPv4 address lists
+ *
+ * Input lines are an address, a CIDR or an a.b.c.d-e.f.g.h range, or with -a
+ * the start|count pairs cut from the APNIC delegated file. All input is
+ * merged into ranges, -i takes the complement, and every range is written
+ * out as the fewest CIDR blocks in ascending order, as
+ *     plain CIDR lines (default)
+ *     ipset restore input (-s setname)
+ *     natcap_ctl cniplist_add= lines (-n)
+ * The lists match what the former Lua + ipcalc -r pipeline generated.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <unistd.h>
+
+struct range {
+	uint32_t s;
+	uint32_t e;
+};
+
+static struct range *ranges = NULL;
+static size_t nr_ranges = 0;
+static size_t max_ranges = 0;
+
+static void range_add(uint32_t s, uint32_t e)
+{
+	if (nr_ranges == max_ranges) {
+		max_ranges = max_ranges ? max_ranges * 2 : 4096;
+		ranges = realloc(ranges, sizeof(struct range) * max_ranges);
+		if (!ranges) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	ranges[nr_ranges].s = s;
+	ranges[nr_ranges].e = e;
+	nr_ranges++;
+}
+
+/* numbers separated by anything but digits: 4 for an address, 5 for a
+ * CIDR or start|count, 8 for a range
+ */
+static int get_parts(const char *line, uint64_t *n, int max)
+{
+	int i = 0;
+
+	while (*line) {
+		if (!isdigit((unsigned char)*line)) {
+			line++;
+			continue;
+		}
+		if (i == max)
+			return max + 1;
+		n[i] = 0;
+		while (isdigit((unsigned char)*line)) {
+			if (n[i] < 0x100000000ULL)
+				n[i] = n[i] * 10 + (*line - '0');
+			line++;
+		}
+		i++;
+	}
+	return i;
+}
+
+static int parse_line(const char *line, int apnic)
+{
+	uint64_t n[8];
+	uint64_t s, e;
+	int i, cnt;
+
+	cnt = get_parts(line, n, 8);
+	if (cnt != 4 && cnt != 5 && cnt != 8)
+		return -1;
+	for (i = 0; i < 4; i++) {
+		if (n[i] > 255)
+			return -1;
+	}
+	s = (((n[0] * 256 + n[1]) * 256 + n[2]) * 256 + n[3]);
+
+	if (cnt == 4) {
+		e = s;
+	} else if (cnt == 5 && apnic) {
+		if (n[4] == 0 || s + n[4] - 1 > 0xffffffffULL)
+			return -1;
+		e = s + n[4] - 1;
+	} else if (cnt == 5) {
+		uint64_t size;
+		if (n[4] > 32)
+			return -1;
+		size = 1ULL << (32 - n[4]);
+		s &= ~(size - 1);
+		e = s + size - 1;
+	} else {
+		for (i = 4; i < 8; i++) {
+			if (n[i] > 255)
+				return -1;
+		}
+		e = (((n[4] * 256 + n[5]) * 256 + n[6]) * 256 + n[7]);
+		if (s > e)
+			return -1;
+	}
+
+	range_add((uint32_t)s, (uint32_t)e);
+	return 0;
+}
+
+static int load_file(const char *path, int apnic)
+{
+	char line[256];
+	FILE *fp;
+
+	if (strcmp(path, "-") == 0) {
+		fp = stdin;
+	} else {
+		fp = fopen(path, "r");
+		if (!fp) {
+			perror(path);
+			return -1;
+		}
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		parse_line(line, apnic);
+	}
+
+	if (fp != stdin)
+		fclose(fp);
+	return 0;
+}
+
+static int range_cmp(const void *a, const void *b)
+{
+	const struct range *ra = a, *rb = b;
+
+	if (ra->s != rb->s)
+		return ra->s < rb->s ? -1 : 1;
+	if (ra->e != rb->e)
+		return ra->e < rb->e ? -1 : 1;
+	return 0;
+}
+
+/* sort and join overlapping or adjacent ranges in place */
+static void ranges_merge(void)
+{
+	size_t i, j;
+
+	if (nr_ranges == 0)
+		return;
+
+	qsort(ranges, nr_ranges, sizeof(struct range), range_cmp);
+	for (i = 0, j = 1; j < nr_ranges; j++) {
+		if ((uint64_t)ranges[i].e + 1 >= ranges[j].s) {
+			if (ranges[j].e > ranges[i].e)
+				ranges[i].e = ranges[j].e;
+		} else {
+			ranges[++i] = ranges[j];
+		}
+	}
+	nr_ranges = i + 1;
+}
+
+/* replace the merged ranges with the gaps between them */
+static void ranges_invert(void)
+{
+	struct range *old = ranges;
+	size_t i, nr_old = nr_ranges;
+	uint64_t next = 0;
+
+	ranges = NULL;
+	nr_ranges = max_ranges = 0;
+	for (i = 0; i < nr_old; i++) {
+		if (next < old[i].s)
+			range_add((uint32_t)next, old[i].s - 1);
+		next = (uint64_t)old[i].e + 1;
+	}
+	if (next <= 0xffffffffULL)
+		range_add((uint32_t)next, 0xffffffff);
+	free(old);
+}
+
+enum {
+	OUT_CIDR,
+	OUT_IPSET,
+	OUT_NATCAP,
+};
+
+static void emit(int out, const char *setname, uint32_t ip, int cidr)
+{
+	char buf[32];
+
+	snprintf(buf, sizeof(buf), "%u.%u.%u.%u/%d", ip >> 24, (ip >> 16) & 0xff, (ip >> 8) & 0xff, ip & 0xff, cidr);
+	switch (out) {
+		case OUT_IPSET:
+			printf("add %s %s\n", setname, buf);
+			break;
+		case OUT_NATCAP:
+			printf("cniplist_add=%s\n", buf);
+			break;
+		default:
+			printf("%s\n", buf);
+			break;
+	}
+}
+
+/* the fewest CIDR blocks covering [s, e], as ipcalc -r prints them */
+static void range_aggregate(int out, const char *setname, uint32_t s, uint32_t e)
+{
+	uint64_t cur = s, end = (uint64_t)e + 1;
+	uint64_t size;
+	int cidr;
+
+	while (cur < end) {
+		size = cur ? (cur & -cur) : (1ULL << 32);
+		cidr = 32 - __builtin_ctzll(size);
+		while (cur + size > end) {
+			size >>= 1;
+			cidr++;
+		}
+		emit(out, setname, (uint32_t)cur, cidr);
+		cur += size;
+	}
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+			"Usage: %s [-a] [-i] [-s setname | -n] file...\n"
+			"    -a          input lines are start|count from the APNIC delegated file\n"
+			"    -i          output the complement of the merged input\n"
+			"    -s setname  output ipset restore input for hash:net set setname\n"
+			"    -n          output natcap_ctl cniplist_add= lines\n"
+			"    file        - reads stdin\n",
+			prog);
+}
+
+int main(int argc, char **argv)
+{
+	int c, i;
+	int apnic = 0, invert = 0, out = OUT_CIDR;
+	const char *setname = NULL;
+
+	while ((c = getopt(argc, argv, "ais:nh")) != -1) {
+		switch (c) {
+			case 'a':
+				apnic = 1;
+				break;
+			case 'i':
+				invert = 1;
+				break;
+			case 's':
+				out = OUT_IPSET;
+				setname = optarg;
+				break;
+			case 'n':
+				out = OUT_NATCAP;
+				break;
+			default:
+				usage(argv[0]);
+				return c == 'h' ? 0 : 1;
+		}
+	}
+	if (optind >= argc) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	for (i = optind; i < argc; i++) {
+		if (load_file(argv[i], apnic) != 0)
+			return 1;
+	}
+
+	ranges_merge();
+	if (invert)
+		ranges_invert();
+
+	if (out == OUT_IPSET) {
+		printf("create %s hash:net family inet hashsize 4096 maxelem 65536 -exist\n", setname);
+		printf("flush %s\n", setname);
+	}
+	for (i = 0; i < (int)nr_ranges; i++) {
+		range_aggregate(out, setname, ranges[i].s, ranges[i].e);
+	}
+
+	return 0;
+}
@@ -95,6 +95,13 @@ struct natcap_session {
 	unsigned int foreign_seq;
 	unsigned int current_seq;
 	__be16 new_source;
+	unsigned int syn_stamp; /* usecs the first SYN left for the server, 0 once sampled */
+#define NATCAP_SERVER_RACE_MAX 4
+	unsigned char race_nr; /* servers racing the first SYN, 0 if not racing */
+	__be16 race_source[NATCAP_SERVER_RACE_MAX];
+	struct tuple race_tup[NATCAP_SERVER_RACE_MAX];
+	__be32 active_ip; /* server counted in its flows_active until destroy, 0 if none */
+	__be16 active_port;
 };
 
 #define NATCAP_MAGIC 0x43415099
@@ -195,4 +202,17 @@ enum {
 
 #define SO_NATCAP_DST 153
 
+/* return values of the classifier program loaded by classifier_bpf= */
+#define NATCAP_VERDICT_DEFAULT 0 /* fall back to the built-in chain, port 53/80/443 defaults included */
+#define NATCAP_VERDICT_KNOCK 1 /* TCP only, the default for UDP */
+#define NATCAP_VERDICT_BYPASS 2
+#define NATCAP_VERDICT_PROXY 3
+#define NATCAP_VERDICT_RACE 4 /* dual out every time, learned race winners are not applied */
+#define NATCAP_VERDICT_REDIRECT 5 /* to natcap_redirect_port, proxy when it is unset */
+
+/* socket marks natcapd-client puts on connects it bound by SNI/Host */
+#define NATCAP_BIND_MARK_MASK 0xff00
+#define NATCAP_BIND_MARK_BYPASS 0x9a00
+#define NATCAP_BIND_MARK_PROXY 0x9b00
+
 #endif /* _NATCAP_H_ */
@@ -0,0 +1,223 @@
+/*
+ * helpers that touch no skb or conntrack state, so that test/ can build them
+ * in userspace against test/kcompat.h and check them against reference code
+ */
+#ifndef _NATCAP_ALGO_H_
+#define _NATCAP_ALGO_H_
+
+/* a plain byte loop: the table lookups bound it, and the word at a time
+ * version measured slower (test/test_map.c -b)
+ */
+static inline void natcap_map_buf(const unsigned char *map, unsigned char *buf, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++) {
+		buf[i] = map[buf[i]];
+	}
+}
+
+/* accumulate the checksum delta of one rewritten 16/32-bit header field */
+static inline __wsum natcap_csum_diff(__wsum diff, __wsum from, __wsum to)
+{
+	return csum_add(csum_sub(diff, from), to);
+}
+
+/* fold the accumulated delta into a stored checksum (RFC 1624) */
+static inline __sum16 natcap_csum_update(__sum16 check, __wsum diff)
+{
+	return csum_fold(csum_add(~csum_unfold(check), diff));
+}
+
+/* the cniplist 16-8-8 multibit trie, see natcap_cniplist_table */
+#define NATCAP_LPM_L1_CHUNK 0x80000000
+#define NATCAP_LPM_L2_CHUNK 2
+#define NATCAP_LPM_L3_MAX (65536 - NATCAP_LPM_L2_CHUNK)
+
+struct natcap_lpm_prefix {
+	unsigned int addr;
+	unsigned int cidr;
+};
+
+struct natcap_lpm_table {
+	unsigned int nr_prefix;
+	unsigned int l2_used;
+	unsigned int l3_used;
+	unsigned short (*l2)[256];
+	unsigned int (*l3)[8];
+	unsigned int l1[65536];
+};
+
+static inline int natcap_lpm_prefix_cmp(const void *a, const void *b)
+{
+	const struct natcap_lpm_prefix *pa = a;
+	const struct natcap_lpm_prefix *pb = b;
+
+	if (pa->cidr != pb->cidr)
+		return pa->cidr < pb->cidr ? -1 : 1;
+	if (pa->addr != pb->addr)
+		return pa->addr < pb->addr ? -1 : 1;
+	return 0;
+}
+
+static inline unsigned short *natcap_lpm_l2_get(struct natcap_lpm_table *t, unsigned int addr)
+{
+	unsigned int *e = &t->l1[addr >> 16];
+
+	if (*e == 1)
+		return NULL;
+	if (*e == 0) {
+		memset(t->l2[t->l2_used], 0, sizeof(t->l2[0]));
+		*e = NATCAP_LPM_L1_CHUNK | t->l2_used++;
+	}
+	return t->l2[*e & ~NATCAP_LPM_L1_CHUNK];
+}
+
+/* prefixes are applied shortest first, so a covered block never grows a chunk */
+static inline struct natcap_lpm_table *natcap_lpm_build(struct natcap_lpm_prefix *p, unsigned int n)
+{
+	unsigned int i, j;
+	unsigned int nr_l2 = 0, nr_l3 = 0;
+	struct natcap_lpm_table *t;
+
+	sort(p, n, sizeof(*p), natcap_lpm_prefix_cmp, NULL);
+
+	for (i = 0; i < n; i++) {
+		if (p[i].cidr > 16)
+			nr_l2++;
+		if (p[i].cidr > 24)
+			nr_l3++;
+	}
+	if (nr_l3 > NATCAP_LPM_L3_MAX)
+		return ERR_PTR(-E2BIG);
+
+	t = vmalloc(sizeof(*t) + nr_l2 * sizeof(t->l2[0]) + nr_l3 * sizeof(t->l3[0]));
+	if (!t)
+		return ERR_PTR(-ENOMEM);
+	memset(t->l1, 0, sizeof(t->l1));
+	t->nr_prefix = n;
+	t->l2_used = 0;
+	t->l3_used = 0;
+	t->l2 = (void *)(t + 1);
+	t->l3 = (void *)(t->l2 + nr_l2);
+
+	for (i = 0; i < n; i++) {
+		unsigned int addr = p[i].addr;
+		unsigned int cidr = p[i].cidr;
+		unsigned short *l2;
+		unsigned short *e;
+
+		if (cidr <= 16) {
+			for (j = 0; j < (1U << (16 - cidr)); j++) {
+				t->l1[(addr >> 16) + j] = 1;
+			}
+			continue;
+		}
+
+		l2 = natcap_lpm_l2_get(t, addr);
+		if (!l2)
+			continue;
+
+		if (cidr <= 24) {
+			for (j = 0; j < (1U << (24 - cidr)); j++) {
+				l2[((addr >> 8) & 0xff) + j] = 1;
+			}
+			continue;
+		}
+
+		e = &l2[(addr >> 8) & 0xff];
+		if (*e == 1)
+			continue;
+		if (*e == 0) {
+			memset(t->l3[t->l3_used], 0, sizeof(t->l3[0]));
+			*e = NATCAP_LPM_L2_CHUNK + t->l3_used++;
+		}
+		for (j = 0; j < (1U << (32 - cidr)); j++) {
+			unsigned int bit = (addr & 0xff) + j;
+			t->l3[*e - NATCAP_LPM_L2_CHUNK][bit >> 5] |= 1U << (bit & 31);
+		}
+	}
+
+	return t;
+}
+
+static inline int natcap_lpm_lookup(const struct natcap_lpm_table *t, unsigned int addr)
+{
+	unsigned int e = t->l1[addr >> 16];
+	unsigned short e2;
+	unsigned int bit;
+
+	if (!(e & NATCAP_LPM_L1_CHUNK))
+		return e;
+	e2 = t->l2[e & ~NATCAP_LPM_L1_CHUNK][(addr >> 8) & 0xff];
+	if (e2 < NATCAP_LPM_L2_CHUNK)
+		return e2;
+	bit = addr & 0xff;
+	return !!(t->l3[e2 - NATCAP_LPM_L2_CHUNK][bit >> 5] & (1U << (bit & 31)));
+}
+
+/* weighted rendezvous hashing for server_affinity: each server ranks a
+ * (client, destination) pair by -log2(h / 2^32) / 2^b, h a hash of the pair
+ * and the server, 2^b its weight, and the lowest key wins. The weight is a
+ * power of two so the division is a shift, and log2 is interpolated in a
+ * table of log2(1 + i / 256) in 16.16 fixed point
+ */
+static const unsigned int natcap_affinity_log2_tbl[257] = {
+	    0,   369,   736,  1102,  1466,  1829,  2190,  2551,
+	 2909,  3267,  3623,  3978,  4331,  4683,  5034,  5384,
+	 5732,  6079,  6425,  6769,  7112,  7454,  7795,  8134,
+	 8473,  8810,  9146,  9480,  9814, 10146, 10477, 10807,
+	11136, 11464, 11791, 12116, 12440, 12764, 13086, 13407,
+	13727, 14046, 14363, 14680, 14996, 15310, 15624, 15937,
+	16248, 16559, 16868, 17177, 17484, 17791, 18096, 18401,
+	18704, 19007, 19308, 19609, 19909, 20207, 20505, 20802,
+	21098, 21393, 21687, 21980, 22272, 22564, 22854, 23144,
+	23433, 23720, 24007, 24293, 24579, 24863, 25146, 25429,
+	25711, 25992, 26272, 26551, 26830, 27108, 27384, 27660,
+	27936, 28210, 28484, 28757, 29029, 29300, 29571, 29840,
+	30109, 30378, 30645, 30912, 31178, 31443, 31707, 31971,
+	32234, 32496, 32758, 33019, 33279, 33538, 33797, 34055,
+	34312, 34569, 34825, 35080, 35334, 35588, 35841, 36094,
+	36346, 36597, 36847, 37097, 37346, 37595, 37842, 38090,
+	38336, 38582, 38827, 39072, 39316, 39559, 39802, 40044,
+	40286, 40527, 40767, 41006, 41246, 41484, 41722, 41959,
+	42196, 42432, 42667, 42902, 43137, 43370, 43603, 43836,
+	44068, 44300, 44530, 44761, 44990, 45220, 45448, 45676,
+	45904, 46131, 46357, 46583, 46809, 47034, 47258, 47482,
+	47705, 47928, 48150, 48372, 48593, 48813, 49034, 49253,
+	49472, 49691, 49909, 50127, 50344, 50560, 50776, 50992,
+	51207, 51422, 51636, 51850, 52063, 52276, 52488, 52700,
+	52911, 53122, 53332, 53542, 53751, 53960, 54169, 54377,
+	54584, 54791, 54998, 55204, 55410, 55615, 55820, 56025,
+	56229, 56432, 56635, 56838, 57040, 57242, 57443, 57644,
+	57845, 58045, 58245, 58444, 58643, 58841, 59039, 59237,
+	59434, 59631, 59827, 60023, 60219, 60414, 60609, 60803,
+	60997, 61190, 61384, 61576, 61769, 61961, 62152, 62343,
+	62534, 62725, 62915, 63104, 63294, 63483, 63671, 63859,
+	64047, 64234, 64421, 64608, 64794, 64980, 65166, 65351,
+	65536,
+};
+
+/* murmur3 finalizer, pair and server hashes are xored before it */
+static inline u32 natcap_affinity_mix(u32 h)
+{
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+static inline u64 natcap_affinity_key(u32 pair, u32 seed, unsigned int b)
+{
+	u32 h = natcap_affinity_mix(pair ^ seed) | 1;
+	unsigned int e = ilog2(h);
+	u32 m = h << (31 - e);
+	const unsigned int *l = &natcap_affinity_log2_tbl[(m >> 23) & 0xff];
+	u32 neglog = (32U << 16) - (e << 16) - l[0] - (((l[1] - l[0]) * ((m >> 15) & 0xff)) >> 8);
+
+	return ((u64)neglog << 32) >> b;
+}
+
+#endif /* _NATCAP_ALGO_H_ */
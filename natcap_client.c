@@ -20,6 +20,19 @@
 #include <linux/tcp.h>
 #include <linux/udp.h>
 #include <linux/version.h>
+#include <linux/hash.h>
+#include <linux/jhash.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/log2.h>
+#include <linux/mutex.h>
+#include <linux/timer.h>
+#include <linux/vmalloc.h>
+#include <net/dst.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 14, 0)
+#include <linux/bpf.h>
+#include <linux/filter.h>
+#endif
 #include <net/netfilter/nf_conntrack.h>
 #include "natcap_common.h"
 #include "natcap_client.h"
@@ -120,202 +133,1971 @@ out:
 
 unsigned int cnipwhitelist_mode = 0;
 
-unsigned int macfilter = 0;
-const char *macfilter_acl_str[NATCAP_ACL_MAX] = {
-	[NATCAP_ACL_NONE] = "none",
-	[NATCAP_ACL_ALLOW] = "allow",
-	[NATCAP_ACL_DENY] = "deny"
+/* per-cpu cache of the destination list verdict of new connections:
+ * browsers open many connections to the same few addresses, and each of them
+ * would otherwise walk knocklist/bypasslist/cniplist/gfwlist again.
+ * Entries live dst_cache_timeout seconds. An address natcap adds to or deletes
+ * from a set itself, or learns from a DNS answer, bumps the generation of its
+ * hash bucket and drops only the entries of that bucket; swapping the cniplist
+ * table or changing cnipwhitelist_mode bumps the global generation.
+ * Set changes made from userspace (ipset restore, dnsmasq ipset=) are not
+ * seen here: a cached address keeps its old verdict for up to
+ * dst_cache_timeout seconds, unless the writer also sends dst_cache_flush,
+ * as client.sh does. ipsets are per netns and the key holds no netns, so
+ * only flows of init_net use the cache
+ */
+enum {
+	NATCAP_DST_MISS = 0,
+	NATCAP_DST_KNOCK,
+	NATCAP_DST_BYPASS,
+	NATCAP_DST_PROXY,
+	NATCAP_DST_DUAL,
+	NATCAP_DST_REDIRECT,
+	NATCAP_DST_CNIP, /* bypass, but found in cniplist: no syn fallback */
 };
 
-unsigned int ipfilter = 0;
-const char *ipfilter_acl_str[NATCAP_ACL_MAX] = {
-	[NATCAP_ACL_NONE] = "none",
-	[NATCAP_ACL_ALLOW] = "allow",
-	[NATCAP_ACL_DENY] = "deny"
+#define NATCAP_DST_CACHE_BITS 8
+
+struct natcap_dst_cache_entry {
+	__be32 ip;
+	unsigned char protocol;
+	unsigned char verdict;
+	unsigned int gen;
+	unsigned long expires;
 };
 
-unsigned int encode_http_only = 0;
-unsigned int http_confusion = 0;
-unsigned int sproxy = 0;
-unsigned int dns_server = __constant_htonl((8<<24)|(8<<16)|(8<<8)|(8<<0));
-unsigned short dns_port = __constant_htons(53);
+struct natcap_dst_cache {
+	struct natcap_dst_cache_entry e[1 << NATCAP_DST_CACHE_BITS];
+	unsigned long long hit;
+	unsigned long long miss;
+};
 
-u32 default_u_hash = 0;
-unsigned char default_mac_addr[ETH_ALEN];
-static void default_mac_addr_init(void)
+static DEFINE_PER_CPU(struct natcap_dst_cache, natcap_dst_cache);
+static atomic_t natcap_dst_cache_gen = ATOMIC_INIT(1);
+
+#define NATCAP_DST_CACHE_IP_GEN_BITS 10
+static atomic_t natcap_dst_cache_ip_gen[1 << NATCAP_DST_CACHE_IP_GEN_BITS];
+
+unsigned int dst_cache_timeout = 2;
+
+static inline struct natcap_dst_cache_entry *natcap_dst_cache_slot(struct natcap_dst_cache *c, __be32 ip, unsigned char protocol)
 {
-	struct net_device *dev;
+	return &c->e[hash_32((__force u32)ip ^ protocol, NATCAP_DST_CACHE_BITS)];
+}
 
-	memset(default_mac_addr, 0, ETH_ALEN);
-	dev = first_net_device(&init_net);
-	while (dev) {
-		if (dev->type == ARPHRD_ETHER) {
-			memcpy(default_mac_addr, dev->dev_addr, ETH_ALEN);
-			break;
-		}
-		dev = next_net_device(dev);
-	}
+static inline atomic_t *natcap_dst_cache_ip_gen_slot(__be32 ip)
+{
+	return &natcap_dst_cache_ip_gen[hash_32((__force u32)ip, NATCAP_DST_CACHE_IP_GEN_BITS)];
+}
 
-	dev = first_net_device(&init_net);
-	while (dev) {
-		if (strcmp("eth0", dev->name) == 0) {
-			memcpy(default_mac_addr, dev->dev_addr, ETH_ALEN);
-			break;
-		} else if (strcmp("eth1", dev->name) == 0) {
-			memcpy(default_mac_addr, dev->dev_addr, ETH_ALEN);
-			// sometimes we use eth1
-		}
+/* both generations only grow, so their sum changes whenever either of them does */
+static inline unsigned int natcap_dst_cache_gen_get(__be32 ip)
+{
+	return atomic_read(&natcap_dst_cache_gen) + atomic_read(natcap_dst_cache_ip_gen_slot(ip));
+}
 
-		dev = next_net_device(dev);
+static int natcap_dst_cache_get(struct net *net, __be32 ip, unsigned char protocol, unsigned int *gen)
+{
+	int verdict = NATCAP_DST_MISS;
+	struct natcap_dst_cache *c;
+	struct natcap_dst_cache_entry *e;
+
+	*gen = natcap_dst_cache_gen_get(ip);
+	if (dst_cache_timeout == 0 || !net_eq(net, &init_net))
+		return NATCAP_DST_MISS;
+
+	local_bh_disable();
+	c = this_cpu_ptr(&natcap_dst_cache);
+	e = natcap_dst_cache_slot(c, ip, protocol);
+	if (e->gen == *gen && e->ip == ip && e->protocol == protocol && time_before(jiffies, e->expires)) {
+		verdict = e->verdict;
+		c->hit++;
+	} else {
+		c->miss++;
 	}
+	local_bh_enable();
+
+	return verdict;
 }
 
-static unsigned long jiffies_diff(unsigned long j1, unsigned long j2)
+/* gen is the generation seen before the lists were walked, so a verdict
+ * raced by a flush is stored already stale
+ */
+static void natcap_dst_cache_set(struct net *net, __be32 ip, unsigned char protocol, int verdict, unsigned int gen)
 {
-	return (j1 > j2) ? (j1 - j2) : (j2 - j1);
+	struct natcap_dst_cache_entry *e;
+
+	if (dst_cache_timeout == 0 || !net_eq(net, &init_net))
+		return;
+
+	local_bh_disable();
+	e = natcap_dst_cache_slot(this_cpu_ptr(&natcap_dst_cache), ip, protocol);
+	e->ip = ip;
+	e->protocol = protocol;
+	e->verdict = verdict;
+	e->gen = gen;
+	e->expires = jiffies + dst_cache_timeout * HZ;
+	local_bh_enable();
 }
 
-#define MAX_NATCAP_SERVER 64
-struct natcap_server_info {
-	unsigned int active_index;
-	unsigned int server_count[2];
-	struct tuple server[2][MAX_NATCAP_SERVER];
-	unsigned long last_active[MAX_NATCAP_SERVER];
-#define NATCAP_SERVER_IN 0
-#define NATCAP_SERVER_OUT 1
-	unsigned char last_dir[MAX_NATCAP_SERVER];
+void natcap_dst_cache_flush(void)
+{
+	atomic_inc(&natcap_dst_cache_gen);
+}
+
+void natcap_dst_cache_invalidate(__be32 ip)
+{
+	atomic_inc(natcap_dst_cache_ip_gen_slot(ip));
+}
+
+void natcap_dst_cache_stat_get(unsigned long long *hit, unsigned long long *miss)
+{
+	int cpu;
+
+	*hit = 0;
+	*miss = 0;
+	for_each_possible_cpu(cpu) {
+		struct natcap_dst_cache *c = per_cpu_ptr(&natcap_dst_cache, cpu);
+		*hit += c->hit;
+		*miss += c->miss;
+	}
+}
+
+/* domain suffix routing: names loaded with domain_add are matched against the
+ * question of every DNS answer passing natcap_client_pre_master_in_hook, one
+ * hash probe per label of the name, so the cost does not grow with the list.
+ * The A records of a matching answer are remembered for their TTL and new
+ * connections to them take the proxy verdict directly
+ */
+struct natcap_domain_entry {
+	u32 hash;
+	u32 next;
+	u32 off;
+	u32 len;
 };
 
-static struct natcap_server_info natcap_server_info;
-static unsigned int server_index = 0;
+struct natcap_domain_table {
+	unsigned int nr;
+	unsigned int mask;
+	u32 *bucket;
+	struct natcap_domain_entry *e;
+	char *pool;
+};
 
-void natcap_server_info_change(int change)
+static struct natcap_domain_table __rcu *natcap_domain_table = NULL;
+static char *natcap_domain_stage = NULL;
+static unsigned int natcap_domain_stage_nr = 0;
+static unsigned int natcap_domain_stage_len = 0;
+static unsigned int natcap_domain_stage_size = 0;
+static DEFINE_MUTEX(natcap_domain_mutex);
+
+int natcap_domain_add(const char *name)
 {
-	static unsigned long server_jiffies = 0;
-	if (change || server_jiffies == 0 || time_after(jiffies, server_jiffies + (7 * server_persist_timeout / 8 + jiffies % (server_persist_timeout / 4 + 1)) * HZ)) {
-		server_jiffies = jiffies;
-		server_index += 1 + prandom_u32();
+	int ret = 0;
+	unsigned int i, len;
+
+	while (*name == '.')
+		name++;
+	len = strlen(name);
+	while (len > 0 && (name[len - 1] == '.' || isspace(name[len - 1])))
+		len--;
+	if (len == 0 || len > 253)
+		return -EINVAL;
+
+	mutex_lock(&natcap_domain_mutex);
+	if (natcap_domain_stage_len + len + 1 > natcap_domain_stage_size) {
+		unsigned int size = natcap_domain_stage_size ? natcap_domain_stage_size * 2 : 65536;
+		char *p = vmalloc(size);
+		if (!p) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		if (natcap_domain_stage) {
+			memcpy(p, natcap_domain_stage, natcap_domain_stage_len);
+			vfree(natcap_domain_stage);
+		}
+		natcap_domain_stage = p;
+		natcap_domain_stage_size = size;
 	}
+	for (i = 0; i < len; i++) {
+		natcap_domain_stage[natcap_domain_stage_len + i] = tolower(name[i]);
+	}
+	natcap_domain_stage[natcap_domain_stage_len + len] = 0;
+	natcap_domain_stage_len += len + 1;
+	natcap_domain_stage_nr++;
+out:
+	mutex_unlock(&natcap_domain_mutex);
+	return ret;
 }
 
-void natcap_server_info_cleanup(void)
+static struct natcap_domain_table *natcap_domain_build(const char *pool, unsigned int pool_len, unsigned int nr)
 {
-	struct natcap_server_info *nsi = &natcap_server_info;
-	unsigned int m = nsi->active_index;
-	unsigned int n = (m + 1) % 2;
+	unsigned int i, off, nr_bucket;
+	struct natcap_domain_table *t;
+
+	nr_bucket = roundup_pow_of_two(max_t(unsigned int, nr, 256));
+	t = vmalloc(sizeof(*t) + nr_bucket * sizeof(u32) + nr * sizeof(struct natcap_domain_entry) + pool_len);
+	if (!t)
+		return NULL;
+	t->nr = nr;
+	t->mask = nr_bucket - 1;
+	t->bucket = (void *)(t + 1);
+	t->e = (void *)(t->bucket + nr_bucket);
+	t->pool = (void *)(t->e + nr);
+	memset(t->bucket, 0, nr_bucket * sizeof(u32));
+	memcpy(t->pool, pool, pool_len);
+
+	for (i = 0, off = 0; i < nr; i++) {
+		struct natcap_domain_entry *e = &t->e[i];
+		e->off = off;
+		e->len = strlen(t->pool + off);
+		e->hash = jhash(t->pool + off, e->len, 0);
+		e->next = t->bucket[e->hash & t->mask];
+		t->bucket[e->hash & t->mask] = i + 1;
+		off += e->len + 1;
+	}
 
-	nsi->server_count[m] = 0;
-	nsi->server_count[n] = 0;
-	nsi->active_index = n;
+	return t;
 }
 
-int natcap_server_info_add(const struct tuple *dst)
+static void natcap_domain_swap(struct natcap_domain_table *t)
 {
-	struct natcap_server_info *nsi = &natcap_server_info;
-	unsigned int m = nsi->active_index;
-	unsigned int n = (m + 1) % 2;
-	unsigned int i, j;
+	struct natcap_domain_table *old;
 
-	if (nsi->server_count[m] == MAX_NATCAP_SERVER)
-		return -ENOSPC;
+	old = rcu_dereference_protected(natcap_domain_table, lockdep_is_held(&natcap_domain_mutex));
+	rcu_assign_pointer(natcap_domain_table, t);
+	if (old) {
+		synchronize_rcu();
+		vfree(old);
+	}
+}
 
-	for (i = 0; i < nsi->server_count[m]; i++) {
-		if (tuple_eq(&nsi->server[m][i], dst)) {
-			return -EEXIST;
-		}
+static void natcap_domain_stage_free(void)
+{
+	if (natcap_domain_stage) {
+		vfree(natcap_domain_stage);
+		natcap_domain_stage = NULL;
 	}
+	natcap_domain_stage_nr = 0;
+	natcap_domain_stage_len = 0;
+	natcap_domain_stage_size = 0;
+}
 
-	/* all dst(s) are stored from MAX to MIN */
-	j = 0;
-	for (i = 0; i < nsi->server_count[m] && tuple_lt(dst, &nsi->server[m][i]); i++) {
-		tuple_copy(&nsi->server[n][j++], &nsi->server[m][i]);
+int natcap_domain_commit(void)
+{
+	struct natcap_domain_table *t;
+
+	mutex_lock(&natcap_domain_mutex);
+	if (natcap_domain_stage_nr == 0) {
+		mutex_unlock(&natcap_domain_mutex);
+		return -ENOENT;
 	}
-	tuple_copy(&nsi->server[n][j++], dst);
-	for (; i < nsi->server_count[m]; i++) {
-		tuple_copy(&nsi->server[n][j++], &nsi->server[m][i]);
+	t = natcap_domain_build(natcap_domain_stage, natcap_domain_stage_len, natcap_domain_stage_nr);
+	natcap_domain_stage_free();
+	if (!t) {
+		mutex_unlock(&natcap_domain_mutex);
+		return -ENOMEM;
+	}
+	NATCAP_println("domain table loaded: %u suffixes", t->nr);
+	natcap_domain_swap(t);
+	mutex_unlock(&natcap_domain_mutex);
+
+	return 0;
+}
+
+void natcap_domain_clean(void)
+{
+	mutex_lock(&natcap_domain_mutex);
+	natcap_domain_stage_free();
+	natcap_domain_swap(NULL);
+	mutex_unlock(&natcap_domain_mutex);
+}
+
+unsigned int natcap_domain_count(void)
+{
+	unsigned int n = 0;
+	struct natcap_domain_table *t;
+
+	rcu_read_lock();
+	t = rcu_dereference(natcap_domain_table);
+	if (t) {
+		n = t->nr;
 	}
+	rcu_read_unlock();
+
+	return n;
+}
 
-	nsi->server_count[n] = j;
-	nsi->active_index = n;
+static int natcap_domain_table_lookup(const struct natcap_domain_table *t, const char *s, unsigned int len)
+{
+	u32 hash = jhash(s, len, 0);
+	u32 i = t->bucket[hash & t->mask];
 
+	while (i) {
+		const struct natcap_domain_entry *e = &t->e[i - 1];
+		if (e->hash == hash && e->len == len && memcmp(t->pool + e->off, s, len) == 0) {
+			return 1;
+		}
+		i = e->next;
+	}
 	return 0;
 }
 
-int natcap_server_info_delete(const struct tuple *dst)
+/* name is as returned by get_rdata(): dotted, with a trailing dot */
+static int natcap_domain_match(char *name, int len)
 {
-	struct natcap_server_info *nsi = &natcap_server_info;
-	unsigned int m = nsi->active_index;
-	unsigned int n = (m + 1) % 2;
-	unsigned int i, j;
+	int i, ret = 0;
+	struct natcap_domain_table *t;
 
-	j = 0;
-	for (i = 0; i < nsi->server_count[m]; i++) {
-		if (tuple_eq(&nsi->server[m][i], dst)) {
-			continue;
+	while (len > 0 && name[len - 1] == '.')
+		len--;
+	if (len <= 0)
+		return 0;
+	for (i = 0; i < len; i++) {
+		name[i] = tolower(name[i]);
+	}
+
+	rcu_read_lock();
+	t = rcu_dereference(natcap_domain_table);
+	if (t) {
+		i = 0;
+		while (i < len) {
+			if (natcap_domain_table_lookup(t, name + i, len - i)) {
+				ret = 1;
+				break;
+			}
+			while (i < len && name[i] != '.')
+				i++;
+			i++;
 		}
-		tuple_copy(&nsi->server[n][j++], &nsi->server[m][i]);
 	}
-	if (j == i)
-		return -ENOENT;
+	rcu_read_unlock();
+
+	return ret;
+}
+
+/* optional classifier: a pinned BPF_PROG_TYPE_SOCKET_FILTER program that
+ * sees the first packet of a new flow from the IP header on and returns one
+ * of NATCAP_VERDICT_*, the built-in chain runs when it returns
+ * NATCAP_VERDICT_DEFAULT or nothing is loaded. Its verdicts are per tuple and
+ * are not kept in the destination cache, and NATCAP_VERDICT_RACE always races:
+ * the winners learned per destination only apply to the built-in chain
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 14, 0)
+static struct bpf_prog __rcu *natcap_classifier_prog = NULL;
+static DEFINE_MUTEX(natcap_classifier_lock);
+
+int natcap_classifier_load(const char *path)
+{
+	struct bpf_prog *prog, *old;
+
+	if (path) {
+		prog = bpf_prog_get_type_path(path, BPF_PROG_TYPE_SOCKET_FILTER);
+		if (IS_ERR(prog))
+			return PTR_ERR(prog);
+	} else {
+		prog = NULL;
+	}
 
-	nsi->server_count[n] = j;
+	mutex_lock(&natcap_classifier_lock);
+	old = rcu_dereference_protected(natcap_classifier_prog, lockdep_is_held(&natcap_classifier_lock));
+	rcu_assign_pointer(natcap_classifier_prog, prog);
+	mutex_unlock(&natcap_classifier_lock);
 
-	nsi->active_index = n;
+	if (old) {
+		synchronize_rcu();
+		bpf_prog_put(old);
+	}
 
 	return 0;
 }
 
-const struct tuple *natcap_server_info_current(void)
+int natcap_classifier_loaded(void)
 {
-	int count = natcap_server_info.server_count[natcap_server_info.active_index];
-	static struct tuple _tuple = {0};
-	if (count > 0)
-		return &natcap_server_info.server[natcap_server_info.active_index][server_index % count];
-	return &_tuple;
+	return rcu_access_pointer(natcap_classifier_prog) != NULL;
 }
 
-void *natcap_server_info_get(loff_t idx)
+static int natcap_classifier_run(struct sk_buff *skb)
 {
-	if (idx < natcap_server_info.server_count[natcap_server_info.active_index])
-		return &natcap_server_info.server[natcap_server_info.active_index][idx];
-	return NULL;
+	struct bpf_prog *prog;
+	unsigned int ret = NATCAP_VERDICT_DEFAULT;
+
+	rcu_read_lock();
+	prog = rcu_dereference(natcap_classifier_prog);
+	if (prog) {
+		ret = bpf_prog_run_save_cb(prog, skb);
+	}
+	rcu_read_unlock();
+
+	switch (ret) {
+		case NATCAP_VERDICT_KNOCK:
+			return NATCAP_DST_KNOCK;
+		case NATCAP_VERDICT_BYPASS:
+			return NATCAP_DST_BYPASS;
+		case NATCAP_VERDICT_PROXY:
+			return NATCAP_DST_PROXY;
+		case NATCAP_VERDICT_RACE:
+			return NATCAP_DST_DUAL;
+		case NATCAP_VERDICT_REDIRECT:
+			return NATCAP_DST_REDIRECT;
+	}
+	return NATCAP_DST_MISS;
+}
+#else
+int natcap_classifier_load(const char *path)
+{
+	return path ? -EOPNOTSUPP : 0;
 }
 
-void natcap_server_in_touch(__be32 ip)
+int natcap_classifier_loaded(void)
+{
+	return 0;
+}
+
+static inline int natcap_classifier_run(struct sk_buff *skb)
+{
+	return NATCAP_DST_MISS;
+}
+#endif
+
+/* small fixed-size address tables, 4-way set associative, the entry that
+ * expires first gives way when a set is full. Lookups run on every new
+ * flow from every cpu, so readers only retry on a racing write and never
+ * take the lock
+ */
+#define NATCAP_IP_CACHE_BITS 11
+#define NATCAP_IP_CACHE_WAYS 4
+
+struct natcap_ip_cache_entry {
+	__be32 ip;
+	unsigned int value;
+	unsigned long expires;
+};
+
+struct natcap_ip_cache {
+	seqlock_t lock;
+	unsigned long long evicted;
+	struct natcap_ip_cache_entry set[1 << NATCAP_IP_CACHE_BITS][NATCAP_IP_CACHE_WAYS];
+};
+
+/* return 1 when ip was not there or carried another value */
+static int natcap_ip_cache_set(struct natcap_ip_cache *c, __be32 ip, unsigned int value, unsigned long expires)
+{
+	int i, victim = 0;
+	int changed = 1;
+	struct natcap_ip_cache_entry *set;
+
+	if (ip == 0)
+		return 0;
+
+	write_seqlock_bh(&c->lock);
+	set = c->set[hash_32((__force u32)ip, NATCAP_IP_CACHE_BITS)];
+	for (i = 0; i < NATCAP_IP_CACHE_WAYS; i++) {
+		if (set[i].ip == ip) {
+			changed = set[i].value != value || !time_before(jiffies, set[i].expires);
+			victim = i;
+			break;
+		}
+		if (time_before(set[i].expires, set[victim].expires)) {
+			victim = i;
+		}
+	}
+	if (i == NATCAP_IP_CACHE_WAYS && set[victim].ip != 0 && time_before(jiffies, set[victim].expires)) {
+		c->evicted++;
+	}
+	set[victim].ip = ip;
+	set[victim].value = value;
+	set[victim].expires = expires;
+	write_sequnlock_bh(&c->lock);
+
+	return changed;
+}
+
+/* return the value stored for ip, 0 when there is none */
+static unsigned int natcap_ip_cache_get(struct natcap_ip_cache *c, __be32 ip)
 {
-	struct natcap_server_info *nsi = &natcap_server_info;
-	unsigned int m = nsi->active_index;
-	unsigned int count = nsi->server_count[m];
-	unsigned int hash;
 	int i;
+	unsigned int seq;
+	unsigned int value;
+	struct natcap_ip_cache_entry *set = c->set[hash_32((__force u32)ip, NATCAP_IP_CACHE_BITS)];
+
+	do {
+		seq = read_seqbegin(&c->lock);
+		value = 0;
+		for (i = 0; i < NATCAP_IP_CACHE_WAYS; i++) {
+			if (set[i].ip == ip && set[i].expires && time_before(jiffies, set[i].expires)) {
+				value = set[i].value;
+				break;
+			}
+		}
+	} while (read_seqretry(&c->lock, seq));
+
+	return value;
+}
+
+/* addresses learned from answers of a matching domain */
+#define NATCAP_DOMAIN_IP_TTL_MIN 60
+
+static struct natcap_ip_cache natcap_domain_ip = {
+	.lock = __SEQLOCK_UNLOCKED(natcap_domain_ip.lock),
+};
+
+static void natcap_domain_ip_add(__be32 ip, unsigned int ttl)
+{
+	if (ttl < NATCAP_DOMAIN_IP_TTL_MIN)
+		ttl = NATCAP_DOMAIN_IP_TTL_MIN;
+	if (ttl > 86400)
+		ttl = 86400;
+
+	if (natcap_ip_cache_set(&natcap_domain_ip, ip, 1, jiffies + ttl * HZ)) {
+		natcap_dst_cache_invalidate(ip);
+	}
+}
+
+static int natcap_domain_ip_test(__be32 ip)
+{
+	return natcap_ip_cache_get(&natcap_domain_ip, ip);
+}
+
+/* dual-out race winners: the path that answered first for a destination is
+ * remembered for race_learn_timeout seconds, and new flows to it go that way
+ * alone. Once the entry ages out the next flow races again, which
+ * re-validates the winner
+ */
+enum {
+	NATCAP_RACE_NONE = 0,
+	NATCAP_RACE_DIRECT,
+	NATCAP_RACE_PROXY,
+};
+
+unsigned int race_learn_timeout = 300;
+
+static struct natcap_ip_cache natcap_race = {
+	.lock = __SEQLOCK_UNLOCKED(natcap_race.lock),
+};
 
-	if (count == 0)
+struct natcap_race_stat {
+	unsigned long long learned;
+	unsigned long long avoided;
+};
+static DEFINE_PER_CPU(struct natcap_race_stat, natcap_race_stat);
+
+static void natcap_race_learn(__be32 ip, unsigned int winner)
+{
+	if (race_learn_timeout == 0)
 		return;
 
-	hash = server_index % count;
+	if (natcap_ip_cache_set(&natcap_race, ip, winner, jiffies + race_learn_timeout * HZ)) {
+		this_cpu_inc(natcap_race_stat.learned);
+	}
+}
 
-	for (i = hash; i < count; i++) {
-		if (nsi->server[m][i].ip == ip) {
-			if (nsi->last_dir[i] != NATCAP_SERVER_IN)
-				nsi->last_dir[i] = NATCAP_SERVER_IN;
-			return;
-		}
+static unsigned int natcap_race_winner(__be32 ip)
+{
+	unsigned int winner;
+
+	if (race_learn_timeout == 0)
+		return NATCAP_RACE_NONE;
+
+	winner = natcap_ip_cache_get(&natcap_race, ip);
+	if (winner != NATCAP_RACE_NONE) {
+		this_cpu_inc(natcap_race_stat.avoided);
+	}
+	return winner;
+}
+
+void natcap_race_stat_get(unsigned long long *learned, unsigned long long *avoided, unsigned long long *evicted)
+{
+	int cpu;
+
+	*learned = 0;
+	*avoided = 0;
+	for_each_possible_cpu(cpu) {
+		struct natcap_race_stat *st = per_cpu_ptr(&natcap_race_stat, cpu);
+		*learned += st->learned;
+		*avoided += st->avoided;
+	}
+	*evicted = natcap_race.evicted;
+}
+
+/* direct-to-proxy fallback: a bypassed TCP connect that has seen no answer
+ * syn_fallback_ms after its first SYN turns into a dual-out race, its SYN is
+ * sent again through POST_ROUTING and natcap_client_post_master_out_hook
+ * adds the proxied attempt. Whichever side answers first is kept.
+ * cniplist destinations are never armed
+ */
+#define NATCAP_SYN_FALLBACK_MAX 256
+
+unsigned int syn_fallback_ms = 300;
+
+/* hand unlisted web connects from the LAN to natcapd-client on
+ * natcap_redirect_port, it reads the first payload for SNI/Host and connects
+ * out with a NATCAP_BIND_MARK_* socket mark that picks the path
+ */
+unsigned int late_bind = 0;
+
+struct natcap_syn_fallback {
+	struct list_head list;
+	struct sk_buff *skb;
+	unsigned long deadline;
+};
+
+static LIST_HEAD(natcap_syn_fallback_list);
+static DEFINE_SPINLOCK(natcap_syn_fallback_lock);
+static unsigned int natcap_syn_fallback_pending = 0;
+static struct timer_list natcap_syn_fallback_timer;
+
+struct natcap_syn_fallback_stat {
+	unsigned long long launched;
+	unsigned long long answered;
+};
+static DEFINE_PER_CPU(struct natcap_syn_fallback_stat, natcap_syn_fallback_stat);
+
+/* the copy natcap_syn_fallback_fire is sending, post out sees it on this CPU
+ * before dst_output returns and must not count it as a retransmit
+ */
+static DEFINE_PER_CPU(struct sk_buff *, natcap_syn_fallback_skb);
+
+static inline int natcap_syn_fallback_resent(struct sk_buff *skb)
+{
+	return this_cpu_read(natcap_syn_fallback_skb) == skb;
+}
+
+static void natcap_syn_fallback_fire(struct sk_buff *skb)
+{
+	enum ip_conntrack_info ctinfo;
+	struct nf_conn *ct;
+	struct dst_entry *dst;
+
+	ct = nf_ct_get(skb, &ctinfo);
+	dst = skb_dst(skb);
+	if (!ct || !dst || nf_ct_is_dying(ct) || (IPS_NATCAP_ACK & ct->status)) {
+		consume_skb(skb);
+		return;
+	}
+	if (test_bit(IPS_SEEN_REPLY_BIT, &ct->status)) {
+		/* direct path answered in time */
+		set_bit(IPS_NATCAP_ACK_BIT, &ct->status);
+		this_cpu_inc(natcap_syn_fallback_stat.answered);
+		consume_skb(skb);
+		return;
 	}
-	for (i = 0; i < hash; i++) {
-		if (nsi->server[m][i].ip == ip) {
-			if (nsi->last_dir[i] != NATCAP_SERVER_IN)
-				nsi->last_dir[i] = NATCAP_SERVER_IN;
-			return;
+
+	set_bit(IPS_NATCAP_SYN_BIT, &ct->status);
+	this_cpu_inc(natcap_syn_fallback_stat.launched);
+
+	rcu_read_lock();
+	this_cpu_write(natcap_syn_fallback_skb, skb);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 4, 0)
+	dst_output(skb);
+#else
+	dst_output(dev_net(dst->dev), skb->sk, skb);
+#endif
+	this_cpu_write(natcap_syn_fallback_skb, NULL);
+	rcu_read_unlock();
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 15, 0)
+static void natcap_syn_fallback_timer_fn(unsigned long data)
+#else
+static void natcap_syn_fallback_timer_fn(struct timer_list *t)
+#endif
+{
+	struct natcap_syn_fallback *fb, *n;
+	LIST_HEAD(fired);
+
+	spin_lock_bh(&natcap_syn_fallback_lock);
+	list_for_each_entry_safe(fb, n, &natcap_syn_fallback_list, list) {
+		if (time_before(jiffies, fb->deadline)) {
+			/* list is kept in deadline order */
+			mod_timer(&natcap_syn_fallback_timer, fb->deadline);
+			break;
 		}
+		list_move_tail(&fb->list, &fired);
+		natcap_syn_fallback_pending--;
+	}
+	spin_unlock_bh(&natcap_syn_fallback_lock);
+
+	list_for_each_entry_safe(fb, n, &fired, list) {
+		list_del(&fb->list);
+		natcap_syn_fallback_fire(fb->skb);
+		kfree(fb);
+	}
+}
+
+/* keep a copy of the first SYN of a bypassed connect, return 0 when armed */
+static int natcap_syn_fallback_arm(struct sk_buff *skb)
+{
+	struct natcap_syn_fallback *fb;
+	unsigned long delay;
+
+	delay = msecs_to_jiffies(syn_fallback_ms);
+	if (delay == 0)
+		delay = 1;
+
+	fb = kmalloc(sizeof(struct natcap_syn_fallback), GFP_ATOMIC);
+	if (!fb)
+		return -ENOMEM;
+	fb->skb = skb_copy(skb, GFP_ATOMIC);
+	if (!fb->skb) {
+		kfree(fb);
+		return -ENOMEM;
+	}
+	/* the route may be held without a reference, it has to outlive the timer */
+	skb_dst_force(fb->skb);
+	if (!skb_dst(fb->skb)) {
+		consume_skb(fb->skb);
+		kfree(fb);
+		return -ENETUNREACH;
+	}
+	fb->deadline = jiffies + delay;
+
+	spin_lock_bh(&natcap_syn_fallback_lock);
+	if (natcap_syn_fallback_pending >= NATCAP_SYN_FALLBACK_MAX) {
+		spin_unlock_bh(&natcap_syn_fallback_lock);
+		consume_skb(fb->skb);
+		kfree(fb);
+		return -ENOSPC;
+	}
+	/* same delay for everyone, appending keeps deadline order */
+	list_add_tail(&fb->list, &natcap_syn_fallback_list);
+	natcap_syn_fallback_pending++;
+	if (!timer_pending(&natcap_syn_fallback_timer)) {
+		mod_timer(&natcap_syn_fallback_timer, fb->deadline);
+	}
+	spin_unlock_bh(&natcap_syn_fallback_lock);
+
+	return 0;
+}
+
+static void natcap_syn_fallback_init(void)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 15, 0)
+	setup_timer(&natcap_syn_fallback_timer, natcap_syn_fallback_timer_fn, 0);
+#else
+	timer_setup(&natcap_syn_fallback_timer, natcap_syn_fallback_timer_fn, 0);
+#endif
+}
+
+static void natcap_syn_fallback_exit(void)
+{
+	struct natcap_syn_fallback *fb, *n;
+
+	del_timer_sync(&natcap_syn_fallback_timer);
+
+	spin_lock_bh(&natcap_syn_fallback_lock);
+	list_for_each_entry_safe(fb, n, &natcap_syn_fallback_list, list) {
+		list_del(&fb->list);
+		consume_skb(fb->skb);
+		kfree(fb);
+	}
+	natcap_syn_fallback_pending = 0;
+	spin_unlock_bh(&natcap_syn_fallback_lock);
+}
+
+void natcap_syn_fallback_stat_get(unsigned long long *launched, unsigned long long *answered)
+{
+	int cpu;
+
+	*launched = 0;
+	*answered = 0;
+	for_each_possible_cpu(cpu) {
+		struct natcap_syn_fallback_stat *st = per_cpu_ptr(&natcap_syn_fallback_stat, cpu);
+		*launched += st->launched;
+		*answered += st->answered;
+	}
+}
+
+/* DNS answer cache: LAN queries are answered from here while the TTL of the
+ * stored answer lasts, and identical queries arriving while the first one is
+ * still upstream wait for its answer instead of going out again. Waiters are
+ * released by any answer to the leader, also one that is not stored.
+ * Entries are keyed by question and upstream server, are fixed size and their
+ * number is bounded, the least recently used one is evicted first
+ */
+#define NATCAP_DNS_CACHE_BITS 8
+#define NATCAP_DNS_CACHE_MAX 1024
+#define NATCAP_DNS_MSG_MAX 512
+/* a name is at most 255 bytes with its length octets and the root label
+ * (RFC 1035), the key adds qtype/qclass and the server ip/port
+ */
+#define NATCAP_DNS_NAME_MAX 255
+#define NATCAP_DNS_KEY_MAX (NATCAP_DNS_NAME_MAX + 4 + 6)
+#define NATCAP_DNS_TTL_NR 16
+#define NATCAP_DNS_TTL_MAX 3600
+#define NATCAP_DNS_WAITER_NR 8
+#define NATCAP_DNS_PENDING_TIMEOUT (2 * HZ)
+
+struct natcap_dns_cache_entry {
+	struct hlist_node hnode;
+	struct list_head lru;
+	u32 hash;
+	unsigned short klen;
+	unsigned short len;
+	unsigned char key[NATCAP_DNS_KEY_MAX];
+	unsigned long pending; /* jiffies the leader query went upstream, 0 if none */
+	__be32 leader_ip;
+	__be16 leader_port;
+	unsigned long stored;
+	unsigned long expires;
+	unsigned int nr_ttl;
+	unsigned short ttl_off[NATCAP_DNS_TTL_NR];
+	unsigned int ttl[NATCAP_DNS_TTL_NR];
+	unsigned int nr_waiter;
+	struct sk_buff *waiter[NATCAP_DNS_WAITER_NR];
+	unsigned char msg[NATCAP_DNS_MSG_MAX];
+};
+
+unsigned int dns_cache = 1;
+
+static struct hlist_head natcap_dns_cache_hash[1 << NATCAP_DNS_CACHE_BITS];
+static LIST_HEAD(natcap_dns_cache_lru);
+static unsigned int natcap_dns_cache_nr = 0;
+static DEFINE_SPINLOCK(natcap_dns_cache_lock);
+
+static unsigned long long natcap_dns_cache_hit = 0;
+static unsigned long long natcap_dns_cache_miss = 0;
+static unsigned long long natcap_dns_cache_coalesced = 0;
+static unsigned long long natcap_dns_cache_evicted = 0;
+
+/* copy the question into key, lowercased, and return its end or -1 */
+static int natcap_dns_question_key(const unsigned char *p, int len, unsigned char *key, unsigned short *klen)
+{
+	int pos = 12;
+	int k = 0;
+	unsigned int v;
+
+	while (pos < len && (v = get_byte1(p + pos)) != 0) {
+		/* the labels leave room for the root label */
+		if (v > 0x3F || pos + v >= len || k + v + 1 > NATCAP_DNS_NAME_MAX - 1) {
+			return -1;
+		}
+		key[k++] = v;
+		for (pos++; v > 0; v--, pos++) {
+			key[k++] = tolower(p[pos]);
+		}
+	}
+	if (pos + 4 >= len) {
+		return -1;
+	}
+	key[k++] = 0;
+	memcpy(key + k, p + pos + 1, 4);
+	k += 4;
+	*klen = k;
+
+	return pos + 5;
+}
+
+/* the same question may get different answers from different servers */
+static inline int natcap_dns_key_server(unsigned char *key, unsigned short *klen, __be32 ip, __be16 port)
+{
+	if (*klen + 6 > NATCAP_DNS_KEY_MAX) {
+		return -1;
+	}
+	memcpy(key + *klen, &ip, 4);
+	memcpy(key + *klen + 4, &port, 2);
+	*klen += 6;
+
+	return 0;
+}
+
+static struct natcap_dns_cache_entry *natcap_dns_cache_find(const unsigned char *key, unsigned short klen, u32 hash)
+{
+	struct hlist_node *pos;
+	struct natcap_dns_cache_entry *e;
+
+	for (pos = natcap_dns_cache_hash[hash & ((1 << NATCAP_DNS_CACHE_BITS) - 1)].first; pos; pos = pos->next) {
+		e = hlist_entry(pos, struct natcap_dns_cache_entry, hnode);
+		if (e->hash == hash && e->klen == klen && memcmp(e->key, key, klen) == 0) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+static void natcap_dns_cache_waiters_free(struct natcap_dns_cache_entry *e)
+{
+	unsigned int i;
+
+	for (i = 0; i < e->nr_waiter; i++) {
+		kfree_skb(e->waiter[i]);
+	}
+	e->nr_waiter = 0;
+}
+
+static void natcap_dns_cache_evict(struct natcap_dns_cache_entry *e)
+{
+	hlist_del(&e->hnode);
+	list_del(&e->lru);
+	natcap_dns_cache_waiters_free(e);
+	natcap_dns_cache_nr--;
+	kfree(e);
+}
+
+/* find or make room for the entry of key, called with the lock held */
+static struct natcap_dns_cache_entry *natcap_dns_cache_get(const unsigned char *key, unsigned short klen, u32 hash)
+{
+	struct natcap_dns_cache_entry *e = natcap_dns_cache_find(key, klen, hash);
+
+	if (e) {
+		list_move(&e->lru, &natcap_dns_cache_lru);
+		return e;
+	}
+
+	if (natcap_dns_cache_nr >= NATCAP_DNS_CACHE_MAX) {
+		natcap_dns_cache_evict(list_entry(natcap_dns_cache_lru.prev, struct natcap_dns_cache_entry, lru));
+		natcap_dns_cache_evicted++;
+	}
+	e = kmalloc(sizeof(*e), GFP_ATOMIC);
+	if (!e) {
+		return NULL;
+	}
+	memset(e, 0, offsetof(struct natcap_dns_cache_entry, msg));
+	e->hash = hash;
+	e->klen = klen;
+	memcpy(e->key, key, klen);
+	hlist_add_head(&e->hnode, &natcap_dns_cache_hash[hash & ((1 << NATCAP_DNS_CACHE_BITS) - 1)]);
+	list_add(&e->lru, &natcap_dns_cache_lru);
+	natcap_dns_cache_nr++;
+
+	return e;
+}
+
+/* turn the query oskb into the answer msg, sent back out of dev.
+ * The TTLs are aged when msg is the one stored in e
+ */
+static struct sk_buff *natcap_dns_cache_reply(const struct net_device *dev, struct sk_buff *oskb,
+		const unsigned char *msg, unsigned int len, const struct natcap_dns_cache_entry *e)
+{
+	struct sk_buff *nskb;
+	struct ethhdr *neth, *oeth;
+	struct iphdr *niph, *oiph;
+	struct udphdr *nudph, *oudph;
+	unsigned char *p;
+	unsigned int i, age;
+	int offset, header_len;
+
+	if (!dev || dev->type != ARPHRD_ETHER || !skb_mac_header_was_set(oskb)) {
+		return NULL;
+	}
+
+	oeth = (struct ethhdr *)skb_mac_header(oskb);
+	oiph = ip_hdr(oskb);
+	oudph = (struct udphdr *)((void *)oiph + oiph->ihl * 4);
+
+	offset = oiph->ihl * 4 + sizeof(struct udphdr) + len - oskb->len;
+	header_len = offset < 0 ? 0 : offset;
+	nskb = skb_copy_expand(oskb, skb_headroom(oskb), header_len, GFP_ATOMIC);
+	if (!nskb) {
+		NATCAP_ERROR(DEBUG_FMT_PREFIX "alloc_skb fail\n", DEBUG_ARG_PREFIX);
+		return NULL;
+	}
+	if (offset <= 0) {
+		if (pskb_trim(nskb, nskb->len + offset)) {
+			NATCAP_ERROR(DEBUG_FMT_PREFIX "pskb_trim fail: len=%d, offset=%d\n", DEBUG_ARG_PREFIX, nskb->len, offset);
+			consume_skb(nskb);
+			return NULL;
+		}
+	} else {
+		nskb->len += offset;
+		nskb->tail += offset;
+	}
+
+	neth = eth_hdr(nskb);
+	memcpy(neth->h_dest, oeth->h_source, ETH_ALEN);
+	memcpy(neth->h_source, oeth->h_dest, ETH_ALEN);
+
+	niph = ip_hdr(nskb);
+	niph->saddr = oiph->daddr;
+	niph->daddr = oiph->saddr;
+	niph->tot_len = htons(nskb->len);
+	niph->ttl = 0x80;
+	niph->frag_off = 0x0;
+	niph->check = 0;
+	niph->check = ip_fast_csum((unsigned char *)niph, niph->ihl);
+
+	nudph = (struct udphdr *)((void *)niph + niph->ihl * 4);
+	nudph->source = oudph->dest;
+	nudph->dest = oudph->source;
+	nudph->len = htons(sizeof(struct udphdr) + len);
+	nudph->check = CSUM_MANGLED_0;
+
+	p = (unsigned char *)nudph + sizeof(struct udphdr);
+	memcpy(p + 2, msg + 2, len - 2);
+	/* p[0..1] still hold the id of the query */
+	if (e) {
+		age = (jiffies - e->stored) / HZ;
+		for (i = 0; i < e->nr_ttl; i++) {
+			set_byte4(p + e->ttl_off[i], htonl(e->ttl[i] > age ? e->ttl[i] - age : 0));
+		}
+	}
+
+	nskb->ip_summed = CHECKSUM_UNNECESSARY;
+	skb_rcsum_tcpudp(nskb);
+
+	skb_push(nskb, (char *)niph - (char *)neth);
+	nskb->dev = (struct net_device *)dev;
+
+	return nskb;
+}
+
+/* LAN query at PRE_ROUTING: NF_STOLEN when answered or queued on a pending
+ * lookup, NF_ACCEPT to let it go upstream
+ */
+static unsigned int natcap_dns_cache_query(const struct net_device *in, struct sk_buff *skb)
+{
+	int qend;
+	u32 hash;
+	unsigned short klen;
+	unsigned char key[NATCAP_DNS_KEY_MAX];
+	struct iphdr *iph;
+	struct udphdr *udph;
+	unsigned char *p;
+	int len;
+	struct sk_buff *nskb = NULL;
+	struct natcap_dns_cache_entry *e;
+
+	if (!pskb_may_pull(skb, skb->len)) {
+		return NF_ACCEPT;
+	}
+	iph = ip_hdr(skb);
+	udph = (struct udphdr *)((void *)iph + iph->ihl * 4);
+	p = (unsigned char *)udph + sizeof(struct udphdr);
+	len = skb->len - iph->ihl * 4 - sizeof(struct udphdr);
+
+	/* standard query with a single question */
+	if (len < 12 || (ntohs(get_byte2(p + 2)) & 0xF800) != 0 || ntohs(get_byte2(p + 4)) != 1) {
+		return NF_ACCEPT;
+	}
+	qend = natcap_dns_question_key(p, len, key, &klen);
+	if (qend < 0) {
+		return NF_ACCEPT;
+	}
+	if (natcap_dns_key_server(key, &klen, iph->daddr, udph->dest) != 0) {
+		return NF_ACCEPT;
+	}
+	hash = jhash(key, klen, 0);
+
+	spin_lock_bh(&natcap_dns_cache_lock);
+	e = natcap_dns_cache_get(key, klen, hash);
+	if (!e) {
+		natcap_dns_cache_miss++;
+		spin_unlock_bh(&natcap_dns_cache_lock);
+		return NF_ACCEPT;
+	}
+	if (e->stored && time_before(jiffies, e->expires)) {
+		nskb = natcap_dns_cache_reply(in, skb, e->msg, e->len, e);
+		if (nskb) {
+			natcap_dns_cache_hit++;
+			spin_unlock_bh(&natcap_dns_cache_lock);
+			dev_queue_xmit(nskb);
+			consume_skb(skb);
+			return NF_STOLEN;
+		}
+	}
+	natcap_dns_cache_miss++;
+	if (e->pending && time_before(jiffies, e->pending + NATCAP_DNS_PENDING_TIMEOUT)) {
+		/* a retransmit of the leader goes out again, its answer comes back on its own ct */
+		if (e->nr_waiter < NATCAP_DNS_WAITER_NR && in && in->type == ARPHRD_ETHER &&
+				(e->leader_ip != iph->saddr || e->leader_port != udph->source)) {
+			skb_nfct_reset(skb);
+			e->waiter[e->nr_waiter++] = skb;
+			natcap_dns_cache_coalesced++;
+			spin_unlock_bh(&natcap_dns_cache_lock);
+			return NF_STOLEN;
+		}
+		spin_unlock_bh(&natcap_dns_cache_lock);
+		return NF_ACCEPT;
+	}
+	/* this query leads, whoever waited on a lost one has retried by now */
+	natcap_dns_cache_waiters_free(e);
+	e->pending = jiffies | 1;
+	e->leader_ip = iph->saddr;
+	e->leader_port = udph->source;
+	spin_unlock_bh(&natcap_dns_cache_lock);
+
+	return NF_ACCEPT;
+}
+
+/* skip an owner name, which may end in a compression pointer */
+static int natcap_dns_skip_name(const unsigned char *p, int len, int pos)
+{
+	unsigned int v;
+
+	while (pos < len && (v = get_byte1(p + pos)) != 0) {
+		if (v > 0x3F) {
+			return pos + 2;
+		}
+		pos += v + 1;
+	}
+	return pos + 1;
+}
+
+/* collect the TTLs of the records after the question, return their number or -1 */
+static int natcap_dns_answer_ttls(const unsigned char *p, int len, int pos, unsigned short *ttl_off, unsigned int *ttl, unsigned int *min_ttl)
+{
+	int i;
+	unsigned int nr_rr, nr_ttl = 0;
+
+	*min_ttl = NATCAP_DNS_TTL_MAX;
+	nr_rr = ntohs(get_byte2(p + 6)) + ntohs(get_byte2(p + 8)) + ntohs(get_byte2(p + 10));
+	for (i = 0; i < nr_rr; i++) {
+		unsigned short type;
+
+		pos = natcap_dns_skip_name(p, len, pos);
+		if (pos + 10 > len) {
+			return -1;
+		}
+		type = ntohs(get_byte2(p + pos));
+		if (type != 41) { /* the ttl of OPT holds EDNS flags */
+			if (nr_ttl == NATCAP_DNS_TTL_NR) {
+				return -1;
+			}
+			ttl_off[nr_ttl] = pos + 4;
+			ttl[nr_ttl] = ntohl(get_byte4(p + pos + 4));
+			if (ttl[nr_ttl] < *min_ttl) {
+				*min_ttl = ttl[nr_ttl];
+			}
+			nr_ttl++;
+		}
+		pos += 10 + ntohs(get_byte2(p + pos + 8));
+	}
+	if (pos > len) {
+		return -1;
+	}
+
+	return nr_ttl;
+}
+
+/* answer accepted towards the LAN at pre_master_in for a query sent to
+ * server:port: remember it when it can be reused, and release the queries
+ * coalesced on it in any case, with the answer as it came
+ */
+static void natcap_dns_cache_store(struct sk_buff *skb, __be32 server, __be16 port)
+{
+	int i, qend, nr_ttl = 0;
+	int cacheable;
+	u32 hash;
+	unsigned short klen;
+	unsigned char key[NATCAP_DNS_KEY_MAX];
+	unsigned int min_ttl = 0;
+	unsigned short ttl_off[NATCAP_DNS_TTL_NR];
+	unsigned int ttl[NATCAP_DNS_TTL_NR];
+	unsigned int nr_waiter = 0;
+	struct sk_buff *waiter[NATCAP_DNS_WAITER_NR];
+	struct natcap_dns_cache_entry *e;
+	struct iphdr *iph;
+	struct udphdr *udph;
+	unsigned char *p;
+	int len;
+
+	iph = ip_hdr(skb);
+	udph = (struct udphdr *)((void *)iph + iph->ihl * 4);
+	len = ntohs(udph->len) - (int)sizeof(struct udphdr);
+	if (len < 12 || !pskb_may_pull(skb, iph->ihl * 4 + sizeof(struct udphdr) + len)) {
+		return;
+	}
+	iph = ip_hdr(skb);
+	udph = (struct udphdr *)((void *)iph + iph->ihl * 4);
+	p = (unsigned char *)udph + sizeof(struct udphdr);
+
+	/* response with a single question */
+	if ((ntohs(get_byte2(p + 2)) & 0x8000) != 0x8000 || ntohs(get_byte2(p + 4)) != 1) {
+		return;
+	}
+	qend = natcap_dns_question_key(p, len, key, &klen);
+	if (qend < 0) {
+		return;
+	}
+	if (natcap_dns_key_server(key, &klen, server, port) != 0) {
+		return;
+	}
+	hash = jhash(key, klen, 0);
+
+	/* not truncated, NOERROR, fits the entry, has records and none of them expired */
+	cacheable = 0;
+	if ((ntohs(get_byte2(p + 2)) & 0x820F) == 0x8000 && len <= NATCAP_DNS_MSG_MAX) {
+		nr_ttl = natcap_dns_answer_ttls(p, len, qend, ttl_off, ttl, &min_ttl);
+		cacheable = nr_ttl > 0 && min_ttl != 0;
+	}
+
+	spin_lock_bh(&natcap_dns_cache_lock);
+	if (cacheable) {
+		e = natcap_dns_cache_get(key, klen, hash);
+	} else {
+		e = natcap_dns_cache_find(key, klen, hash);
+	}
+	if (e) {
+		if (cacheable) {
+			e->len = len;
+			memcpy(e->msg, p, len);
+			e->nr_ttl = nr_ttl;
+			memcpy(e->ttl_off, ttl_off, sizeof(ttl_off[0]) * nr_ttl);
+			memcpy(e->ttl, ttl, sizeof(ttl[0]) * nr_ttl);
+			e->stored = jiffies;
+			e->expires = jiffies + min_ttl * HZ;
+		}
+		e->pending = 0;
+		for (i = 0; i < e->nr_waiter; i++) {
+			waiter[nr_waiter++] = e->waiter[i];
+		}
+		e->nr_waiter = 0;
+	}
+	spin_unlock_bh(&natcap_dns_cache_lock);
+
+	for (i = 0; i < nr_waiter; i++) {
+		/* waiters do not pin their device, look it up again, we are under rcu */
+		struct net_device *dev = dev_get_by_index_rcu(&init_net, waiter[i]->skb_iif);
+		struct sk_buff *nskb = natcap_dns_cache_reply(dev, waiter[i], p, len, NULL);
+
+		if (nskb) {
+			dev_queue_xmit(nskb);
+		}
+		consume_skb(waiter[i]);
+	}
+}
+
+void natcap_dns_cache_clean(void)
+{
+	struct natcap_dns_cache_entry *e, *n;
+
+	spin_lock_bh(&natcap_dns_cache_lock);
+	list_for_each_entry_safe(e, n, &natcap_dns_cache_lru, lru) {
+		natcap_dns_cache_evict(e);
+	}
+	spin_unlock_bh(&natcap_dns_cache_lock);
+}
+
+void natcap_dns_cache_stat_get(unsigned long long *hit, unsigned long long *miss, unsigned long long *coalesced, unsigned long long *evicted)
+{
+	spin_lock_bh(&natcap_dns_cache_lock);
+	*hit = natcap_dns_cache_hit;
+	*miss = natcap_dns_cache_miss;
+	*coalesced = natcap_dns_cache_coalesced;
+	*evicted = natcap_dns_cache_evicted;
+	spin_unlock_bh(&natcap_dns_cache_lock);
+}
+
+unsigned int macfilter = 0;
+const char *macfilter_acl_str[NATCAP_ACL_MAX] = {
+	[NATCAP_ACL_NONE] = "none",
+	[NATCAP_ACL_ALLOW] = "allow",
+	[NATCAP_ACL_DENY] = "deny"
+};
+
+unsigned int ipfilter = 0;
+const char *ipfilter_acl_str[NATCAP_ACL_MAX] = {
+	[NATCAP_ACL_NONE] = "none",
+	[NATCAP_ACL_ALLOW] = "allow",
+	[NATCAP_ACL_DENY] = "deny"
+};
+
+unsigned int encode_http_only = 0;
+unsigned int http_confusion = 0;
+unsigned int sproxy = 0;
+unsigned int dns_server = __constant_htonl((8<<24)|(8<<16)|(8<<8)|(8<<0));
+unsigned short dns_port = __constant_htons(53);
+
+u32 default_u_hash = 0;
+unsigned char default_mac_addr[ETH_ALEN];
+static void default_mac_addr_init(void)
+{
+	struct net_device *dev;
+
+	memset(default_mac_addr, 0, ETH_ALEN);
+	dev = first_net_device(&init_net);
+	while (dev) {
+		if (dev->type == ARPHRD_ETHER) {
+			memcpy(default_mac_addr, dev->dev_addr, ETH_ALEN);
+			break;
+		}
+		dev = next_net_device(dev);
+	}
+
+	dev = first_net_device(&init_net);
+	while (dev) {
+		if (strcmp("eth0", dev->name) == 0) {
+			memcpy(default_mac_addr, dev->dev_addr, ETH_ALEN);
+			break;
+		} else if (strcmp("eth1", dev->name) == 0) {
+			memcpy(default_mac_addr, dev->dev_addr, ETH_ALEN);
+			// sometimes we use eth1
+		}
+
+		dev = next_net_device(dev);
+	}
+}
+
+static unsigned long jiffies_diff(unsigned long j1, unsigned long j2)
+{
+	return (j1 > j2) ? (j1 - j2) : (j2 - j1);
+}
+
+/* the server table is rebuilt on every add/delete and published with RCU,
+ * readers never block. Servers are kept sorted from MAX to MIN so every
+ * client walks the same order, and an open-addressed hash of their ips
+ * answers is_natcap_server in constant time. The per-server state lives in
+ * the nodes, which survive rebuilds
+ */
+#define NATCAP_SERVER_MAX 4096
+
+/* per cpu telemetry of one server: the data path only adds to its own cpu,
+ * readers sum over the cpus without taking any lock
+ */
+struct natcap_server_stat {
+	unsigned long long flows_new;
+	unsigned long long flows_active; /* may go below 0 on a cpu, only the sum counts */
+	unsigned long long tx_bytes;
+	unsigned long long rx_bytes;
+	unsigned long long syn_timeouts;
+	unsigned long long rsts;
+	unsigned long long rtt_hist[NATCAP_SERVER_RTT_BUCKETS];
+};
+
+struct natcap_server_node {
+	struct tuple server;
+	unsigned long last_active;
+#define NATCAP_SERVER_IN 0
+#define NATCAP_SERVER_OUT 1
+	unsigned char last_dir;
+	unsigned int srtt_us; /* smoothed SYN to SYN-ACK time, 0 until sampled */
+	unsigned int loss; /* smoothed handshake failure rate, scaled to 1024 */
+	unsigned int fails; /* handshakes failed in a row */
+	unsigned long dead_until;
+	unsigned char affinity_log; /* weight bucket used by server_affinity */
+	u32 affinity_seed; /* hash of the server mixed into the pair hash */
+	unsigned long long race_won; /* SYN races this server answered first */
+	unsigned long rate_sec; /* second rate_cur counts new flows in */
+	unsigned int rate_cur;
+	unsigned int rate_last;
+	struct natcap_server_stat __percpu *stat;
+};
+
+struct natcap_server_table {
+	struct rcu_head rcu;
+	unsigned int count;
+	unsigned int hash_bits;
+	struct natcap_server_node **ip_hash;
+	struct natcap_server_node *node[0];
+};
+
+static struct natcap_server_table __rcu *natcap_server_table = NULL;
+static DEFINE_MUTEX(natcap_server_table_lock);
+static unsigned int server_index = 0;
+static int server_reselect = 0;
+
+void natcap_server_info_change(int change)
+{
+	static unsigned long server_jiffies = 0;
+	if (change || server_jiffies == 0 || time_after(jiffies, server_jiffies + (7 * server_persist_timeout / 8 + jiffies % (server_persist_timeout / 4 + 1)) * HZ)) {
+		server_jiffies = jiffies;
+		server_index += 1 + prandom_u32();
+		server_reselect = 1;
+	}
+}
+
+/* every handshake through a server feeds its stats: the SYN-ACK time into
+ * srtt_us, a retransmitted SYN into loss. server_dead_fails failures in a row
+ * take the server out of selection for server_dead_timeout seconds, after
+ * which the next flow through it probes it again
+ */
+unsigned int server_dead_timeout = 10;
+unsigned int server_dead_fails = 3;
+static DEFINE_PER_CPU(unsigned long long, server_evicted);
+
+#define NATCAP_SERVER_RTT_DEFAULT 200000
+#define NATCAP_SERVER_RTT_MAX 10000000
+
+static inline int natcap_server_node_dead(const struct natcap_server_node *node)
+{
+	return node->dead_until && time_before(jiffies, node->dead_until);
+}
+
+/* weight falls with the RTT in ms and with the failure rate */
+static unsigned int natcap_server_node_weight(const struct natcap_server_node *node)
+{
+	unsigned int srtt_us = node->srtt_us ? node->srtt_us : NATCAP_SERVER_RTT_DEFAULT;
+	unsigned int weight;
+
+	weight = (1U << 20) / (srtt_us / 1000 + 20);
+	weight = (weight * (1024 - node->loss)) >> 10;
+
+	return weight ? weight : 1;
+}
+
+/* weighted random pick among the live servers, -1 if all are dead */
+static int natcap_server_weighted_pick(const struct natcap_server_table *t)
+{
+	unsigned int i, total = 0;
+	unsigned int r;
+
+	for (i = 0; i < t->count; i++) {
+		if (!natcap_server_node_dead(t->node[i]))
+			total += natcap_server_node_weight(t->node[i]);
+	}
+	if (total == 0)
+		return -1;
+
+	r = prandom_u32() % total;
+	for (i = 0; i < t->count; i++) {
+		if (natcap_server_node_dead(t->node[i]))
+			continue;
+		if (r < natcap_server_node_weight(t->node[i]))
+			return i;
+		r -= natcap_server_node_weight(t->node[i]);
+	}
+
+	return -1;
+}
+
+void natcap_server_stat_get(unsigned long long *evicted)
+{
+	int cpu;
+
+	*evicted = 0;
+	for_each_possible_cpu(cpu) {
+		*evicted += *per_cpu_ptr(&server_evicted, cpu);
+	}
+}
+
+/* with server_affinity every (client, destination) pair is hashed onto the
+ * servers by weighted rendezvous hashing (natcap_affinity_key): each server
+ * scores weight / -log2(hash(client, destination, server)) and the highest
+ * score wins. Adding or removing a server only moves the pairs it wins or won.
+ * The weight is the handshake weight rounded down to a power of two, and a
+ * server only changes bucket once its weight is a quarter outside the current
+ * one, so RTT jitter around a power of two does not move pairs back and forth.
+ * A pair whose server is dead or unusable goes to the next server in its own
+ * ranking, and comes back once the server recovers.
+ * It is off by default: every new flow scores all servers, and it replaces
+ * the server_persist_timeout rotation, so change_server has no effect
+ */
+unsigned int server_affinity = 0;
+
+static void natcap_server_node_affinity_update(struct natcap_server_node *node)
+{
+	unsigned int weight = natcap_server_node_weight(node);
+	unsigned int b = node->affinity_log;
+
+	if (weight < ((3U << b) >> 2) || weight >= ((5U << b) >> 1))
+		node->affinity_log = ilog2(weight);
+}
+
+static inline int natcap_server_node_usable(const struct natcap_server_node *node)
+{
+	if (natcap_server_node_dead(node))
+		return 0;
+	return node->last_dir == NATCAP_SERVER_IN ||
+		jiffies_diff(jiffies, node->last_active) <= natcap_touch_timeout * HZ ||
+		jiffies_diff(jiffies, node->last_active) > 512 * HZ;
+}
+
+/* the best ranked usable server, else the best live one, else the best one */
+static unsigned int natcap_server_affinity_pick(const struct natcap_server_table *t, __be32 sip, __be32 dip)
+{
+	struct natcap_server_node *node;
+	unsigned int i, level, l;
+	u32 pair = jhash_2words((__force u32)sip, (__force u32)dip, 0);
+	u64 key, best_key[3] = { 0, 0, 0 };
+	int best[3] = { -1, -1, -1 };
+
+	for (i = 0; i < t->count; i++) {
+		node = t->node[i];
+		if (natcap_server_node_usable(node))
+			level = 0;
+		else if (!natcap_server_node_dead(node))
+			level = 1;
+		else
+			level = 2;
+		key = natcap_affinity_key(pair, node->affinity_seed, node->affinity_log);
+		for (l = level; l < 3; l++) {
+			if (best[l] < 0 || key < best_key[l]) {
+				best[l] = i;
+				best_key[l] = key;
+			}
+		}
+	}
+	for (l = 0; l < 3; l++) {
+		if (best[l] >= 0)
+			return best[l];
+	}
+
+	return 0;
+}
+
+static inline unsigned int natcap_syn_stamp_now(void)
+{
+	unsigned int now = (unsigned int)ktime_to_us(ktime_get());
+	return now ? now : 1;
+}
+
+static struct natcap_server_table *natcap_server_table_alloc(unsigned int count)
+{
+	struct natcap_server_table *t;
+	unsigned int bits = 4;
+
+	while ((1U << bits) < count * 2)
+		bits++;
+
+	t = vmalloc(sizeof(struct natcap_server_table) + sizeof(struct natcap_server_node *) * (count + (1U << bits)));
+	if (!t)
+		return NULL;
+	t->count = 0;
+	t->hash_bits = bits;
+	t->ip_hash = (struct natcap_server_node **)&t->node[count];
+	memset(t->ip_hash, 0, sizeof(struct natcap_server_node *) * (1U << bits));
+
+	return t;
+}
+
+static void natcap_server_table_append(struct natcap_server_table *t, struct natcap_server_node *node)
+{
+	unsigned int mask = (1U << t->hash_bits) - 1;
+	unsigned int h = hash_32((__force u32)node->server.ip, t->hash_bits);
+
+	t->node[t->count++] = node;
+	while (t->ip_hash[h])
+		h = (h + 1) & mask;
+	t->ip_hash[h] = node;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 10, 0)
+static void natcap_server_table_free_rcu(struct rcu_head *head)
+{
+	/* vfree defers itself when called from softirq */
+	vfree(container_of(head, struct natcap_server_table, rcu));
+}
+#endif
+
+/* swap in t, caller holds natcap_server_table_lock. The old table is freed
+ * after a grace period without waiting for it, so loading thousands of
+ * server lines does not wait for thousands of grace periods
+ */
+static void natcap_server_table_publish(struct natcap_server_table *t)
+{
+	struct natcap_server_table *old;
+
+	old = rcu_dereference_protected(natcap_server_table, lockdep_is_held(&natcap_server_table_lock));
+	rcu_assign_pointer(natcap_server_table, t);
+	if (old) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 10, 0)
+		call_rcu(&old->rcu, natcap_server_table_free_rcu);
+#else
+		synchronize_rcu();
+		vfree(old);
+#endif
+	}
+}
+
+void natcap_server_info_cleanup(void)
+{
+	struct natcap_server_table *old;
+	unsigned int i;
+
+	mutex_lock(&natcap_server_table_lock);
+	old = rcu_dereference_protected(natcap_server_table, lockdep_is_held(&natcap_server_table_lock));
+	rcu_assign_pointer(natcap_server_table, NULL);
+	if (old) {
+		synchronize_rcu();
+		for (i = 0; i < old->count; i++) {
+			free_percpu(old->node[i]->stat);
+			kfree(old->node[i]);
+		}
+		vfree(old);
+	}
+	/* tables retired by publish */
+	rcu_barrier();
+	mutex_unlock(&natcap_server_table_lock);
+}
+
+int natcap_server_info_add(const struct tuple *dst)
+{
+	struct natcap_server_table *m, *n;
+	struct natcap_server_node *node;
+	unsigned int i, count;
+	int ret = 0;
+
+	mutex_lock(&natcap_server_table_lock);
+	m = rcu_dereference_protected(natcap_server_table, lockdep_is_held(&natcap_server_table_lock));
+	count = m ? m->count : 0;
+
+	if (count == NATCAP_SERVER_MAX) {
+		ret = -ENOSPC;
+		goto out;
+	}
+	for (i = 0; i < count; i++) {
+		if (tuple_eq(&m->node[i]->server, dst)) {
+			ret = -EEXIST;
+			goto out;
+		}
+	}
+
+	node = kzalloc(sizeof(struct natcap_server_node), GFP_KERNEL);
+	if (!node) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	tuple_copy(&node->server, dst);
+	node->affinity_log = ilog2(natcap_server_node_weight(node));
+	node->affinity_seed = jhash_2words((__force u32)dst->ip, (__force u32)dst->port, 0);
+	node->stat = alloc_percpu(struct natcap_server_stat);
+	if (!node->stat) {
+		kfree(node);
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	n = natcap_server_table_alloc(count + 1);
+	if (!n) {
+		free_percpu(node->stat);
+		kfree(node);
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	/* all dst(s) are stored from MAX to MIN */
+	for (i = 0; i < count && tuple_lt(dst, &m->node[i]->server); i++) {
+		natcap_server_table_append(n, m->node[i]);
+	}
+	natcap_server_table_append(n, node);
+	for (; i < count; i++) {
+		natcap_server_table_append(n, m->node[i]);
+	}
+
+	natcap_server_table_publish(n);
+out:
+	mutex_unlock(&natcap_server_table_lock);
+	return ret;
+}
+
+int natcap_server_info_delete(const struct tuple *dst)
+{
+	struct natcap_server_table *m, *n;
+	struct natcap_server_node *node = NULL;
+	unsigned int i;
+	int ret = 0;
+
+	mutex_lock(&natcap_server_table_lock);
+	m = rcu_dereference_protected(natcap_server_table, lockdep_is_held(&natcap_server_table_lock));
+	if (!m) {
+		ret = -ENOENT;
+		goto out;
+	}
+	for (i = 0; i < m->count; i++) {
+		if (tuple_eq(&m->node[i]->server, dst)) {
+			node = m->node[i];
+			break;
+		}
+	}
+	if (!node) {
+		ret = -ENOENT;
+		goto out;
+	}
+
+	n = natcap_server_table_alloc(m->count - 1);
+	if (!n) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < m->count; i++) {
+		if (m->node[i] != node) {
+			natcap_server_table_append(n, m->node[i]);
+		}
+	}
+
+	natcap_server_table_publish(n);
+	/* readers of the old table may still hold the node */
+	synchronize_rcu();
+	free_percpu(node->stat);
+	kfree(node);
+out:
+	mutex_unlock(&natcap_server_table_lock);
+	return ret;
+}
+
+void natcap_server_info_current(struct tuple *dst)
+{
+	struct natcap_server_table *t;
+
+	memset(dst, 0, sizeof(struct tuple));
+	rcu_read_lock();
+	t = rcu_dereference(natcap_server_table);
+	if (t && t->count > 0)
+		tuple_copy(dst, &t->node[server_index % t->count]->server);
+	rcu_read_unlock();
+}
+
+void natcap_server_in_touch(__be32 ip)
+{
+	struct natcap_server_table *t;
+	struct natcap_server_node *node;
+	unsigned int h, mask;
+
+	rcu_read_lock();
+	t = rcu_dereference(natcap_server_table);
+	if (t && t->count > 0) {
+		mask = (1U << t->hash_bits) - 1;
+		for (h = hash_32((__force u32)ip, t->hash_bits); (node = t->ip_hash[h]) != NULL; h = (h + 1) & mask) {
+			if (node->server.ip == ip && node->last_dir != NATCAP_SERVER_IN)
+				node->last_dir = NATCAP_SERVER_IN;
+		}
+	}
+	rcu_read_unlock();
+}
+
+/* buckets of SYN-ACK time: <10ms, <20ms, <40ms ... <640ms, >=640ms */
+static inline unsigned int natcap_server_rtt_bucket(unsigned int rtt_us)
+{
+	unsigned int ms = rtt_us / 1000;
+
+	if (ms < 10)
+		return 0;
+	ms = ilog2(ms / 10) + 1;
+	return ms < NATCAP_SERVER_RTT_BUCKETS ? ms : NATCAP_SERVER_RTT_BUCKETS - 1;
+}
+
+/* the node of server ip:port, caller holds rcu_read_lock */
+static struct natcap_server_node *natcap_server_node_get(__be32 ip, __be16 port)
+{
+	struct natcap_server_table *t;
+	struct natcap_server_node *node;
+	unsigned int h, mask;
+
+	t = rcu_dereference(natcap_server_table);
+	if (!t || t->count == 0)
+		return NULL;
+
+	mask = (1U << t->hash_bits) - 1;
+	for (h = hash_32((__force u32)ip, t->hash_bits); (node = t->ip_hash[h]) != NULL; h = (h + 1) & mask) {
+		if (node->server.ip == ip && (node->server.port == port || node->server.port == __constant_htons(0) || node->server.port == __constant_htons(65535)))
+			return node;
+	}
+
+	return NULL;
+}
+
+void natcap_server_stat_flow_new(struct nf_conn *ct, __be32 ip, __be16 port)
+{
+	struct natcap_server_node *node;
+	struct natcap_session *ns;
+	unsigned long sec = jiffies / HZ;
+
+	rcu_read_lock();
+	node = natcap_server_node_get(ip, port);
+	if (node) {
+		this_cpu_inc(node->stat->flows_new);
+		ns = natcap_session_get(ct);
+		if (ns && ns->active_ip == 0) {
+			ns->active_ip = ip;
+			ns->active_port = port;
+			this_cpu_inc(node->stat->flows_active);
+		}
+		if (node->rate_sec != sec) {
+			node->rate_last = (node->rate_sec + 1 == sec) ? node->rate_cur : 0;
+			node->rate_cur = 0;
+			node->rate_sec = sec;
+		}
+		node->rate_cur++;
+	}
+	rcu_read_unlock();
+}
+
+void natcap_server_stat_bytes(struct nf_conn *ct, unsigned int len, int dir)
+{
+	struct natcap_server_node *node;
+
+	rcu_read_lock();
+	node = natcap_server_node_get(ct->tuplehash[IP_CT_DIR_REPLY].tuple.src.u3.ip, ct->tuplehash[IP_CT_DIR_REPLY].tuple.src.u.all);
+	if (node) {
+		if (dir == IP_CT_DIR_ORIGINAL)
+			this_cpu_add(node->stat->tx_bytes, len);
+		else
+			this_cpu_add(node->stat->rx_bytes, len);
+	}
+	rcu_read_unlock();
+}
+
+void natcap_server_stat_rst(struct nf_conn *ct)
+{
+	struct natcap_server_node *node;
+
+	rcu_read_lock();
+	node = natcap_server_node_get(ct->tuplehash[IP_CT_DIR_REPLY].tuple.src.u3.ip, ct->tuplehash[IP_CT_DIR_REPLY].tuple.src.u.all);
+	if (node) {
+		this_cpu_inc(node->stat->rsts);
+	}
+	rcu_read_unlock();
+}
+
+/* flows_active is decremented when the conntrack is freed. The natcap
+ * session lives in the NAT extension and has no destroy hook, and the ct
+ * event notifier is taken by ctnetlink, so the module wraps nf_ct_destroy,
+ * which every conntrack of every netns goes through on its last put. It is
+ * restored on exit, any other module wrapping it must unload first
+ */
+static void (*natcap_ct_destroy_orig)(struct nf_conntrack *) = NULL;
+
+static void natcap_ct_destroy(struct nf_conntrack *nfct)
+{
+	struct nf_conn *ct = (struct nf_conn *)nfct;
+	struct natcap_server_node *node;
+	struct natcap_session *ns;
+
+	if ((IPS_NATCAP & ct->status) && (ns = natcap_session_get(ct)) != NULL && ns->active_ip != 0) {
+		rcu_read_lock();
+		node = natcap_server_node_get(ns->active_ip, ns->active_port);
+		if (node) {
+			this_cpu_dec(node->stat->flows_active);
+		}
+		rcu_read_unlock();
+	}
+
+	natcap_ct_destroy_orig(nfct);
+}
+
+static void natcap_ct_destroy_init(void)
+{
+	natcap_ct_destroy_orig = rcu_dereference_protected(nf_ct_destroy, 1);
+	rcu_assign_pointer(nf_ct_destroy, natcap_ct_destroy);
+}
+
+static void natcap_ct_destroy_exit(void)
+{
+	rcu_assign_pointer(nf_ct_destroy, natcap_ct_destroy_orig);
+	synchronize_rcu();
+}
+
+int natcap_server_info_stat_get(loff_t idx, struct natcap_server_info_stat *st)
+{
+	struct natcap_server_table *t;
+	struct natcap_server_node *node;
+	unsigned long sec = jiffies / HZ;
+	int cpu, i;
+	int ret = -ENOENT;
+
+	memset(st, 0, sizeof(*st));
+	rcu_read_lock();
+	t = rcu_dereference(natcap_server_table);
+	if (t && idx < t->count) {
+		node = t->node[idx];
+		tuple_copy(&st->server, &node->server);
+		for_each_possible_cpu(cpu) {
+			struct natcap_server_stat *ps = per_cpu_ptr(node->stat, cpu);
+			st->flows_new += ps->flows_new;
+			st->flows_active += ps->flows_active;
+			st->tx_bytes += ps->tx_bytes;
+			st->rx_bytes += ps->rx_bytes;
+			st->syn_timeouts += ps->syn_timeouts;
+			st->rsts += ps->rsts;
+			for (i = 0; i < NATCAP_SERVER_RTT_BUCKETS; i++) {
+				st->rtt_hist[i] += ps->rtt_hist[i];
+			}
+		}
+		if (node->rate_sec == sec)
+			st->flows_per_sec = node->rate_last;
+		else if (node->rate_sec + 1 == sec)
+			st->flows_per_sec = node->rate_cur;
+		st->srtt_us = node->srtt_us;
+		st->loss = node->loss;
+		st->dead = natcap_server_node_dead(node);
+		st->race_won = node->race_won;
+		/* a server deleted and added again sees the old flows end */
+		if ((long long)st->flows_active < 0)
+			st->flows_active = 0;
+		ret = 0;
+	}
+	rcu_read_unlock();
+
+	return ret;
+}
+
+void natcap_server_rtt_sample(__be32 ip, unsigned int rtt_us)
+{
+	struct natcap_server_table *t;
+	struct natcap_server_node *node;
+	unsigned int h, mask;
+	int delta;
+
+	if (rtt_us > NATCAP_SERVER_RTT_MAX)
+		rtt_us = NATCAP_SERVER_RTT_MAX;
+
+	rcu_read_lock();
+	t = rcu_dereference(natcap_server_table);
+	if (t && t->count > 0) {
+		mask = (1U << t->hash_bits) - 1;
+		for (h = hash_32((__force u32)ip, t->hash_bits); (node = t->ip_hash[h]) != NULL; h = (h + 1) & mask) {
+			if (node->server.ip != ip)
+				continue;
+			this_cpu_inc(node->stat->rtt_hist[natcap_server_rtt_bucket(rtt_us)]);
+			if (node->srtt_us == 0) {
+				node->srtt_us = rtt_us;
+			} else {
+				delta = (int)rtt_us - (int)node->srtt_us;
+				node->srtt_us += delta / 8;
+			}
+			node->loss -= node->loss >> 3;
+			node->fails = 0;
+			node->dead_until = 0;
+			natcap_server_node_affinity_update(node);
+		}
+	}
+	rcu_read_unlock();
+}
+
+void natcap_server_fail_sample(__be32 ip)
+{
+	struct natcap_server_table *t;
+	struct natcap_server_node *node;
+	unsigned int h, mask;
+
+	rcu_read_lock();
+	t = rcu_dereference(natcap_server_table);
+	if (t && t->count > 0) {
+		mask = (1U << t->hash_bits) - 1;
+		for (h = hash_32((__force u32)ip, t->hash_bits); (node = t->ip_hash[h]) != NULL; h = (h + 1) & mask) {
+			if (node->server.ip != ip)
+				continue;
+			this_cpu_inc(node->stat->syn_timeouts);
+			node->loss += (1024 - node->loss) >> 3;
+			node->fails++;
+			natcap_server_node_affinity_update(node);
+			if (server_dead_fails && node->fails >= server_dead_fails && !natcap_server_node_dead(node)) {
+				node->dead_until = jiffies + server_dead_timeout * HZ;
+				if (node->dead_until == 0)
+					node->dead_until = 1;
+				this_cpu_inc(server_evicted);
+				server_reselect = 1;
+				NATCAP_WARN("server=" TUPLE_FMT " failed %u handshakes, evicted for %us\n", TUPLE_ARG(&node->server), node->fails, server_dead_timeout);
+			}
+		}
+	}
+	rcu_read_unlock();
+}
+
+static void natcap_server_tuple_fixup(__be32 ip, __be16 port, struct tuple *dst)
+{
+	static atomic_t server_port = ATOMIC_INIT(0);
+
+	if (dst->port == __constant_htons(0)) {
+		dst->port = port;
+	} else if (dst->port == __constant_htons(65535)) {
+		dst->port = atomic_add_return(1, &server_port) ^ (ip & 0xFFFF) ^ ((ip >> 16) & 0xFFFF);
+	}
+
+	if (encode_http_only == 0)
+		return;
+
+	//XXX: encode for port 80 and 53 only
+	if (port != __constant_htons(80) && port != __constant_htons(53)) {
+		dst->encryption = 0;
 	}
 }
 
-void natcap_server_info_select(__be32 ip, __be16 port, struct tuple *dst)
+void natcap_server_info_select(__be32 sip, __be32 ip, __be16 port, struct tuple *dst)
 {
-	static atomic_t server_port = ATOMIC_INIT(0);
-	struct natcap_server_info *nsi = &natcap_server_info;
-	unsigned int m = nsi->active_index;
-	unsigned int count = nsi->server_count[m];
+	struct natcap_server_table *t;
+	struct natcap_server_node *node;
+	unsigned int count;
 	unsigned int hash;
 	int i, found = 0;
 
@@ -323,76 +2105,262 @@ void natcap_server_info_select(__be32 ip, __be16 port, struct tuple *dst)
 	dst->port = 0;
 	dst->encryption = 0;
 
-	if (count == 0)
+	rcu_read_lock();
+	t = rcu_dereference(natcap_server_table);
+	count = t ? t->count : 0;
+	if (count == 0) {
+		rcu_read_unlock();
 		return;
+	}
+
+	if (server_affinity) {
+		/* the current server is the one of the last flow */
+		server_index = natcap_server_affinity_pick(t, sip, ip);
+		node = t->node[server_index];
+		found = 1;
+		goto server_found;
+	}
 
 	natcap_server_info_change(0);
 
 	hash = server_index % count;
+	node = t->node[hash];
+
+	if (server_reselect || natcap_server_node_dead(node)) {
+		server_reselect = 0;
+		i = natcap_server_weighted_pick(t);
+		if (i >= 0) {
+			hash = i;
+			server_index = i;
+			node = t->node[hash];
+		}
+	}
 
-	if (nsi->last_dir[hash] == NATCAP_SERVER_IN || jiffies_diff(jiffies, nsi->last_active[hash]) <= natcap_touch_timeout * HZ) {
+	if (!natcap_server_node_dead(node) &&
+			(node->last_dir == NATCAP_SERVER_IN || jiffies_diff(jiffies, node->last_active) <= natcap_touch_timeout * HZ)) {
 		found = 1;
 	} else {
 		hash = (hash + jiffies) % count;
 		for (i = hash; i < count; i++) {
-			if (nsi->last_dir[i] == NATCAP_SERVER_IN || jiffies_diff(jiffies, nsi->last_active[i]) > 512 * HZ) {
+			node = t->node[i];
+			if (natcap_server_node_dead(node))
+				continue;
+			if (node->last_dir == NATCAP_SERVER_IN || jiffies_diff(jiffies, node->last_active) > 512 * HZ) {
 				found = 1;
 				hash = i;
 				server_index = i;
-				nsi->last_dir[i] = NATCAP_SERVER_IN;
-				NATCAP_WARN("current server is not available, reuse old state server=" TUPLE_FMT "\n", TUPLE_ARG(&nsi->server[m][hash]));
+				node->last_dir = NATCAP_SERVER_IN;
+				NATCAP_WARN("current server is not available, reuse old state server=" TUPLE_FMT "\n", TUPLE_ARG(&node->server));
 				break;
 			}
 		}
 		for (i = 0; !found && i < hash; i++) {
-			if (nsi->last_dir[i] == NATCAP_SERVER_IN || jiffies_diff(jiffies, nsi->last_active[i]) > 512 * HZ) {
+			node = t->node[i];
+			if (natcap_server_node_dead(node))
+				continue;
+			if (node->last_dir == NATCAP_SERVER_IN || jiffies_diff(jiffies, node->last_active) > 512 * HZ) {
 				found = 1;
 				hash = i;
 				server_index = i;
-				nsi->last_dir[i] = NATCAP_SERVER_IN;
-				NATCAP_WARN("current server is not available, reuse old state server=" TUPLE_FMT "\n", TUPLE_ARG(&nsi->server[m][hash]));
+				node->last_dir = NATCAP_SERVER_IN;
+				NATCAP_WARN("current server is not available, reuse old state server=" TUPLE_FMT "\n", TUPLE_ARG(&node->server));
 				break;
 			}
 		}
 		if (!found) {
-			NATCAP_WARN("no server is availabe, force change next. current=" TUPLE_FMT "\n", TUPLE_ARG(&nsi->server[m][hash]));
+			node = t->node[hash];
+			NATCAP_WARN("no server is availabe, force change next. current=" TUPLE_FMT "\n", TUPLE_ARG(&node->server));
 			natcap_server_info_change(1);
 		}
 	}
 
-	if (nsi->last_dir[hash] == NATCAP_SERVER_IN || !found) {
-		nsi->last_dir[hash] = NATCAP_SERVER_OUT;
-		nsi->last_active[hash] = jiffies; /* ticks start */
+server_found:
+	if (node->last_dir == NATCAP_SERVER_IN || !found) {
+		node->last_dir = NATCAP_SERVER_OUT;
+		node->last_active = jiffies; /* ticks start */
 	}
 
-	tuple_copy(dst, &nsi->server[m][hash]);
-	if (dst->port == __constant_htons(0)) {
-		dst->port = port;
-	} else if (dst->port == __constant_htons(65535)) {
-		dst->port = atomic_add_return(1, &server_port) ^ (ip & 0xFFFF) ^ ((ip >> 16) & 0xFFFF);
+	tuple_copy(dst, &node->server);
+	rcu_read_unlock();
+
+	natcap_server_tuple_fixup(ip, port, dst);
+}
+
+static inline int natcap_server_race_candidate(const struct natcap_server_node *node, const struct tuple *dst, int nr)
+{
+	int i;
+
+	if (!natcap_server_node_usable(node))
+		return 0;
+	for (i = 0; i < nr; i++) {
+		if (dst[i].ip == node->server.ip)
+			return 0;
 	}
+	return 1;
+}
 
-	if (encode_http_only == 0)
-		return;
+/* with server_race > 1 a new proxied TCP flow sends its SYN through that
+ * many servers at once on the master/dual-out path, the first SYN-ACK wins
+ * and the other legs are reset and killed
+ */
+unsigned int server_race = 1;
 
-	//XXX: encode for port 80 and 53 only
-	if (port != __constant_htons(80) && port != __constant_htons(53)) {
-		dst->encryption = 0;
+struct natcap_server_race_stat {
+	unsigned long long launched;
+	unsigned long long switched;
+};
+static DEFINE_PER_CPU(struct natcap_server_race_stat, server_race_stat);
+
+void natcap_server_race_stat_get(unsigned long long *launched, unsigned long long *switched)
+{
+	int cpu;
+
+	*launched = 0;
+	*switched = 0;
+	for_each_possible_cpu(cpu) {
+		struct natcap_server_race_stat *st = per_cpu_ptr(&server_race_stat, cpu);
+		*launched += st->launched;
+		*switched += st->switched;
+	}
+}
+
+/* fill dst[0..n-1] with servers on distinct ips to race the first SYN
+ * through: dst[0] is what natcap_server_info_select picks, the others are
+ * weighted picks among the usable servers. Returns how many were found
+ */
+int natcap_server_info_select_race(__be32 sip, __be32 ip, __be16 port, struct tuple *dst, int n)
+{
+	struct natcap_server_table *t;
+	struct natcap_server_node *node = NULL;
+	unsigned int i, total, r;
+	int nr;
+
+	natcap_server_info_select(sip, ip, port, &dst[0]);
+	if (dst[0].ip == 0)
+		return 0;
+	nr = 1;
+
+	rcu_read_lock();
+	t = rcu_dereference(natcap_server_table);
+	while (t && nr < n) {
+		total = 0;
+		for (i = 0; i < t->count; i++) {
+			if (natcap_server_race_candidate(t->node[i], dst, nr))
+				total += natcap_server_node_weight(t->node[i]);
+		}
+		if (total == 0)
+			break;
+
+		r = prandom_u32() % total;
+		for (i = 0; i < t->count; i++) {
+			node = t->node[i];
+			if (!natcap_server_race_candidate(node, dst, nr))
+				continue;
+			if (r < natcap_server_node_weight(node))
+				break;
+			r -= natcap_server_node_weight(node);
+		}
+		if (i == t->count)
+			break;
+
+		tuple_copy(&dst[nr], &node->server);
+		natcap_server_tuple_fixup(ip, port, &dst[nr]);
+		nr++;
+	}
+	rcu_read_unlock();
+
+	return nr;
+}
+
+void natcap_server_race_won(__be32 ip)
+{
+	struct natcap_server_table *t;
+	struct natcap_server_node *node;
+	unsigned int h, mask;
+
+	rcu_read_lock();
+	t = rcu_dereference(natcap_server_table);
+	if (t && t->count > 0) {
+		mask = (1U << t->hash_bits) - 1;
+		for (h = hash_32((__force u32)ip, t->hash_bits); (node = t->ip_hash[h]) != NULL; h = (h + 1) & mask) {
+			if (node->server.ip == ip)
+				node->race_won++;
+		}
+	}
+	rcu_read_unlock();
+}
+
+/* ct is the leg whose reply locked CFM on master: later packets of master
+ * follow it, and the legs still waiting on the other servers are killed
+ */
+static void natcap_server_race_settle(struct nf_conn *master, struct nf_conn *ct, struct natcap_session *ns)
+{
+	struct nf_conntrack_tuple_hash *h;
+	struct nf_conntrack_tuple tuple;
+	struct nf_conn *leg;
+	int i;
+
+	ns->tup.ip = ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.u3.ip;
+	ns->tup.port = ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.u.all;
+	ns->tup.encryption = !!(IPS_NATCAP_ENC & ct->status);
+	ns->new_source = ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u.all;
+
+	natcap_server_race_won(ns->tup.ip);
+	if (ns->race_tup[0].ip != ns->tup.ip) {
+		this_cpu_inc(server_race_stat.switched);
+	}
+	NATCAP_INFO(DEBUG_FMT_PREFIX "server race won by " TUPLE_FMT " of %u\n", DEBUG_ARG_PREFIX, TUPLE_ARG(&ns->tup), ns->race_nr);
+
+	for (i = 0; i < ns->race_nr; i++) {
+		if (ns->race_source[i] == 0 ||
+				(ns->race_tup[i].ip == ns->tup.ip && ns->race_source[i] == ns->new_source)) {
+			continue;
+		}
+
+		memset(&tuple, 0, sizeof(tuple));
+		tuple.src.u3.ip = ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.ip;
+		tuple.src.u.all = ns->race_source[i];
+		tuple.src.l3num = AF_INET;
+		tuple.dst.u3.ip = ns->race_tup[i].ip;
+		tuple.dst.u.all = ns->race_tup[i].port;
+		tuple.dst.protonum = IPPROTO_TCP;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 3, 0)
+		h = nf_conntrack_find_get(nf_ct_net(master), NF_CT_DEFAULT_ZONE, &tuple);
+#else
+		h = nf_conntrack_find_get(nf_ct_net(master), &nf_ct_zone_dflt, &tuple);
+#endif
+		if (h) {
+			leg = nf_ct_tuplehash_to_ctrack(h);
+			if (NF_CT_DIRECTION(h) == IP_CT_DIR_ORIGINAL && leg != ct && leg->master == master) {
+				nf_ct_kill(leg);
+			}
+			nf_ct_put(leg);
+		}
 	}
 }
 
 static inline int is_natcap_server(__be32 ip)
 {
-	struct natcap_server_info *nsi = &natcap_server_info;
-	unsigned int m = nsi->active_index;
-	unsigned int i;
+	struct natcap_server_table *t;
+	struct natcap_server_node *node;
+	unsigned int h, mask;
+	int ret = 0;
 
-	for (i = 0; i < nsi->server_count[m]; i++) {
-		if (nsi->server[m][i].ip == ip)
-			return 1;
+	rcu_read_lock();
+	t = rcu_dereference(natcap_server_table);
+	if (t) {
+		mask = (1U << t->hash_bits) - 1;
+		for (h = hash_32((__force u32)ip, t->hash_bits); (node = t->ip_hash[h]) != NULL; h = (h + 1) & mask) {
+			if (node->server.ip == ip) {
+				ret = 1;
+				break;
+			}
+		}
 	}
+	rcu_read_unlock();
 
-	return 0;
+	return ret;
 }
 
 static inline int natcap_reset_synack(struct sk_buff *oskb, const struct net_device *dev, struct nf_conn *ct)
@@ -526,6 +2494,9 @@ static unsigned int natcap_client_dnat_hook(void *priv,
 	void *l4;
 	struct natcap_session *ns;
 	struct tuple server;
+	int verdict;
+	int classified = 0;
+	unsigned int gen = 0;
 
 	if (disabled)
 		return NF_ACCEPT;
@@ -594,14 +2565,81 @@ static unsigned int natcap_client_dnat_hook(void *priv,
 			return NF_ACCEPT;
 		}
 
-		if (IP_SET_test_dst_ip(state, in, out, skb, "knocklist") > 0) {
+		verdict = NATCAP_DST_MISS;
+		if (hooknum == NF_INET_LOCAL_OUT) {
+			/* bound late by natcapd-client */
+			switch (skb->mark & NATCAP_BIND_MARK_MASK) {
+				case NATCAP_BIND_MARK_BYPASS:
+					verdict = NATCAP_DST_BYPASS;
+					break;
+				case NATCAP_BIND_MARK_PROXY:
+					verdict = NATCAP_DST_PROXY;
+					break;
+			}
+		}
+		if (verdict == NATCAP_DST_MISS) {
+			verdict = natcap_classifier_run(skb);
+			classified = (verdict != NATCAP_DST_MISS);
+		}
+		if (verdict == NATCAP_DST_MISS) {
+			verdict = natcap_dst_cache_get(nf_ct_net(ct), iph->daddr, IPPROTO_TCP, &gen);
+		}
+		if (verdict == NATCAP_DST_MISS) {
+			if (IP_SET_test_dst_ip(state, in, out, skb, "knocklist") > 0) {
+				verdict = NATCAP_DST_KNOCK;
+			} else if (IP_SET_test_dst_ip(state, in, out, skb, "bypasslist") > 0) {
+				verdict = NATCAP_DST_BYPASS;
+			} else if (IP_SET_test_dst_ip(state, in, out, skb, "cniplist") > 0) {
+				verdict = NATCAP_DST_CNIP;
+			} else if (cnipwhitelist_mode || natcap_domain_ip_test(iph->daddr) || IP_SET_test_dst_ip(state, in, out, skb, "gfwlist") > 0) {
+				verdict = NATCAP_DST_PROXY;
+			} else {
+				verdict = NATCAP_DST_DUAL;
+			}
+			natcap_dst_cache_set(nf_ct_net(ct), iph->daddr, IPPROTO_TCP, verdict, gen);
+		}
+		if (verdict == NATCAP_DST_DUAL && !classified && late_bind && natcap_redirect_port != 0 && hooknum == NF_INET_PRE_ROUTING &&
+				(TCPH(l4)->dest == __constant_htons(443) || TCPH(l4)->dest == __constant_htons(80))) {
+			/* let natcapd-client finish the handshake and bind by SNI/Host,
+			 * a winner learned for the address says nothing about the name
+			 */
+			verdict = NATCAP_DST_REDIRECT;
+		}
+		if (verdict == NATCAP_DST_DUAL && !classified) {
+			switch (natcap_race_winner(iph->daddr)) {
+				case NATCAP_RACE_DIRECT:
+					verdict = NATCAP_DST_BYPASS;
+					break;
+				case NATCAP_RACE_PROXY:
+					verdict = NATCAP_DST_PROXY;
+					break;
+			}
+		}
+
+		if (verdict == NATCAP_DST_KNOCK) {
 			natcap_knock_info_select(iph->daddr, ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.u.all, &server);
 			NATCAP_INFO("(CD)" DEBUG_TCP_FMT ": new connection, knock select target server=" TUPLE_FMT "\n", DEBUG_TCP_ARG(iph,l4), TUPLE_ARG(&server));
-		} else if (IP_SET_test_dst_ip(state, in, out, skb, "bypasslist") > 0 || IP_SET_test_dst_ip(state, in, out, skb, "cniplist") > 0) {
+		} else if (verdict == NATCAP_DST_BYPASS || verdict == NATCAP_DST_CNIP) {
 			set_bit(IPS_NATCAP_BYPASS_BIT, &ct->status);
+			/* domestic destinations are not armed, it would copy the SYN and stop
+			 * natflow on all of their connects for syn_fallback_ms
+			 */
+			if (verdict == NATCAP_DST_BYPASS && syn_fallback_ms && !nf_ct_is_confirmed(ct) && !ct->master &&
+					!ipv4_is_lbcast(iph->daddr) && !ipv4_is_loopback(iph->daddr) &&
+					!ipv4_is_multicast(iph->daddr) && !ipv4_is_zeronet(iph->daddr)) {
+				natcap_server_info_select(iph->saddr, iph->daddr, TCPH(l4)->dest, &server);
+				if (server.ip != 0) {
+					ns = natcap_session_in(ct);
+					if (ns) {
+						/* no ACK yet: post out arms the fallback on the first SYN */
+						memcpy(&ns->tup, &server, sizeof(struct tuple));
+						return NF_ACCEPT;
+					}
+				}
+			}
 			set_bit(IPS_NATCAP_ACK_BIT, &ct->status);
 			return NF_ACCEPT;
-		} else if (cnipwhitelist_mode || IP_SET_test_dst_ip(state, in, out, skb, "gfwlist") > 0) {
+		} else if (verdict == NATCAP_DST_PROXY || verdict == NATCAP_DST_REDIRECT) {
 			if (natcap_redirect_port != 0 && hooknum == NF_INET_PRE_ROUTING) {
 				__be32 newdst = 0;
 				struct in_device *indev;
@@ -624,7 +2662,30 @@ static unsigned int natcap_client_dnat_hook(void *priv,
 					return NF_ACCEPT;
 				}
 			}
-			natcap_server_info_select(iph->daddr, ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.u.all, &server);
+			if (server_race > 1 && !nf_ct_is_confirmed(ct) && !ct->master &&
+					!ipv4_is_lbcast(iph->daddr) && !ipv4_is_loopback(iph->daddr) &&
+					!ipv4_is_multicast(iph->daddr) && !ipv4_is_zeronet(iph->daddr)) {
+				struct tuple race[NATCAP_SERVER_RACE_MAX];
+				int nr;
+
+				nr = natcap_server_info_select_race(iph->saddr, iph->daddr, ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.u.all, race,
+						server_race < NATCAP_SERVER_RACE_MAX ? server_race : NATCAP_SERVER_RACE_MAX);
+				if (nr > 1 && (ns = natcap_session_in(ct)) != NULL) {
+					/* the master out hook sends the SYN through every server, no direct leg */
+					memcpy(ns->race_tup, race, sizeof(struct tuple) * nr);
+					memcpy(&ns->tup, &race[0], sizeof(struct tuple));
+					ns->race_nr = nr;
+					set_bit(IPS_NATCAP_BYPASS_BIT, &ct->status);
+					set_bit(IPS_NATCAP_SYN_BIT, &ct->status);
+					this_cpu_inc(server_race_stat.launched);
+
+					NATCAP_DEBUG("(CD)" DEBUG_TCP_FMT ": TCP race out to %d servers\n", DEBUG_TCP_ARG(iph,l4), nr);
+					xt_mark_natcap_set(XT_MARK_NATCAP, &skb->mark);
+					if (!(IPS_NATFLOW_STOP & ct->status)) set_bit(IPS_NATFLOW_STOP_BIT, &ct->status);
+					return NF_ACCEPT;
+				}
+			}
+			natcap_server_info_select(iph->saddr, iph->daddr, ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.u.all, &server);
 			if (server.ip == 0) {
 				NATCAP_DEBUG("(CD)" DEBUG_TCP_FMT ": no server found\n", DEBUG_TCP_ARG(iph,l4));
 				set_bit(IPS_NATCAP_BYPASS_BIT, &ct->status);
@@ -653,7 +2714,7 @@ static unsigned int natcap_client_dnat_hook(void *priv,
 					return NF_ACCEPT;
 				}
 
-				natcap_server_info_select(iph->daddr, TCPH(l4)->dest, &server);
+				natcap_server_info_select(iph->saddr, iph->daddr, TCPH(l4)->dest, &server);
 				if (server.ip == 0) {
 					NATCAP_DEBUG("(CD)" DEBUG_TCP_FMT ": no server found\n", DEBUG_TCP_ARG(iph,l4));
 					set_bit(IPS_NATCAP_ACK_BIT, &ct->status);
@@ -683,7 +2744,25 @@ static unsigned int natcap_client_dnat_hook(void *priv,
 		iph = ip_hdr(skb);
 		l4 = (void *)iph + iph->ihl * 4;
 
-		if (UDPH(l4)->dest == __constant_htons(53)) {
+		if (UDPH(l4)->dest == __constant_htons(53) && dns_cache && hooknum == NF_INET_PRE_ROUTING && !nf_ct_is_confirmed(ct)) {
+			if (natcap_dns_cache_query(in, skb) == NF_STOLEN) {
+				return NF_STOLEN;
+			}
+			iph = ip_hdr(skb);
+			l4 = (void *)iph + iph->ihl * 4;
+		}
+
+		/* an attached program decides before the port 53/80/443 defaults */
+		verdict = natcap_classifier_run(skb);
+		if (verdict == NATCAP_DST_KNOCK) {
+			/* no knock for UDP, same as the default verdict */
+			verdict = NATCAP_DST_MISS;
+		} else if (verdict == NATCAP_DST_REDIRECT) {
+			verdict = NATCAP_DST_PROXY;
+		}
+		classified = (verdict != NATCAP_DST_MISS);
+
+		if (UDPH(l4)->dest == __constant_htons(53) && !classified) {
 natcap_dual_out:
 			set_bit(IPS_NATCAP_BYPASS_BIT, &ct->status);
 			if (!nf_ct_is_confirmed(ct)) {
@@ -699,7 +2778,7 @@ natcap_dual_out:
 					return NF_ACCEPT;
 				}
 
-				natcap_server_info_select(iph->daddr, UDPH(l4)->dest, &server);
+				natcap_server_info_select(iph->saddr, iph->daddr, UDPH(l4)->dest, &server);
 				if (server.ip == 0) {
 					NATCAP_DEBUG("(CD)" DEBUG_UDP_FMT ": no server found\n", DEBUG_UDP_ARG(iph,l4));
 					set_bit(IPS_NATCAP_ACK_BIT, &ct->status);
@@ -723,16 +2802,40 @@ natcap_dual_out:
 			return NF_ACCEPT;
 		}
 
-		if (IP_SET_test_dst_ip(state, in, out, skb, "bypasslist") > 0 || IP_SET_test_dst_ip(state, in, out, skb, "cniplist") > 0) {
+		if (verdict == NATCAP_DST_MISS) {
+			verdict = natcap_dst_cache_get(nf_ct_net(ct), iph->daddr, IPPROTO_UDP, &gen);
+		}
+		if (verdict == NATCAP_DST_MISS) {
+			if (IP_SET_test_dst_ip(state, in, out, skb, "bypasslist") > 0 || IP_SET_test_dst_ip(state, in, out, skb, "cniplist") > 0) {
+				verdict = NATCAP_DST_BYPASS;
+			} else if (cnipwhitelist_mode ||
+					natcap_domain_ip_test(iph->daddr) ||
+					IP_SET_test_dst_ip(state, in, out, skb, "udproxylist") > 0 ||
+					IP_SET_test_dst_ip(state, in, out, skb, "gfwlist") > 0) {
+				verdict = NATCAP_DST_PROXY;
+			} else {
+				verdict = NATCAP_DST_DUAL;
+			}
+			natcap_dst_cache_set(nf_ct_net(ct), iph->daddr, IPPROTO_UDP, verdict, gen);
+		}
+		if (verdict == NATCAP_DST_DUAL && !classified) {
+			switch (natcap_race_winner(iph->daddr)) {
+				case NATCAP_RACE_DIRECT:
+					verdict = NATCAP_DST_BYPASS;
+					break;
+				case NATCAP_RACE_PROXY:
+					verdict = NATCAP_DST_PROXY;
+					break;
+			}
+		}
+
+		if (verdict == NATCAP_DST_BYPASS) {
 			set_bit(IPS_NATCAP_BYPASS_BIT, &ct->status);
 			set_bit(IPS_NATCAP_ACK_BIT, &ct->status);
 			return NF_ACCEPT;
-		} else if (cnipwhitelist_mode ||
-				IP_SET_test_dst_ip(state, in, out, skb, "udproxylist") > 0 ||
-				IP_SET_test_dst_ip(state, in, out, skb, "gfwlist") > 0 ||
-				UDPH(l4)->dest == __constant_htons(443) ||
-				UDPH(l4)->dest == __constant_htons(80)) {
-			natcap_server_info_select(iph->daddr, ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.u.all, &server);
+		} else if (verdict == NATCAP_DST_PROXY ||
+				(!classified && (UDPH(l4)->dest == __constant_htons(443) || UDPH(l4)->dest == __constant_htons(80)))) {
+			natcap_server_info_select(iph->saddr, iph->daddr, ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.u.all, &server);
 			if (server.ip == 0) {
 				NATCAP_DEBUG("(CD)" DEBUG_UDP_FMT ": no server found\n", DEBUG_UDP_ARG(iph,l4));
 				set_bit(IPS_NATCAP_BYPASS_BIT, &ct->status);
@@ -765,6 +2868,11 @@ natcap_dual_out:
 				NATCAP_INFO("(CD)" DEBUG_TCP_FMT ": new connection, after encode, server=" TUPLE_FMT "\n", DEBUG_TCP_ARG(iph,l4), TUPLE_ARG(&server));
 				if (natcap_session_init(ct, GFP_ATOMIC) != 0) {
 					NATCAP_WARN("(CD)" DEBUG_TCP_FMT ": natcap_session_init failed\n", DEBUG_TCP_ARG(iph,l4));
+				} else if (TCPH(l4)->syn && !TCPH(l4)->ack) {
+					ns = natcap_session_get(ct);
+					if (ns) {
+						ns->syn_stamp = natcap_syn_stamp_now();
+					}
 				}
 				break;
 			case IPPROTO_UDP:
@@ -787,6 +2895,7 @@ natcap_dual_out:
 			set_bit(IPS_NATCAP_ACK_BIT, &ct->status);
 			return NF_DROP;
 		}
+		natcap_server_stat_flow_new(ct, server.ip, server.port);
 	}
 
 	switch (iph->protocol) {
@@ -813,7 +2922,13 @@ natcaped_out:
 				return NF_ACCEPT;
 			}
 			if (!(IPS_NATCAP_SYN2 & ct->status) && !test_and_set_bit(IPS_NATCAP_SYN2_BIT, &ct->status)) {
+				ns = natcap_session_get(ct);
 				NATCAP_DEBUG("(CD)" DEBUG_TCP_FMT ": natcaped syn2\n", DEBUG_TCP_ARG(iph,l4));
+				/* the first SYN got no answer, and a late SYN-ACK would be ambiguous */
+				if (ns && ns->syn_stamp) {
+					ns->syn_stamp = 0;
+					natcap_server_fail_sample(ct->tuplehash[IP_CT_DIR_REPLY].tuple.src.u3.ip);
+				}
 				return NF_ACCEPT;
 			}
 			if ((IPS_NATCAP_SYN1 & ct->status) && (IPS_NATCAP_SYN2 & ct->status)) {
@@ -935,6 +3050,7 @@ static unsigned int natcap_client_pre_ct_in_hook(void *priv,
 	xt_mark_natcap_set(XT_MARK_NATCAP, &skb->mark);
 
 	flow_total_rx_bytes += skb->len;
+	natcap_server_stat_bytes(ct, skb->len, IP_CT_DIR_REPLY);
 
 	if (iph->protocol == IPPROTO_TCP) {
 		if (!skb_make_writable(skb, iph->ihl * 4 + sizeof(struct tcphdr))) {
@@ -948,8 +3064,17 @@ static unsigned int natcap_client_pre_ct_in_hook(void *priv,
 		iph = ip_hdr(skb);
 		l4 = (void *)iph + iph->ihl * 4;
 
-		if (TCPH(l4)->syn)
+		if (TCPH(l4)->rst) {
+			natcap_server_stat_rst(ct);
+		}
+		if (TCPH(l4)->syn) {
+			struct natcap_session *ns = natcap_session_get(ct);
 			natcap_server_in_touch(ct->tuplehash[IP_CT_DIR_REPLY].tuple.src.u3.ip);
+			if (ns && ns->syn_stamp) {
+				natcap_server_rtt_sample(ct->tuplehash[IP_CT_DIR_REPLY].tuple.src.u3.ip, natcap_syn_stamp_now() - ns->syn_stamp);
+				ns->syn_stamp = 0;
+			}
+		}
 
 		NATCAP_DEBUG("(CPCI)" DEBUG_TCP_FMT ": before decode\n", DEBUG_TCP_ARG(iph,l4));
 
@@ -985,12 +3110,13 @@ static unsigned int natcap_client_pre_ct_in_hook(void *priv,
 		}
 
 		if ((IPS_NATCAP_ENC & ct->status)) {
-			if (!skb_make_writable(skb, skb->len)) {
+			if (!skb_payload_make_writable(skb)) {
 				NATCAP_ERROR("(CPCI)" DEBUG_UDP_FMT ": natcap_udp_decode() failed\n", DEBUG_UDP_ARG(iph,l4));
 				return NF_DROP;
 			}
-			skb_data_hook(skb, iph->ihl * 4 + sizeof(struct udphdr), skb->len - (iph->ihl * 4 + sizeof(struct udphdr)), natcap_data_decode);
-			skb_rcsum_tcpudp(skb);
+			iph = ip_hdr(skb);
+			l4 = (void *)iph + iph->ihl * 4;
+			skb_data_decode_rcsum(skb, iph->ihl * 4 + sizeof(struct udphdr), skb->len - (iph->ihl * 4 + sizeof(struct udphdr)));
 		}
 
 		NATCAP_DEBUG("(CPCI)" DEBUG_UDP_FMT ": after decode\n", DEBUG_UDP_ARG(iph,l4));
@@ -999,6 +3125,9 @@ static unsigned int natcap_client_pre_ct_in_hook(void *priv,
 	return NF_ACCEPT;
 }
 
+/* shared with the hook table, GRO segments continue PRE_ROUTING from here */
+#define NATCAP_CLIENT_PRE_IN_PRIORITY (NF_IP_PRI_CONNTRACK - 10)
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 13, 0)
 static unsigned natcap_client_pre_in_hook(unsigned int hooknum,
 		struct sk_buff *skb,
@@ -1100,14 +3229,19 @@ static unsigned int natcap_client_pre_in_hook(void *priv,
 				skb->ip_summed = CHECKSUM_UNNECESSARY;
 			}
 
-			memmove((void *)UDPH(l4) + sizeof(struct udphdr), (void *)UDPH(l4) + sizeof(struct tcphdr), skb_tail_pointer(skb) - (unsigned char *)UDPH(l4) - sizeof(struct tcphdr));
+			if (natcap_skb_shim_pull(skb, iph->ihl * 4 + sizeof(struct udphdr), sizeof(struct tcphdr) - sizeof(struct udphdr))) {
+				return NF_DROP;
+			}
+			iph = ip_hdr(skb);
+			l4 = (void *)iph + iph->ihl * 4;
+
 			iph->tot_len = htons(ntohs(iph->tot_len) - (sizeof(struct tcphdr) - sizeof(struct udphdr)));
 			UDPH(l4)->len = htons(ntohs(iph->tot_len) - iph->ihl * 4);
 			UDPH(l4)->check = CSUM_MANGLED_0;
-			skb->len -= sizeof(struct tcphdr) - sizeof(struct udphdr);
-			skb->tail -= sizeof(struct tcphdr) - sizeof(struct udphdr);
 			iph->protocol = IPPROTO_UDP;
-			skb->ip_summed = CHECKSUM_UNNECESSARY;
+			if (skb->ip_summed != CHECKSUM_PARTIAL) {
+				skb->ip_summed = CHECKSUM_UNNECESSARY;
+			}
 			skb_rcsum_tcpudp(skb);
 
 			if (in)
@@ -1145,13 +3279,19 @@ static unsigned int natcap_client_pre_in_hook(void *priv,
 	l4 = (void *)iph + iph->ihl * 4;
 
 	if (skb_is_gso(skb)) {
+		if (get_byte4((void *)UDPH(l4) + 8) != __constant_htonl(0xFFFF0099)) {
+			return NF_ACCEPT;
+		}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 4, 0)
+		NATCAP_DEBUG("(CPI)" DEBUG_UDP_FMT ": gro skb, segment and reinject\n", DEBUG_UDP_ARG(iph,l4));
+		return natcap_gro_segment_reinject(skb, state, NATCAP_CLIENT_PRE_IN_PRIORITY);
+#else
 		NATCAP_ERROR("(CPI)" DEBUG_UDP_FMT ": skb_is_gso\n", DEBUG_UDP_ARG(iph,l4));
 		return NF_ACCEPT;
+#endif
 	}
 
 	if (get_byte4((void *)UDPH(l4) + 8) == __constant_htonl(0xFFFF0099)) {
-		int offlen;
-
 		if (skb->ip_summed == CHECKSUM_NONE) {
 			if (skb_rcsum_verify(skb) != 0) {
 				NATCAP_WARN("(CPI)" DEBUG_UDP_FMT ": skb_rcsum_verify fail\n", DEBUG_UDP_ARG(iph,l4));
@@ -1172,12 +3312,13 @@ static unsigned int natcap_client_pre_in_hook(void *priv,
 		iph = ip_hdr(skb);
 		l4 = (void *)iph + iph->ihl * 4;
 
-		offlen = skb_tail_pointer(skb) - (unsigned char *)UDPH(l4) - 4 - 8;
-		BUG_ON(offlen < 0);
-		memmove((void *)UDPH(l4) + 4, (void *)UDPH(l4) + 4 + 8, offlen);
+		if (natcap_skb_shim_pull(skb, iph->ihl * 4 + 4, 8)) {
+			return NF_DROP;
+		}
+		iph = ip_hdr(skb);
+		l4 = (void *)iph + iph->ihl * 4;
+
 		iph->tot_len = htons(ntohs(iph->tot_len) - 8);
-		skb->len -= 8;
-		skb->tail -= 8;
 		iph->protocol = IPPROTO_TCP;
 		skb->ip_summed = CHECKSUM_UNNECESSARY;
 		skb_rcsum_tcpudp(skb);
@@ -1263,9 +3404,14 @@ static unsigned int natcap_client_post_out_hook(void *priv,
 	}
 	if ((IPS_NATCAP_BYPASS & ct->status)) {
 		if (CTINFO2DIR(ctinfo) == IP_CT_DIR_ORIGINAL && iph->protocol == IPPROTO_TCP) {
-			if (TCPH(l4)->syn && !TCPH(l4)->ack) {
+			if (TCPH(l4)->syn && !TCPH(l4)->ack && !natcap_syn_fallback_resent(skb)) {
 				if (!(IPS_NATCAP_SYN1 & ct->status) && !test_and_set_bit(IPS_NATCAP_SYN1_BIT, &ct->status)) {
 					NATCAP_DEBUG("(CPO)" DEBUG_TCP_FMT ": bypass syn1\n", DEBUG_TCP_ARG(iph,l4));
+					if (!(IPS_NATCAP_ACK & ct->status) && !(IPS_NATCAP_SYN & ct->status) && hooknum == NF_INET_POST_ROUTING) {
+						if (natcap_syn_fallback_arm(skb) != 0) {
+							set_bit(IPS_NATCAP_ACK_BIT, &ct->status);
+						}
+					}
 					return NF_ACCEPT;
 				}
 				if (!(IPS_NATCAP_SYN2 & ct->status) && !test_and_set_bit(IPS_NATCAP_SYN2_BIT, &ct->status)) {
@@ -1298,6 +3444,8 @@ static unsigned int natcap_client_post_out_hook(void *priv,
 		return NF_DROP;
 	}
 
+	natcap_server_stat_bytes(ct, skb->len, IP_CT_DIR_ORIGINAL);
+
 	if (iph->protocol == IPPROTO_TCP) {
 		struct sk_buff *skb2 = NULL;
 		struct sk_buff *skb_htp = NULL;
@@ -1465,7 +3613,7 @@ static unsigned int natcap_client_post_out_hook(void *priv,
 		if (skb_is_gso(skb)) {
 			struct sk_buff *segs;
 
-			segs = skb_gso_segment(skb, 0);
+			segs = natcap_skb_gso_segment(skb);
 			if (IS_ERR(segs)) {
 				if (skb2) {
 					consume_skb(skb2);
@@ -1482,50 +3630,21 @@ static unsigned int natcap_client_post_out_hook(void *priv,
 			skb = skb2;
 		}
 
-		do {
-			int offlen;
-			struct sk_buff *nskb = skb->next;
-
-			if (skb_tailroom(skb) < 8 && pskb_expand_head(skb, 0, 8, GFP_ATOMIC)) {
-				consume_skb(skb);
-				skb = nskb;
-				NATCAP_ERROR(DEBUG_FMT_PREFIX "pskb_expand_head failed\n", DEBUG_ARG_PREFIX);
-				continue;
-			}
-			iph = ip_hdr(skb);
-			l4 = (void *)iph + iph->ihl * 4;
-
-			offlen = skb_tail_pointer(skb) - (unsigned char *)UDPH(l4) - 4;
-			BUG_ON(offlen < 0);
-			memmove((void *)UDPH(l4) + 4 + 8, (void *)UDPH(l4) + 4, offlen);
-			iph->tot_len = htons(ntohs(iph->tot_len) + 8);
-			UDPH(l4)->len = htons(ntohs(iph->tot_len) - iph->ihl * 4);
-			UDPH(l4)->check = CSUM_MANGLED_0;
-			skb->len += 8;
-			skb->tail += 8;
-			set_byte4((void *)UDPH(l4) + 8, __constant_htonl(0xFFFF0099));
-			iph->protocol = IPPROTO_UDP;
-			skb->ip_summed = CHECKSUM_UNNECESSARY;
-			skb_rcsum_tcpudp(skb);
-			skb->next = NULL;
-
-			NATCAP_DEBUG("(CPO)" DEBUG_UDP_FMT ": after natcap post out\n", DEBUG_UDP_ARG(iph,l4));
-
-			flow_total_tx_bytes += skb->len;
-			NF_OKFN(skb);
-
-			skb = nskb;
-		} while (skb);
+		skb = natcap_udpenc_pack_list(skb, &flow_total_tx_bytes);
+		if (skb) {
+			NF_OKFN_LIST(skb);
+		}
 
 		return NF_STOLEN;
 	} else if (iph->protocol == IPPROTO_UDP) {
 		if ((IPS_NATCAP_ENC & ct->status)) {
-			if (!skb_make_writable(skb, skb->len)) {
+			if (!skb_payload_make_writable(skb)) {
 				NATCAP_ERROR("(CPO)" DEBUG_UDP_FMT ": natcap_udp_encode() failed\n", DEBUG_UDP_ARG(iph,l4));
 				return NF_DROP;
 			}
-			skb_data_hook(skb, iph->ihl * 4 + sizeof(struct udphdr), skb->len - (iph->ihl * 4 + sizeof(struct udphdr)), natcap_data_encode);
-			skb_rcsum_tcpudp(skb);
+			iph = ip_hdr(skb);
+			l4 = (void *)iph + iph->ihl * 4;
+			skb_data_encode_rcsum(skb, iph->ihl * 4 + sizeof(struct udphdr), skb->len - (iph->ihl * 4 + sizeof(struct udphdr)));
 		}
 
 		if (!(IPS_NATCAP_CFM & ct->status)) {
@@ -1575,22 +3694,15 @@ static unsigned int natcap_client_post_out_hook(void *priv,
 				flow_total_tx_bytes += nskb->len;
 				NF_OKFN(nskb);
 			} else {
-				int offlen;
-
-				if (skb_tailroom(skb) < 12 && pskb_expand_head(skb, 0, 12, GFP_ATOMIC)) {
-					NATCAP_ERROR(DEBUG_FMT_PREFIX "pskb_expand_head failed\n", DEBUG_ARG_PREFIX);
+				if (natcap_skb_shim_push(skb, iph->ihl * 4 + sizeof(struct udphdr), 12)) {
+					NATCAP_ERROR(DEBUG_FMT_PREFIX "natcap_skb_shim_push failed\n", DEBUG_ARG_PREFIX);
 					return NF_ACCEPT;
 				}
 				iph = ip_hdr(skb);
 				l4 = (void *)iph + iph->ihl * 4;
 
-				offlen = skb_tail_pointer(skb) - (unsigned char *)UDPH(l4) - sizeof(struct udphdr);
-				BUG_ON(offlen < 0);
-				memmove((void *)UDPH(l4) + sizeof(struct udphdr) + 12, (void *)UDPH(l4) + sizeof(struct udphdr), offlen);
 				iph->tot_len = htons(ntohs(iph->tot_len) + 12);
 				UDPH(l4)->len = htons(ntohs(iph->tot_len) - iph->ihl * 4);
-				skb->len += 12;
-				skb->tail += 12;
 				set_byte4(l4 + sizeof(struct udphdr), __constant_htonl(0xFFFE0099));
 				set_byte4(l4 + sizeof(struct udphdr) + 4, ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.u3.ip);
 				set_byte2(l4 + sizeof(struct udphdr) + 8, ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.u.all);
@@ -1660,7 +3772,11 @@ static unsigned int natcap_client_post_master_out_hook(void *priv,
 	void *l4;
 	struct net *net = &init_net;
 	struct natcap_session *ns = NULL;
+	struct natcap_session *ctns;
 	struct natcap_TCPOPT tcpopt;
+	struct tuple *tup;
+	__be16 *new_source;
+	int leg = 0;
 
 	if (disabled)
 		return NF_ACCEPT;
@@ -1707,17 +3823,31 @@ static unsigned int natcap_client_post_master_out_hook(void *priv,
 		return NF_DROP;
 	}
 
+	ctns = ns;
+next_leg:
+	ns = ctns;
+	status = NATCAP_CLIENT_MODE;
+	skb2 = NULL;
+	if (ns->race_nr && !(IPS_NATCAP_CFM & ct->status)) {
+		/* still racing: every SYN goes through each leg */
+		tup = &ns->race_tup[leg];
+		new_source = &ns->race_source[leg];
+	} else {
+		tup = &ns->tup;
+		new_source = &ns->new_source;
+	}
+
 	skb = skb_copy(skb_orig, GFP_ATOMIC);
 	if (skb == NULL) {
 		NATCAP_ERROR(DEBUG_FMT_PREFIX "alloc_skb fail\n", DEBUG_ARG_PREFIX);
-		return NF_ACCEPT;
+		goto leg_fail;
 	}
 	skb_nfct_reset(skb);
 	iph = ip_hdr(skb);
 	l4 = (void *)iph + iph->ihl * 4;
 
 	if (iph->protocol == IPPROTO_TCP) {
-		if (ns->new_source == 0) {
+		if (*new_source == 0) {
 			unsigned int range_size, min, i;
 			__be16 *portptr;
 			u_int16_t off;
@@ -1727,8 +3857,8 @@ static unsigned int natcap_client_post_master_out_hook(void *priv,
 			tuple.src.u3.ip = iph->saddr;
 			tuple.src.u.all = TCPH(l4)->source;
 			tuple.src.l3num = AF_INET;
-			tuple.dst.u3.ip = ns->tup.ip;
-			tuple.dst.u.all = ns->tup.port;
+			tuple.dst.u3.ip = tup->ip;
+			tuple.dst.u.all = tup->port;
 			tuple.dst.protonum = IPPROTO_TCP;
 
 			portptr = &tuple.src.u.all;
@@ -1744,19 +3874,19 @@ static unsigned int natcap_client_post_master_out_hook(void *priv,
 						continue;
 				}
 			}
-			ns->new_source = *portptr;
+			*new_source = *portptr;
 		}
 
 		NATCAP_DEBUG("(CPMO)" DEBUG_TCP_FMT ": before natcap post out\n", DEBUG_TCP_ARG(iph,l4));
-		csum_replace4(&iph->check, iph->daddr, ns->tup.ip);
-		inet_proto_csum_replace4(&TCPH(l4)->check, skb, iph->daddr, ns->tup.ip, true);
-		inet_proto_csum_replace2(&TCPH(l4)->check, skb, TCPH(l4)->source, ns->new_source, false);
-		inet_proto_csum_replace2(&TCPH(l4)->check, skb, TCPH(l4)->dest, ns->tup.port, false);
-		TCPH(l4)->source = ns->new_source;
-		TCPH(l4)->dest = ns->tup.port;
-		iph->daddr = ns->tup.ip;
+		csum_replace4(&iph->check, iph->daddr, tup->ip);
+		inet_proto_csum_replace4(&TCPH(l4)->check, skb, iph->daddr, tup->ip, true);
+		inet_proto_csum_replace2(&TCPH(l4)->check, skb, TCPH(l4)->source, *new_source, false);
+		inet_proto_csum_replace2(&TCPH(l4)->check, skb, TCPH(l4)->dest, tup->port, false);
+		TCPH(l4)->source = *new_source;
+		TCPH(l4)->dest = tup->port;
+		iph->daddr = tup->ip;
 	} else {
-		if (ns->new_source == 0) {
+		if (*new_source == 0) {
 			unsigned int range_size, min, i;
 			__be16 *portptr;
 			u_int16_t off;
@@ -1766,8 +3896,8 @@ static unsigned int natcap_client_post_master_out_hook(void *priv,
 			tuple.src.u3.ip = iph->saddr;
 			tuple.src.u.all = UDPH(l4)->source;
 			tuple.src.l3num = AF_INET;
-			tuple.dst.u3.ip = ns->tup.ip;
-			tuple.dst.u.all = ns->tup.port;
+			tuple.dst.u3.ip = tup->ip;
+			tuple.dst.u.all = tup->port;
 			tuple.dst.protonum = IPPROTO_UDP;
 
 			portptr = &tuple.src.u.all;
@@ -1783,21 +3913,21 @@ static unsigned int natcap_client_post_master_out_hook(void *priv,
 						continue;
 				}
 			}
-			ns->new_source = *portptr;
+			*new_source = *portptr;
 		}
 
 		NATCAP_DEBUG("(CPMO)" DEBUG_UDP_FMT ": before natcap post out\n", DEBUG_UDP_ARG(iph,l4));
-		csum_replace4(&iph->check, iph->daddr, ns->tup.ip);
+		csum_replace4(&iph->check, iph->daddr, tup->ip);
 		if (UDPH(l4)->check) {
-			inet_proto_csum_replace4(&UDPH(l4)->check, skb, iph->daddr, ns->tup.ip, true);
-			inet_proto_csum_replace2(&UDPH(l4)->check, skb, UDPH(l4)->source, ns->new_source, false);
-			inet_proto_csum_replace2(&UDPH(l4)->check, skb, UDPH(l4)->dest, ns->tup.port, false);
+			inet_proto_csum_replace4(&UDPH(l4)->check, skb, iph->daddr, tup->ip, true);
+			inet_proto_csum_replace2(&UDPH(l4)->check, skb, UDPH(l4)->source, *new_source, false);
+			inet_proto_csum_replace2(&UDPH(l4)->check, skb, UDPH(l4)->dest, tup->port, false);
 			if (UDPH(l4)->check == 0)
 				UDPH(l4)->check = CSUM_MANGLED_0;
 		}
-		UDPH(l4)->source = ns->new_source;
-		UDPH(l4)->dest = ns->tup.port;
-		iph->daddr = ns->tup.ip;
+		UDPH(l4)->source = *new_source;
+		UDPH(l4)->dest = tup->port;
+		iph->daddr = tup->ip;
 
 		if (cone_nat_array &&
 				ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.u.all != __constant_htons(53) &&
@@ -1831,22 +3961,20 @@ static unsigned int natcap_client_post_master_out_hook(void *priv,
 		if (ret != NF_STOLEN) {
 			consume_skb(skb);
 		}
-		return NF_ACCEPT;
+		goto leg_fail;
 	}
 
 	master = nf_ct_get(skb, &ctinfo);
 	if (!master || master == ct) {
 		consume_skb(skb);
-		set_bit(IPS_NATCAP_ACK_BIT, &ct->status);
-		return NF_ACCEPT;
+		goto leg_fail_ack;
 	}
 	if (!(IPS_NATCAP_SYN & master->status) && !test_and_set_bit(IPS_NATCAP_SYN_BIT, &master->status)) {
 		if (master->master) {
-			set_bit(IPS_NATCAP_ACK_BIT, &ct->status);
 			consume_skb(skb);
-			return NF_ACCEPT;
+			goto leg_fail_ack;
 		}
-		if (ns->tup.encryption) {
+		if (tup->encryption) {
 			set_bit(IPS_NATCAP_ENC_BIT, &master->status);
 		}
 		switch(iph->protocol) {
@@ -1873,10 +4001,16 @@ static unsigned int natcap_client_post_master_out_hook(void *priv,
 						NATCAP_WARN("(CPMO)" DEBUG_UDP_FMT ": natcap_session_init failed\n", DEBUG_UDP_ARG(iph,l4));
 						break;
 				}
-				set_bit(IPS_NATCAP_ACK_BIT, &ct->status);
 				consume_skb(skb);
-				return NF_ACCEPT;
+				goto leg_fail_ack;
+			}
+			if (iph->protocol == IPPROTO_TCP) {
+				struct natcap_session *mns = natcap_session_get(master);
+				if (mns) {
+					mns->syn_stamp = natcap_syn_stamp_now();
+				}
 			}
+			natcap_server_stat_flow_new(master, tup->ip, tup->port);
 		}
 	}
 
@@ -1886,11 +4020,10 @@ static unsigned int natcap_client_post_master_out_hook(void *priv,
 		if (ret != NF_STOLEN) {
 			consume_skb(skb);
 		}
-		return NF_ACCEPT;
+		goto leg_fail;
 	}
 
 	if (master->master != ct) {
-		set_bit(IPS_NATCAP_ACK_BIT, &ct->status);
 		switch (iph->protocol) {
 			case IPPROTO_TCP:
 				NATCAP_ERROR("(CPMO)" DEBUG_TCP_FMT ": bad ct[%pI4:%u->%pI4:%u %pI4:%u<-%pI4:%u] and master[%pI4:%u->%pI4:%u %pI4:%u<-%pI4:%u]\n",
@@ -1920,9 +4053,11 @@ static unsigned int natcap_client_post_master_out_hook(void *priv,
 				break;
 		}
 		consume_skb(skb);
-		return NF_ACCEPT;
+		goto leg_fail_ack;
 	}
 
+	natcap_server_stat_bytes(master, skb->len, IP_CT_DIR_ORIGINAL);
+
 	if (iph->protocol == IPPROTO_TCP) {
 		struct sk_buff *skb_htp = NULL;
 
@@ -1933,17 +4068,15 @@ static unsigned int natcap_client_post_master_out_hook(void *priv,
 		if (ret != 0) {
 			if (skb_is_gso(skb) || (!TCPH(l4)->syn || TCPH(l4)->ack)) {
 				NATCAP_ERROR("(CPMO)" DEBUG_TCP_FMT ": natcap_tcpopt_setup() failed ret=%d\n", DEBUG_TCP_ARG(iph,l4), ret);
-				set_bit(IPS_NATCAP_ACK_BIT, &ct->status);
 				consume_skb(skb);
-				return NF_ACCEPT;
+				goto leg_fail_ack;
 			}
 
 			skb2 = skb_copy(skb, GFP_ATOMIC);
 			if (skb2 == NULL) {
 				NATCAP_ERROR(DEBUG_FMT_PREFIX "alloc_skb fail\n", DEBUG_ARG_PREFIX);
-				set_bit(IPS_NATCAP_ACK_BIT, &ct->status);
 				consume_skb(skb);
-				return NF_ACCEPT;
+				goto leg_fail_ack;
 			}
 			iph = ip_hdr(skb2);
 			l4 = (void *)iph + iph->ihl * 4;
@@ -1956,10 +4089,9 @@ static unsigned int natcap_client_post_master_out_hook(void *priv,
 			ret = natcap_tcpopt_setup(status, skb2, master, &tcpopt, ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.u3.ip, ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.u.tcp.port);
 			if (ret != 0) {
 				NATCAP_ERROR("(CPMO)" DEBUG_TCP_FMT ": natcap_tcpopt_setup() failed ret=%d\n", DEBUG_TCP_ARG(iph,l4), ret);
-				set_bit(IPS_NATCAP_ACK_BIT, &ct->status);
 				consume_skb(skb2);
 				consume_skb(skb);
-				return NF_ACCEPT;
+				goto leg_fail_ack;
 			}
 			tcpopt.header.type |= NATCAP_TCPOPT_SYN;
 			if (iph->daddr == ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.u3.ip) {
@@ -1968,10 +4100,9 @@ static unsigned int natcap_client_post_master_out_hook(void *priv,
 			ret = natcap_tcp_encode(master, skb2, &tcpopt, IP_CT_DIR_ORIGINAL);
 			if (ret != 0) {
 				NATCAP_ERROR("(CPMO)" DEBUG_TCP_FMT ": natcap_tcpopt_setup() failed ret=%d\n", DEBUG_TCP_ARG(iph,l4), ret);
-				set_bit(IPS_NATCAP_ACK_BIT, &ct->status);
 				consume_skb(skb2);
 				consume_skb(skb);
-				return NF_ACCEPT;
+				goto leg_fail_ack;
 			}
 			tcpopt.header.type = NATCAP_TCPOPT_TYPE_NONE;
 			tcpopt.header.opsize = 0;
@@ -2043,7 +4174,6 @@ static unsigned int natcap_client_post_master_out_hook(void *priv,
 		}
 		if (ret != 0) {
 			NATCAP_ERROR("(CPMO)" DEBUG_TCP_FMT ": natcap_tcp_encode() ret=%d, skb2=%p\n", DEBUG_TCP_ARG(iph,l4), ret, skb2);
-			set_bit(IPS_NATCAP_ACK_BIT, &ct->status);
 			if (skb2) {
 				consume_skb(skb2);
 			}
@@ -2051,7 +4181,7 @@ static unsigned int natcap_client_post_master_out_hook(void *priv,
 			if (skb_htp) {
 				consume_skb(skb_htp);
 			}
-			return NF_ACCEPT;
+			goto leg_fail_ack;
 		}
 
 		NATCAP_DEBUG("(CPMO)" DEBUG_TCP_FMT ": after encode\n", DEBUG_TCP_ARG(iph,l4));
@@ -2076,7 +4206,7 @@ static unsigned int natcap_client_post_master_out_hook(void *priv,
 		if (skb_is_gso(skb)) {
 			struct sk_buff *segs;
 
-			segs = skb_gso_segment(skb, 0);
+			segs = natcap_skb_gso_segment(skb);
 			consume_skb(skb);
 			if (IS_ERR(segs)) {
 				if (skb2) {
@@ -2092,50 +4222,21 @@ static unsigned int natcap_client_post_master_out_hook(void *priv,
 			skb = skb2;
 		}
 
-		do {
-			int offlen;
-			struct sk_buff *nskb = skb->next;
-
-			if (skb_tailroom(skb) < 8 && pskb_expand_head(skb, 0, 8, GFP_ATOMIC)) {
-				consume_skb(skb);
-				skb = nskb;
-				NATCAP_ERROR(DEBUG_FMT_PREFIX "pskb_expand_head failed\n", DEBUG_ARG_PREFIX);
-				continue;
-			}
-			iph = ip_hdr(skb);
-			l4 = (void *)iph + iph->ihl * 4;
-
-			offlen = skb_tail_pointer(skb) - (unsigned char *)UDPH(l4) - 4;
-			BUG_ON(offlen < 0);
-			memmove((void *)UDPH(l4) + 4 + 8, (void *)UDPH(l4) + 4, offlen);
-			iph->tot_len = htons(ntohs(iph->tot_len) + 8);
-			UDPH(l4)->len = htons(ntohs(iph->tot_len) - iph->ihl * 4);
-			UDPH(l4)->check = CSUM_MANGLED_0;
-			skb->len += 8;
-			skb->tail += 8;
-			set_byte4((void *)UDPH(l4) + 8, __constant_htonl(0xFFFF0099));
-			iph->protocol = IPPROTO_UDP;
-			skb->ip_summed = CHECKSUM_UNNECESSARY;
-			skb_rcsum_tcpudp(skb);
-			skb->next = NULL;
-
-			NATCAP_DEBUG("(CPMO)" DEBUG_UDP_FMT ": after natcap post out\n", DEBUG_UDP_ARG(iph,l4));
-
-			flow_total_tx_bytes += skb->len;
-			NF_OKFN(skb);
-
-			skb = nskb;
-		} while (skb);
+		skb = natcap_udpenc_pack_list(skb, &flow_total_tx_bytes);
+		if (skb) {
+			NF_OKFN_LIST(skb);
+		}
 
 	} else {
 		if ((IPS_NATCAP_ENC & master->status)) {
-			if (!skb_make_writable(skb, skb->len)) {
+			if (!skb_payload_make_writable(skb)) {
 				NATCAP_ERROR("(CPMO)" DEBUG_UDP_FMT ": natcap_udp_encode() failed\n", DEBUG_UDP_ARG(iph,l4));
 				consume_skb(skb);
-				return NF_ACCEPT;
+				goto leg_fail;
 			}
-			skb_data_hook(skb, iph->ihl * 4 + sizeof(struct udphdr), skb->len - (iph->ihl * 4 + sizeof(struct udphdr)), natcap_data_encode);
-			skb_rcsum_tcpudp(skb);
+			iph = ip_hdr(skb);
+			l4 = (void *)iph + iph->ihl * 4;
+			skb_data_encode_rcsum(skb, iph->ihl * 4 + sizeof(struct udphdr), skb->len - (iph->ihl * 4 + sizeof(struct udphdr)));
 		}
 
 		if (!(IPS_NATCAP_CFM & master->status)) {
@@ -2149,14 +4250,14 @@ static unsigned int natcap_client_post_master_out_hook(void *priv,
 				if (!nskb) {
 					NATCAP_ERROR(DEBUG_FMT_PREFIX "alloc_skb fail\n", DEBUG_ARG_PREFIX);
 					consume_skb(skb);
-					return NF_ACCEPT;
+					goto leg_fail;
 				}
 				if (offset <= 0) {
 					if (pskb_trim(nskb, nskb->len + offset)) {
 						NATCAP_ERROR(DEBUG_FMT_PREFIX "pskb_trim fail: len=%d, offset=%d\n", DEBUG_ARG_PREFIX, nskb->len, offset);
 						consume_skb(nskb);
 						consume_skb(skb);
-						return NF_ACCEPT;
+						goto leg_fail;
 					}
 				} else {
 					nskb->len += offset;
@@ -2192,23 +4293,16 @@ static unsigned int natcap_client_post_master_out_hook(void *priv,
 				flow_total_tx_bytes += nskb->len;
 				NF_OKFN(nskb);
 			} else {
-				int offlen;
-
-				if (skb_tailroom(skb) < 12 && pskb_expand_head(skb, 0, 12, GFP_ATOMIC)) {
-					NATCAP_ERROR(DEBUG_FMT_PREFIX "pskb_expand_head failed\n", DEBUG_ARG_PREFIX);
+				if (natcap_skb_shim_push(skb, iph->ihl * 4 + sizeof(struct udphdr), 12)) {
+					NATCAP_ERROR(DEBUG_FMT_PREFIX "natcap_skb_shim_push failed\n", DEBUG_ARG_PREFIX);
 					consume_skb(skb);
-					return NF_ACCEPT;
+					goto leg_fail;
 				}
 				iph = ip_hdr(skb);
 				l4 = (void *)iph + iph->ihl * 4;
 
-				offlen = skb_tail_pointer(skb) - (unsigned char *)UDPH(l4) - sizeof(struct udphdr);
-				BUG_ON(offlen < 0);
-				memmove((void *)UDPH(l4) + sizeof(struct udphdr) + 12, (void *)UDPH(l4) + sizeof(struct udphdr), offlen);
 				iph->tot_len = htons(ntohs(iph->tot_len) + 12);
 				UDPH(l4)->len = htons(ntohs(iph->tot_len) - iph->ihl * 4);
-				skb->len += 12;
-				skb->tail += 12;
 				set_byte4(l4 + sizeof(struct udphdr), __constant_htonl(0xFFFE0099));
 				if (dns_server == 0) {
 					set_byte4(l4 + sizeof(struct udphdr) + 4, ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.u3.ip);
@@ -2238,6 +4332,13 @@ static unsigned int natcap_client_post_master_out_hook(void *priv,
 	}
 
 out:
+	if (ctns->race_nr) {
+		if (!(IPS_NATCAP_CFM & ct->status) && ++leg < ctns->race_nr) {
+			goto next_leg;
+		}
+		goto eat;
+	}
+
 	iph = ip_hdr(skb_orig);
 	if (iph->protocol == IPPROTO_TCP) {
 		l4 = (void *)iph + iph->ihl * 4;
@@ -2255,6 +4356,19 @@ out:
 eat:
 	consume_skb(skb_orig);
 	return NF_STOLEN;
+
+leg_fail_ack:
+	if (!ctns->race_nr) {
+		set_bit(IPS_NATCAP_ACK_BIT, &ct->status);
+	}
+leg_fail:
+	if (ctns->race_nr) {
+		/* a failed leg neither lets the direct SYN out nor turns the flow direct,
+		 * the next leg is tried and the SYN retransmit races again
+		 */
+		goto out;
+	}
+	return NF_ACCEPT;
 }
 
 static inline int get_rdata(const unsigned char *src_ptr, int src_len, int src_pos, unsigned char *dst_ptr, int dst_size)
@@ -2335,6 +4449,7 @@ static unsigned int natcap_client_pre_master_in_hook(void *priv,
 	struct iphdr *iph;
 	void *l4;
 	struct net *net = &init_net;
+	struct natcap_session *ns;
 
 	if (disabled)
 		return NF_ACCEPT;
@@ -2382,15 +4497,24 @@ static unsigned int natcap_client_pre_master_in_hook(void *priv,
 				return NF_DROP;
 			}
 
+			ns = natcap_session_get(master);
 			if (!(IPS_NATCAP_CFM & master->status) && !test_and_set_bit(IPS_NATCAP_CFM_BIT, &master->status)) {
 				NATCAP_INFO("(CPMI)" DEBUG_TCP_FMT ": got cfm\n", DEBUG_TCP_ARG(iph,l4));
 				set_bit(IPS_NATCAP_ACK_BIT, &ct->status);
+				if (ns && ns->race_nr) {
+					natcap_server_race_settle(master, ct, ns);
+				} else if (!TCPH(l4)->rst) {
+					natcap_race_learn(master->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.u3.ip, NATCAP_RACE_PROXY);
+				}
 			}
 			if (!(IPS_NATCAP_ACK & ct->status)) {
 				NATCAP_INFO("(CPMI)" DEBUG_TCP_FMT ": drop without lock cfm\n", DEBUG_TCP_ARG(iph,l4));
 				if (TCPH(l4)->syn && TCPH(l4)->ack) {
 					natcap_reset_synack(skb, in, ct);
 				}
+				if (ns && ns->race_nr) {
+					nf_ct_kill(ct);
+				}
 				return NF_DROP;
 			}
 
@@ -2452,6 +4576,9 @@ static unsigned int natcap_client_pre_master_in_hook(void *priv,
 			if (!(IPS_NATCAP_CFM & ct->status) && !test_and_set_bit(IPS_NATCAP_CFM_BIT, &ct->status)) {
 				NATCAP_INFO("(CPMI)" DEBUG_TCP_FMT ": got cfm\n", DEBUG_TCP_ARG(iph,l4));
 				set_bit(IPS_NATCAP_ACK_BIT, &ct->status);
+				if (!TCPH(l4)->rst) {
+					natcap_race_learn(ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.u3.ip, NATCAP_RACE_DIRECT);
+				}
 			}
 			if (!(IPS_NATCAP_ACK & ct->status)) {
 				NATCAP_INFO("(CPMI)" DEBUG_TCP_FMT ": drop without lock cfm\n", DEBUG_TCP_ARG(iph,l4));
@@ -2495,6 +4622,7 @@ static unsigned int natcap_client_pre_master_in_hook(void *priv,
 				if (master->tuplehash[IP_CT_DIR_REPLY].tuple.src.u.all != __constant_htons(53)) {
 					//not DNS
 					set_bit(IPS_NATCAP_ACK_BIT, &ct->status);
+					natcap_race_learn(master->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.u3.ip, NATCAP_RACE_PROXY);
 				}
 			}
 			if (master->tuplehash[IP_CT_DIR_REPLY].tuple.src.u.all != __constant_htons(53)) {
@@ -2561,6 +4689,7 @@ static unsigned int natcap_client_pre_master_in_hook(void *priv,
 				if (ct->tuplehash[IP_CT_DIR_REPLY].tuple.src.u.all != __constant_htons(53)) {
 					//not DNS
 					set_bit(IPS_NATCAP_ACK_BIT, &ct->status);
+					natcap_race_learn(ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.u3.ip, NATCAP_RACE_DIRECT);
 				}
 			}
 			if (ct->tuplehash[IP_CT_DIR_REPLY].tuple.src.u.all != __constant_htons(53)) {
@@ -2575,6 +4704,7 @@ static unsigned int natcap_client_pre_master_in_hook(void *priv,
 
 		do {
 			int i, pos;
+			int domain_match = 0;
 			unsigned int v;
 			unsigned short flags;
 			unsigned short qd_count;
@@ -2621,6 +4751,16 @@ static unsigned int natcap_client_pre_master_in_hook(void *priv,
 					}
 				}
 
+				/* only answers that came back through the server are trusted */
+				if (i == 0 && (IPS_NATCAP & ct->status) && natcap_domain_count() != 0) {
+					int qname_len;
+					char qname[256];
+
+					if ((qname_len = get_rdata(p, len, pos, qname, sizeof(qname))) > 0) {
+						domain_match = natcap_domain_match(qname, qname_len);
+					}
+				}
+
 				while (pos < len && ((v = get_byte1(p + pos)) != 0)) {
 					if (v > 0x3F) {
 						pos++;
@@ -2711,7 +4851,10 @@ static unsigned int natcap_client_pre_master_in_hook(void *priv,
 						if (rdlength == 4) {
 							ip = get_byte4(p + pos);
 							NATCAP_DEBUG("(CPMI)" DEBUG_UDP_FMT ": id=0x%04x type=%d, class=%d, ttl=%d, rdlength=%d, ip=%pI4\n", DEBUG_UDP_ARG(iph,l4), id, type, class, ttl, rdlength, &ip);
-							if (!IS_NATCAP_DEBUG()) {
+							if (domain_match) {
+								NATCAP_INFO("(CPMI)" DEBUG_UDP_FMT ": id=0x%04x domain match, proxy ip=%pI4 ttl=%u\n", DEBUG_UDP_ARG(iph,l4), id, &ip, ttl);
+								natcap_domain_ip_add(ip, ttl);
+							} else if (!IS_NATCAP_DEBUG()) {
 								goto dns_done;
 							}
 						}
@@ -2776,6 +4919,12 @@ dns_done:
 				iph->daddr = old_ip;
 			}
 		}
+
+		if (dns_cache) {
+			struct nf_conn *oct = (IPS_NATCAP & ct->status) ? ct->master : ct;
+			natcap_dns_cache_store(skb, oct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.u3.ip,
+					oct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.u.all);
+		}
 	}
 
 	return NF_ACCEPT;
@@ -2789,7 +4938,7 @@ static struct nf_hook_ops client_hooks[] = {
 		.hook = natcap_client_pre_in_hook,
 		.pf = PF_INET,
 		.hooknum = NF_INET_PRE_ROUTING,
-		.priority = NF_IP_PRI_CONNTRACK - 10,
+		.priority = NATCAP_CLIENT_PRE_IN_PRIORITY,
 	},
 	{
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 4, 0)
@@ -2866,11 +5015,22 @@ int natcap_client_init(void)
 
 	natcap_server_info_cleanup();
 	default_mac_addr_init();
+	natcap_syn_fallback_init();
+	natcap_ct_destroy_init();
 	ret = nf_register_hooks(client_hooks, ARRAY_SIZE(client_hooks));
+	if (ret != 0) {
+		natcap_ct_destroy_exit();
+	}
 	return ret;
 }
 
 void natcap_client_exit(void)
 {
 	nf_unregister_hooks(client_hooks, ARRAY_SIZE(client_hooks));
+	natcap_ct_destroy_exit();
+	natcap_syn_fallback_exit();
+	natcap_classifier_load(NULL);
+	natcap_domain_clean();
+	natcap_dns_cache_clean();
+	natcap_server_info_cleanup();
 }
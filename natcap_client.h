@@ -11,6 +11,30 @@
 
 extern unsigned int cnipwhitelist_mode;
 
+extern unsigned int dst_cache_timeout;
+void natcap_dst_cache_flush(void);
+void natcap_dst_cache_invalidate(__be32 ip);
+void natcap_dst_cache_stat_get(unsigned long long *hit, unsigned long long *miss);
+
+int natcap_domain_add(const char *name);
+int natcap_domain_commit(void);
+void natcap_domain_clean(void);
+unsigned int natcap_domain_count(void);
+
+extern unsigned int race_learn_timeout;
+void natcap_race_stat_get(unsigned long long *learned, unsigned long long *avoided, unsigned long long *evicted);
+
+int natcap_classifier_load(const char *path);
+int natcap_classifier_loaded(void);
+
+extern unsigned int syn_fallback_ms;
+extern unsigned int late_bind;
+void natcap_syn_fallback_stat_get(unsigned long long *launched, unsigned long long *answered);
+
+extern unsigned int dns_cache;
+void natcap_dns_cache_clean(void);
+void natcap_dns_cache_stat_get(unsigned long long *hit, unsigned long long *miss, unsigned long long *coalesced, unsigned long long *evicted);
+
 enum {
 	NATCAP_ACL_NONE,
 	NATCAP_ACL_ALLOW,
@@ -41,11 +65,43 @@ void natcap_server_info_change(int change);
 void natcap_server_info_cleanup(void);
 int natcap_server_info_add(const struct tuple *dst);
 int natcap_server_info_delete(const struct tuple *dst);
-void *natcap_server_info_get(loff_t idx);
 void natcap_server_in_touch(__be32 ip);
-void natcap_server_info_select(__be32 ip, __be16 port, struct tuple *dst);
+void natcap_server_info_select(__be32 sip, __be32 ip, __be16 port, struct tuple *dst);
+void natcap_server_rtt_sample(__be32 ip, unsigned int rtt_us);
+void natcap_server_fail_sample(__be32 ip);
+
+extern unsigned int server_dead_timeout;
+extern unsigned int server_dead_fails;
+extern unsigned int server_affinity;
+void natcap_server_stat_get(unsigned long long *evicted);
+
+extern unsigned int server_race;
+int natcap_server_info_select_race(__be32 sip, __be32 ip, __be16 port, struct tuple *dst, int n);
+void natcap_server_race_won(__be32 ip);
+void natcap_server_race_stat_get(unsigned long long *launched, unsigned long long *switched);
+
+#define NATCAP_SERVER_RTT_BUCKETS 8
+struct natcap_server_info_stat {
+	struct tuple server;
+	unsigned long long flows_new;
+	unsigned long long flows_active;
+	unsigned int flows_per_sec;
+	unsigned long long tx_bytes;
+	unsigned long long rx_bytes;
+	unsigned long long syn_timeouts;
+	unsigned long long rsts;
+	unsigned long long rtt_hist[NATCAP_SERVER_RTT_BUCKETS];
+	unsigned int srtt_us;
+	unsigned int loss;
+	int dead;
+	unsigned long long race_won;
+};
+int natcap_server_info_stat_get(loff_t idx, struct natcap_server_info_stat *st);
+void natcap_server_stat_flow_new(struct nf_conn *ct, __be32 ip, __be16 port);
+void natcap_server_stat_bytes(struct nf_conn *ct, unsigned int len, int dir);
+void natcap_server_stat_rst(struct nf_conn *ct);
 
-const struct tuple *natcap_server_info_current(void);
+void natcap_server_info_current(struct tuple *dst);
 
 int natcap_client_init(void);
 void natcap_client_exit(void);
@@ -8,6 +8,8 @@
 #include <linux/spinlock.h>
 #include <linux/rcupdate.h>
 #include <linux/highmem.h>
+#include <linux/sort.h>
+#include <linux/mutex.h>
 #include <linux/udp.h>
 #include <linux/netfilter.h>
 #include <net/netfilter/nf_conntrack.h>
@@ -21,6 +23,7 @@
 #include <linux/netfilter/xt_set.h>
 #include "natcap_common.h"
 #include "natcap_client.h"
+#include "natcap_algo.h"
 
 unsigned int natcap_touch_timeout = 32;
 
@@ -125,40 +128,49 @@ static void dnatcap_map_init(void)
 
 void natcap_data_encode(unsigned char *buf, int len)
 {
-	int i;
-	for (i = 0; i < len; i++) {
-		buf[i] = natcap_map[buf[i]];
-	}
+	natcap_map_buf(natcap_map, buf, len);
 }
 
 void natcap_data_decode(unsigned char *buf, int len)
 {
-	int i;
-	for (i = 0; i < len; i++) {
-		buf[i] = dnatcap_map[buf[i]];
-	}
+	natcap_map_buf(dnatcap_map, buf, len);
 }
 
-void skb_data_hook(struct sk_buff *skb, int offset, int len, void (*update)(unsigned char *, int))
+#ifdef CONFIG_HIGHMEM
+#define natcap_frag_map(frag) kmap_atomic(skb_frag_page(frag))
+#define natcap_frag_unmap(vaddr) kunmap_atomic(vaddr)
+#else
+/* lowmem pages are always mapped, no per frag kmap needed */
+#define natcap_frag_map(frag) page_address(skb_frag_page(frag))
+#define natcap_frag_unmap(vaddr) do { (void)(vaddr); } while (0)
+#endif
+
+/* linear data and page frags of one skb (frag_list excluded),
+ * returns the bytes done
+ */
+static __always_inline int __skb_data_map_frags(struct sk_buff *skb, int offset, int len,
+		const unsigned char *map, __wsum *csum, int pos, const int do_csum)
 {
 	int start = skb_headlen(skb);
 	int i, copy = start - offset;
-	struct sk_buff *frag_iter;
-	int pos = 0;
+	int done = 0;
 
 	if (copy > 0) {
 		if (copy > len)
 			copy = len;
-		update(skb->data + offset, copy);
+		natcap_map_buf(map, skb->data + offset, copy);
+		if (do_csum)
+			*csum = csum_block_add(*csum, csum_partial(skb->data + offset, copy, 0), pos);
+		done += copy;
 		if ((len -= copy) == 0)
-			return;
+			return done;
 		offset += copy;
-		pos	= copy;
+		pos    += copy;
 	}
 
 	for (i = 0; i < skb_shinfo(skb)->nr_frags; i++) {
 		int end;
-		skb_frag_t *frag = &skb_shinfo(skb)->frags[i];
+		const skb_frag_t *frag = &skb_shinfo(skb)->frags[i];
 
 		WARN_ON(start > offset + len);
 
@@ -168,19 +180,45 @@ void skb_data_hook(struct sk_buff *skb, int offset, int len, void (*update)(unsi
 
 			if (copy > len)
 				copy = len;
-			vaddr = kmap_atomic(skb_frag_page(frag));
-			update(vaddr + frag->page_offset + offset - start, copy);
-			kunmap_atomic(vaddr);
+			vaddr = natcap_frag_map(frag);
+			natcap_map_buf(map, vaddr + frag->page_offset + offset - start, copy);
+			if (do_csum)
+				*csum = csum_block_add(*csum, csum_partial(vaddr + frag->page_offset + offset - start, copy, 0), pos);
+			natcap_frag_unmap(vaddr);
+			done += copy;
 			if (!(len -= copy))
-				return;
+				return done;
 			offset += copy;
 			pos    += copy;
 		}
 		start = end;
 	}
 
+	return done;
+}
+
+/* substitute len bytes from offset through map over linear data, page frags
+ * and the frag_list skbs, optionally folding the checksum of the result into csum.
+ * frag_list is walked flat: skbs in a frag_list never carry a frag_list themselves
+ */
+static __always_inline __wsum __skb_data_map(struct sk_buff *skb, int offset, int len,
+		const unsigned char *map, __wsum csum, int pos, const int do_csum)
+{
+	struct sk_buff *frag_iter;
+	int i, start, done;
+
+	done = __skb_data_map_frags(skb, offset, len, map, &csum, pos, do_csum);
+	if ((len -= done) == 0)
+		return csum;
+	offset += done;
+	pos    += done;
+
+	start = skb_headlen(skb);
+	for (i = 0; i < skb_shinfo(skb)->nr_frags; i++)
+		start += skb_frag_size(&skb_shinfo(skb)->frags[i]);
+
 	skb_walk_frags(skb, frag_iter) {
-		int end;
+		int end, copy;
 
 		WARN_ON(start > offset + len);
 
@@ -188,9 +226,10 @@ void skb_data_hook(struct sk_buff *skb, int offset, int len, void (*update)(unsi
 		if ((copy = end - offset) > 0) {
 			if (copy > len)
 				copy = len;
-			skb_data_hook(frag_iter, offset - start, copy, update);
+			WARN_ON_ONCE(skb_has_frag_list(frag_iter));
+			__skb_data_map_frags(frag_iter, offset - start, copy, map, &csum, pos, do_csum);
 			if ((len -= copy) == 0)
-				return;
+				return csum;
 			offset += copy;
 			pos    += copy;
 		}
@@ -198,7 +237,359 @@ void skb_data_hook(struct sk_buff *skb, int offset, int len, void (*update)(unsi
 	}
 	BUG_ON(len);
 
-	return;
+	return csum;
+}
+
+void skb_data_encode(struct sk_buff *skb, int offset, int len)
+{
+	__skb_data_map(skb, offset, len, natcap_map, 0, 0, 0);
+}
+
+void skb_data_decode(struct sk_buff *skb, int offset, int len)
+{
+	__skb_data_map(skb, offset, len, dnatcap_map, 0, 0, 0);
+}
+
+struct natcap_writable_stat {
+	unsigned long long copied_bytes;
+	unsigned long long inplace_bytes;
+};
+static DEFINE_PER_CPU(struct natcap_writable_stat, natcap_writable_stat);
+
+/* like skb_make_writable(skb, skb->len) but without linearizing the skb:
+ * page frags owned by this skb alone are left in place to be transformed there,
+ * only frags shared with a clone or with user pages are copied into new pages
+ */
+int skb_payload_make_writable(struct sk_buff *skb)
+{
+	int i, shared;
+	unsigned int headlen = skb_headlen(skb);
+
+	if (skb_has_frag_list(skb) || (skb_shinfo(skb)->tx_flags & SKBTX_DEV_ZEROCOPY)) {
+		this_cpu_add(natcap_writable_stat.copied_bytes, skb->len);
+		return skb_make_writable(skb, skb->len);
+	}
+
+	shared = skb_cloned(skb);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 10, 0)
+	shared = shared || skb_has_shared_frag(skb);
+#endif
+
+	if (skb_cloned(skb)) {
+		/* get a private head and shinfo first, the frag pages stay shared with the clone */
+		if (pskb_expand_head(skb, 0, 0, GFP_ATOMIC)) {
+			return 0;
+		}
+		this_cpu_add(natcap_writable_stat.copied_bytes, headlen);
+	} else {
+		this_cpu_add(natcap_writable_stat.inplace_bytes, headlen);
+	}
+	if (!skb_make_writable(skb, headlen)) {
+		return 0;
+	}
+
+	for (i = 0; i < skb_shinfo(skb)->nr_frags; i++) {
+		skb_frag_t *frag = &skb_shinfo(skb)->frags[i];
+		unsigned int size = skb_frag_size(frag);
+		unsigned int order, copied;
+		struct page *page;
+		u8 *src, *dst;
+
+		if (!shared) {
+			this_cpu_add(natcap_writable_stat.inplace_bytes, size);
+			continue;
+		}
+
+		order = get_order(size);
+		page = alloc_pages(GFP_ATOMIC | __GFP_COMP, order);
+		if (!page) {
+			return 0;
+		}
+		/* lowmem: the whole compound page is mapped, the source may span highmem pages */
+		dst = page_address(page);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+		{
+			struct page *p;
+			u32 p_off, p_len;
+
+			copied = 0;
+			skb_frag_foreach_page(frag, frag->page_offset, size, p, p_off, p_len, copied) {
+				src = kmap_atomic(p);
+				memcpy(dst + copied, src + p_off, p_len);
+				kunmap_atomic(src);
+			}
+		}
+#else
+		for (copied = 0; copied < size; ) {
+			unsigned int off = frag->page_offset + copied;
+			unsigned int len = min_t(unsigned int, size - copied, PAGE_SIZE - offset_in_page(off));
+
+			src = kmap_atomic(skb_frag_page(frag) + (off >> PAGE_SHIFT));
+			memcpy(dst + copied, src + offset_in_page(off), len);
+			kunmap_atomic(src);
+			copied += len;
+		}
+#endif
+
+		__skb_frag_unref(frag);
+		__skb_frag_set_page(frag, page);
+		frag->page_offset = 0;
+		skb->truesize += (PAGE_SIZE << order) - size;
+		this_cpu_add(natcap_writable_stat.copied_bytes, size);
+	}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 10, 0)
+	if (shared) {
+		skb_shinfo(skb)->tx_flags &= ~SKBTX_SHARED_FRAG;
+	}
+#endif
+
+	return 1;
+}
+
+void natcap_writable_stat_get(unsigned long long *copied, unsigned long long *inplace)
+{
+	int cpu;
+
+	*copied = 0;
+	*inplace = 0;
+	for_each_possible_cpu(cpu) {
+		struct natcap_writable_stat *st = per_cpu_ptr(&natcap_writable_stat, cpu);
+		*copied += st->copied_bytes;
+		*inplace += st->inplace_bytes;
+	}
+}
+
+/* substitution + skb_rcsum_tcpudp() in one walk:
+ * the payload checksum is accumulated right after each chunk is updated,
+ * while the chunk is still hot in cache
+ */
+static int __skb_data_map_rcsum(struct sk_buff *skb, int offset, int len, const unsigned char *map)
+{
+	struct iphdr *iph = ip_hdr(skb);
+	int tot_len = ntohs(iph->tot_len);
+	int l4_len;
+	__sum16 *check;
+	__wsum skbcsum;
+
+	if (skb->ip_summed == CHECKSUM_PARTIAL || skb->len != tot_len ||
+			(iph->protocol != IPPROTO_TCP && iph->protocol != IPPROTO_UDP) ||
+			offset < iph->ihl * 4 || offset + len != tot_len) {
+		__skb_data_map(skb, offset, len, map, 0, 0, 0);
+		return skb_rcsum_tcpudp(skb);
+	}
+
+	if (iph->protocol == IPPROTO_TCP) {
+		check = &((struct tcphdr *)((void *)iph + iph->ihl * 4))->check;
+	} else {
+		check = &((struct udphdr *)((void *)iph + iph->ihl * 4))->check;
+		if (*check == 0) {
+			/* no udp checksum, nothing to accumulate */
+			__skb_data_map(skb, offset, len, map, 0, 0, 0);
+			return skb_rcsum_tcpudp(skb);
+		}
+	}
+
+	iph->check = 0;
+	iph->check = ip_fast_csum(iph, iph->ihl);
+
+	l4_len = tot_len - iph->ihl * 4;
+	*check = 0;
+	skbcsum = skb_checksum(skb, iph->ihl * 4, offset - iph->ihl * 4, 0);
+	skbcsum = __skb_data_map(skb, offset, len, map, skbcsum, offset - iph->ihl * 4, 1);
+	*check = csum_tcpudp_magic(iph->saddr, iph->daddr, l4_len, iph->protocol, skbcsum);
+	if (iph->protocol == IPPROTO_UDP && *check == 0)
+		*check = CSUM_MANGLED_0;
+
+	if (skb->ip_summed == CHECKSUM_COMPLETE) {
+		skb->ip_summed = CHECKSUM_UNNECESSARY;
+	}
+
+	return 0;
+}
+
+int skb_data_encode_rcsum(struct sk_buff *skb, int offset, int len)
+{
+	return __skb_data_map_rcsum(skb, offset, len, natcap_map);
+}
+
+int skb_data_decode_rcsum(struct sk_buff *skb, int offset, int len)
+{
+	return __skb_data_map_rcsum(skb, offset, len, dnatcap_map);
+}
+
+struct natcap_csum_stat {
+	unsigned long long offload_kept;
+	unsigned long long offload_lost;
+};
+static DEFINE_PER_CPU(struct natcap_csum_stat, natcap_csum_stat);
+
+/* called right before a CHECKSUM_PARTIAL skb gets its checksum done in software */
+void skb_csum_offload_lost(struct sk_buff *skb)
+{
+	if (skb->ip_summed == CHECKSUM_PARTIAL) {
+		this_cpu_inc(natcap_csum_stat.offload_lost);
+	}
+}
+
+/* software segmentation of the UDPENC path: the 8-byte shim splits the inner
+ * tcp header, so the stack cannot segment the encapsulated packet for us.
+ * Segment once at POST_ROUTING, keeping scatter-gather and checksum offload
+ * of the output device, so segments share the original pages and leave with
+ * CHECKSUM_PARTIAL instead of being copied and summed in software
+ */
+struct sk_buff *natcap_skb_gso_segment(struct sk_buff *skb)
+{
+	netdev_features_t features = 0;
+
+	if (skb->dev) {
+		features = skb->dev->features & (NETIF_F_SG | NETIF_F_HW_CSUM | NETIF_F_IP_CSUM);
+	}
+	if (!(features & (NETIF_F_HW_CSUM | NETIF_F_IP_CSUM))) {
+		skb_csum_offload_lost(skb);
+	}
+
+	return skb_gso_segment(skb, features);
+}
+
+/* wrap every segment of the list into UDPENC, dropping the ones that fail,
+ * and return the surviving list so it can be sent back to back by NF_OKFN_LIST
+ */
+struct sk_buff *natcap_udpenc_pack_list(struct sk_buff *skb, unsigned long long *tx_bytes)
+{
+	struct iphdr *iph;
+	void *l4;
+	struct sk_buff *head = NULL;
+	struct sk_buff **pprev = &head;
+
+	while (skb) {
+		struct sk_buff *nskb = skb->next;
+
+		skb->next = NULL;
+		if (natcap_skb_shim_push(skb, ip_hdr(skb)->ihl * 4 + 4, 8)) {
+			consume_skb(skb);
+			skb = nskb;
+			NATCAP_ERROR(DEBUG_FMT_PREFIX "natcap_skb_shim_push failed\n", DEBUG_ARG_PREFIX);
+			continue;
+		}
+		iph = ip_hdr(skb);
+		l4 = (void *)iph + iph->ihl * 4;
+
+		iph->tot_len = htons(ntohs(iph->tot_len) + 8);
+		UDPH(l4)->len = htons(ntohs(iph->tot_len) - iph->ihl * 4);
+		UDPH(l4)->check = CSUM_MANGLED_0;
+		set_byte4((void *)UDPH(l4) + 8, __constant_htonl(0xFFFF0099));
+		iph->protocol = IPPROTO_UDP;
+		if (skb->ip_summed != CHECKSUM_PARTIAL) {
+			skb->ip_summed = CHECKSUM_UNNECESSARY;
+		}
+		skb_rcsum_tcpudp(skb);
+
+		NATCAP_DEBUG(DEBUG_FMT_PREFIX "UDPENC %pI4:%u->%pI4:%u len=%u\n", DEBUG_ARG_PREFIX,
+				&iph->saddr, ntohs(UDPH(l4)->source), &iph->daddr, ntohs(UDPH(l4)->dest), skb->len);
+
+		if (tx_bytes) {
+			*tx_bytes += skb->len;
+		}
+		*pprev = skb;
+		pprev = &skb->next;
+		skb = nskb;
+	}
+
+	return head;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 4, 0)
+/* run one segment through PRE_ROUTING again starting at the hook of @priority,
+ * the hooks in front of it (raw, defrag, ...) already saw the aggregate once
+ */
+static void natcap_gro_segment_continue(struct sk_buff *skb, const struct nf_hook_state *state, int priority)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 10, 0)
+	NF_HOOK_THRESH(NFPROTO_IPV4, NF_INET_PRE_ROUTING, state->net, state->sk, skb, state->in, state->out, state->okfn, priority);
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(4, 14, 0)
+	struct nf_hook_state st;
+	struct nf_hook_entry *e;
+
+	e = rcu_dereference(state->net->nf.hooks[NFPROTO_IPV4][NF_INET_PRE_ROUTING]);
+	while (e && e->orig_ops->priority < priority) {
+		e = rcu_dereference(e->next);
+	}
+	if (!e) {
+		kfree_skb(skb);
+		return;
+	}
+	nf_hook_state_init(&st, NF_INET_PRE_ROUTING, NFPROTO_IPV4, state->in, state->out, state->sk, state->net, state->okfn);
+	if (nf_hook_slow(skb, &st, e) == 1) {
+		state->okfn(state->net, state->sk, skb);
+	}
+#else
+	const struct nf_hook_entries *e;
+	struct nf_hook_ops **ops;
+	struct nf_hook_state st;
+	unsigned int i;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 16, 0)
+	e = rcu_dereference(state->net->nf.hooks[NFPROTO_IPV4][NF_INET_PRE_ROUTING]);
+#else
+	e = rcu_dereference(state->net->nf.hooks_ipv4[NF_INET_PRE_ROUTING]);
+#endif
+	if (!e) {
+		kfree_skb(skb);
+		return;
+	}
+	ops = nf_hook_entries_get_hook_ops(e);
+	for (i = 0; i < e->num_hook_entries && ops[i]->priority < priority; i++);
+	if (i == e->num_hook_entries) {
+		kfree_skb(skb);
+		return;
+	}
+	nf_hook_state_init(&st, NF_INET_PRE_ROUTING, NFPROTO_IPV4, state->in, state->out, state->sk, state->net, state->okfn);
+	if (nf_hook_slow(skb, &st, e, i) == 1) {
+		state->okfn(state->net, state->sk, skb);
+	}
+#endif
+}
+
+/* UDP GRO (udp-gro-forwarding/fraglist) hands us many UDPENC datagrams in one skb.
+ * Split it back into datagrams right here and continue PRE_ROUTING for each of them
+ * from the calling hook (registered at @priority), so the driver, GRO and ip_rcv work
+ * below netfilter stays batched while every datagram is still stripped and decoded on its own
+ */
+unsigned int natcap_gro_segment_reinject(struct sk_buff *skb, const struct nf_hook_state *state, int priority)
+{
+	struct sk_buff *segs, *nskb;
+
+	segs = __skb_gso_segment(skb, 0, false);
+	if (IS_ERR(segs)) {
+		return NF_DROP;
+	}
+	if (segs == NULL) {
+		return NF_ACCEPT;
+	}
+	consume_skb(skb);
+
+	do {
+		nskb = segs->next;
+		segs->next = NULL;
+		natcap_gro_segment_continue(segs, state, priority);
+		segs = nskb;
+	} while (segs);
+
+	return NF_STOLEN;
+}
+#endif
+
+void natcap_csum_stat_get(unsigned long long *kept, unsigned long long *lost)
+{
+	int cpu;
+
+	*kept = 0;
+	*lost = 0;
+	for_each_possible_cpu(cpu) {
+		struct natcap_csum_stat *st = per_cpu_ptr(&natcap_csum_stat, cpu);
+		*kept += st->offload_kept;
+		*lost += st->offload_lost;
+	}
 }
 
 int skb_rcsum_verify(struct sk_buff *skb)
@@ -286,6 +677,7 @@ int skb_rcsum_tcpudp(struct sk_buff *skb)
 			tcph->check = ~csum_tcpudp_magic(iph->saddr, iph->daddr, skb->len - iph->ihl * 4, IPPROTO_TCP, 0);
 			skb->csum_start = (unsigned char *)tcph - skb->head;
 			skb->csum_offset = offsetof(struct tcphdr, check);
+			this_cpu_inc(natcap_csum_stat.offload_kept);
 		} else {
 			iph->check = 0;
 			iph->check = ip_fast_csum(iph, iph->ihl);
@@ -306,6 +698,7 @@ int skb_rcsum_tcpudp(struct sk_buff *skb)
 			udph->check = ~csum_tcpudp_magic(iph->saddr, iph->daddr, skb->len - iph->ihl * 4, IPPROTO_UDP, 0);
 			skb->csum_start = (unsigned char *)udph - skb->head;
 			skb->csum_offset = offsetof(struct udphdr, check);
+			this_cpu_inc(natcap_csum_stat.offload_kept);
 		} else {
 			iph->check = 0;
 			iph->check = ip_fast_csum(iph, iph->ihl);
@@ -327,6 +720,55 @@ int skb_rcsum_tcpudp(struct sk_buff *skb)
 	return 0;
 }
 
+/* open len bytes at offset (counted from the ip header at skb->data) by moving
+ * the offset bytes of headers in front of it into the headroom,
+ * the payload behind offset is not touched
+ */
+int natcap_skb_shim_push(struct sk_buff *skb, int offset, int len)
+{
+	if (!pskb_may_pull(skb, offset)) {
+		return -EINVAL;
+	}
+	if (skb_cow_head(skb, len)) {
+		return -ENOMEM;
+	}
+
+	__skb_push(skb, len);
+	memmove(skb->data, skb->data + len, offset);
+	skb_reset_network_header(skb);
+	skb_set_transport_header(skb, ip_hdr(skb)->ihl * 4);
+
+	return 0;
+}
+
+/* remove len bytes at offset by moving the offset bytes of headers in front
+ * of it forward, the payload behind offset + len is not touched
+ */
+int natcap_skb_shim_pull(struct sk_buff *skb, int offset, int len)
+{
+	int mac_len = 0;
+
+	if (!skb_make_writable(skb, offset + len)) {
+		return -ENOMEM;
+	}
+
+	/* keep an adjacent l2 header in front of the ip header */
+	if (skb_mac_header_was_set(skb) && skb_mac_header(skb) + skb->mac_len == skb->data &&
+			skb_mac_header(skb) >= skb->head) {
+		mac_len = skb->mac_len;
+	}
+
+	memmove(skb->data - mac_len + len, skb->data - mac_len, mac_len + offset);
+	__skb_pull(skb, len);
+	skb_reset_network_header(skb);
+	skb_set_transport_header(skb, ip_hdr(skb)->ihl * 4);
+	if (mac_len) {
+		skb_set_mac_header(skb, -mac_len);
+	}
+
+	return 0;
+}
+
 int natcap_tcpopt_setup(unsigned long status, struct sk_buff *skb, struct nf_conn *ct, struct natcap_TCPOPT *tcpopt, __be32 ip, __be16 port)
 {
 	int size;
@@ -425,37 +867,68 @@ int natcap_tcpopt_setup(unsigned long status, struct sk_buff *skb, struct nf_con
 	}
 }
 
+/* apply the delta of header-only rewrites: cost does not depend on payload size */
+static void natcap_tcp_csum_update(struct sk_buff *skb, __wsum diff)
+{
+	struct iphdr *iph = ip_hdr(skb);
+	struct tcphdr *tcph = (struct tcphdr *)((void *)iph + iph->ihl * 4);
+
+	if (skb->ip_summed == CHECKSUM_PARTIAL) {
+		/* only the pseudo-header seed is needed */
+		skb_rcsum_tcpudp(skb);
+		return;
+	}
+
+	iph->check = 0;
+	iph->check = ip_fast_csum(iph, iph->ihl);
+	tcph->check = natcap_csum_update(tcph->check, diff);
+	if (skb->ip_summed == CHECKSUM_COMPLETE) {
+		skb->ip_summed = CHECKSUM_UNNECESSARY;
+	}
+}
+
+#define TCPH_FLAG_WORD(tcph) (((__be16 *)(tcph))[6])
+
 int natcap_tcp_encode(struct nf_conn *ct, struct sk_buff *skb, const struct natcap_TCPOPT *tcpopt, int dir)
 {
 	struct natcap_session *ns = natcap_session_get(ct);
 	struct iphdr *iph;
 	struct tcphdr *tcph;
-	int offlen;
+	__be32 old;
+	__be16 old_word, old_len;
+	__wsum diff = 0;
+	int update = 0;
 
 	iph = ip_hdr(skb);
 	tcph = (struct tcphdr *)((void *)iph + iph->ihl * 4);
 
+	/* like before, the checksum is only refreshed when the option is added or
+	 * stripped: seq/ack-only shifts are left as is to stay compatible with peers
+	 */
 	if (NTCAP_TCPOPT_TYPE(tcpopt->header.type) == NATCAP_TCPOPT_TYPE_NONE) {
 		goto do_encode;
 	}
 
 	if (tcph->doff * 4 + tcpopt->header.opsize > 60)
 		return -1;
-	if (skb_tailroom(skb) < tcpopt->header.opsize && pskb_expand_head(skb, 0, tcpopt->header.opsize, GFP_ATOMIC)) {
+	if (natcap_skb_shim_push(skb, iph->ihl * 4 + sizeof(struct tcphdr), tcpopt->header.opsize)) {
 		return -2;
 	}
 	iph = ip_hdr(skb);
 	tcph = (struct tcphdr *)((void *)iph + iph->ihl * 4);
 
-	offlen = skb_tail_pointer(skb) - (unsigned char *)tcph - sizeof(struct tcphdr);
-	BUG_ON(offlen < 0);
-	memmove((void *)tcph + sizeof(struct tcphdr) + tcpopt->header.opsize, (void *)tcph + sizeof(struct tcphdr), offlen);
 	memcpy((void *)tcph + sizeof(struct tcphdr), (void *)tcpopt, tcpopt->header.opsize);
 
+	old_word = TCPH_FLAG_WORD(tcph);
+	old_len = htons(ntohs(iph->tot_len) - iph->ihl * 4);
 	tcph->doff = (tcph->doff * 4 + tcpopt->header.opsize) / 4;
 	iph->tot_len = htons(ntohs(iph->tot_len) + tcpopt->header.opsize);
-	skb->len += tcpopt->header.opsize;
-	skb->tail += tcpopt->header.opsize;
+
+	/* opsize is 4 bytes aligned, the payload keeps its 16-bit word alignment */
+	diff = csum_partial((void *)tcpopt, tcpopt->header.opsize, diff);
+	diff = natcap_csum_diff(diff, (__force __wsum)old_word, (__force __wsum)TCPH_FLAG_WORD(tcph));
+	diff = natcap_csum_diff(diff, (__force __wsum)old_len, (__force __wsum)htons(ntohs(iph->tot_len) - iph->ihl * 4));
+	update = 1;
 
 do_encode:
 	if (ns) {
@@ -467,10 +940,14 @@ do_encode:
 					ct->proto.tcp.seen[0].td_maxend -= ns->tcp_seq_offset;
 				}
 				spin_unlock_bh(&ct->lock);
+				old = tcph->seq;
 				tcph->seq = htonl(ntohl(tcph->seq) - ns->tcp_seq_offset);
+				diff = natcap_csum_diff(diff, (__force __wsum)old, (__force __wsum)tcph->seq);
 			}
 			if (ns->tcp_ack_offset) {
+				old = tcph->ack_seq;
 				tcph->ack_seq = htonl(ntohl(tcph->ack_seq) - ns->tcp_ack_offset);
+				diff = natcap_csum_diff(diff, (__force __wsum)old, (__force __wsum)tcph->ack_seq);
 			}
 		} else {
 			if (ns->tcp_ack_offset) {
@@ -480,22 +957,27 @@ do_encode:
 					ct->proto.tcp.seen[1].td_maxend -= ns->tcp_ack_offset;
 				}
 				spin_unlock_bh(&ct->lock);
+				old = tcph->seq;
 				tcph->seq = htonl(ntohl(tcph->seq) - ns->tcp_ack_offset);
+				diff = natcap_csum_diff(diff, (__force __wsum)old, (__force __wsum)tcph->seq);
 			}
 			if (ns->tcp_seq_offset) {
+				old = tcph->ack_seq;
 				tcph->ack_seq = htonl(ntohl(tcph->ack_seq) - ns->tcp_seq_offset);
+				diff = natcap_csum_diff(diff, (__force __wsum)old, (__force __wsum)tcph->ack_seq);
 			}
 		}
 	}
 
 	if (tcpopt->header.encryption) {
-		if (!skb_make_writable(skb, skb->len)) {
+		if (!skb_payload_make_writable(skb)) {
 			return -3;
 		}
-		skb_data_hook(skb, iph->ihl * 4 + tcph->doff * 4, skb->len - (iph->ihl * 4 + tcph->doff * 4), natcap_data_encode);
-	}
-	if (tcpopt->header.encryption || NTCAP_TCPOPT_TYPE(tcpopt->header.type) != NATCAP_TCPOPT_TYPE_NONE) {
-		skb_rcsum_tcpudp(skb);
+		iph = ip_hdr(skb);
+		tcph = (struct tcphdr *)((void *)iph + iph->ihl * 4);
+		skb_data_encode_rcsum(skb, iph->ihl * 4 + tcph->doff * 4, skb->len - (iph->ihl * 4 + tcph->doff * 4));
+	} else if (update) {
+		natcap_tcp_csum_update(skb, diff);
 	}
 
 	return 0;
@@ -507,7 +989,10 @@ int natcap_tcp_decode(struct nf_conn *ct, struct sk_buff *skb, struct natcap_TCP
 	struct iphdr *iph;
 	struct tcphdr *tcph;
 	struct natcap_TCPOPT *opt;
-	int offlen;
+	__be32 old;
+	__be16 old_word, old_len;
+	__wsum diff = 0;
+	int update = 0;
 
 	iph = ip_hdr(skb);
 	tcph = (struct tcphdr *)((void *)iph + iph->ihl * 4);
@@ -525,8 +1010,13 @@ int natcap_tcp_decode(struct nf_conn *ct, struct sk_buff *skb, struct natcap_TCP
 		goto done;
 	}
 	if ((tcpopt->header.type & NATCAP_TCPOPT_SYN)) {
+		old = tcph->seq;
 		tcph->seq = TCPOPT_NATCAP;
+		diff = natcap_csum_diff(diff, (__force __wsum)old, (__force __wsum)tcph->seq);
+		old = tcph->ack_seq;
 		tcph->ack_seq = TCPOPT_NATCAP;
+		diff = natcap_csum_diff(diff, (__force __wsum)old, (__force __wsum)tcph->ack_seq);
+		update = 1;
 		goto do_decode;
 	}
 	if ((tcpopt->header.type & NATCAP_TCPOPT_CONFUSION) && ns) {
@@ -542,14 +1032,21 @@ int natcap_tcp_decode(struct nf_conn *ct, struct sk_buff *skb, struct natcap_TCP
 		}
 	}
 
-	offlen = skb_tail_pointer(skb) - (unsigned char *)((void *)tcph + sizeof(struct tcphdr) + tcpopt->header.opsize);
-	BUG_ON(offlen < 0);
-	memmove((void *)tcph + sizeof(struct tcphdr), (void *)tcph + sizeof(struct tcphdr) + tcpopt->header.opsize, offlen);
+	if (natcap_skb_shim_pull(skb, iph->ihl * 4 + sizeof(struct tcphdr), tcpopt->header.opsize)) {
+		return -2;
+	}
+	iph = ip_hdr(skb);
+	tcph = (struct tcphdr *)((void *)iph + iph->ihl * 4);
 
+	old_word = TCPH_FLAG_WORD(tcph);
+	old_len = htons(ntohs(iph->tot_len) - iph->ihl * 4);
 	tcph->doff = (tcph->doff * 4 - tcpopt->header.opsize) / 4;
 	iph->tot_len = htons(ntohs(iph->tot_len) - tcpopt->header.opsize);
-	skb->len -= tcpopt->header.opsize;
-	skb->tail -= tcpopt->header.opsize;
+
+	diff = csum_sub(diff, csum_partial((void *)tcpopt, tcpopt->header.opsize, 0));
+	diff = natcap_csum_diff(diff, (__force __wsum)old_word, (__force __wsum)TCPH_FLAG_WORD(tcph));
+	diff = natcap_csum_diff(diff, (__force __wsum)old_len, (__force __wsum)htons(ntohs(iph->tot_len) - iph->ihl * 4));
+	update = (tcpopt->header.opsize & 1) ? -1 : 1;
 
 do_decode:
 	if (ns) {
@@ -561,10 +1058,14 @@ do_decode:
 					ct->proto.tcp.seen[0].td_maxend += ns->tcp_seq_offset;
 				}
 				spin_unlock_bh(&ct->lock);
+				old = tcph->seq;
 				tcph->seq = htonl(ntohl(tcph->seq) + ns->tcp_seq_offset);
+				diff = natcap_csum_diff(diff, (__force __wsum)old, (__force __wsum)tcph->seq);
 			}
 			if (ns->tcp_ack_offset) {
+				old = tcph->ack_seq;
 				tcph->ack_seq = htonl(ntohl(tcph->ack_seq) + ns->tcp_ack_offset);
+				diff = natcap_csum_diff(diff, (__force __wsum)old, (__force __wsum)tcph->ack_seq);
 			}
 		} else {
 			if (ns->tcp_ack_offset) {
@@ -574,22 +1075,30 @@ do_decode:
 					ct->proto.tcp.seen[1].td_maxend += ns->tcp_ack_offset;
 				}
 				spin_unlock_bh(&ct->lock);
+				old = tcph->seq;
 				tcph->seq = htonl(ntohl(tcph->seq) + ns->tcp_ack_offset);
+				diff = natcap_csum_diff(diff, (__force __wsum)old, (__force __wsum)tcph->seq);
 			}
 			if (ns->tcp_seq_offset) {
+				old = tcph->ack_seq;
 				tcph->ack_seq = htonl(ntohl(tcph->ack_seq) + ns->tcp_seq_offset);
+				diff = natcap_csum_diff(diff, (__force __wsum)old, (__force __wsum)tcph->ack_seq);
 			}
 		}
 	}
 
 	if (tcpopt->header.encryption) {
-		if (!skb_make_writable(skb, skb->len)) {
+		if (!skb_payload_make_writable(skb)) {
 			return -3;
 		}
-		skb_data_hook(skb, iph->ihl * 4 + tcph->doff * 4, skb->len - (iph->ihl * 4 + tcph->doff * 4), natcap_data_decode);
-	}
-	if (tcpopt->header.encryption || NTCAP_TCPOPT_TYPE(tcpopt->header.type) != NATCAP_TCPOPT_TYPE_NONE) {
+		iph = ip_hdr(skb);
+		tcph = (struct tcphdr *)((void *)iph + iph->ihl * 4);
+		skb_data_decode_rcsum(skb, iph->ihl * 4 + tcph->doff * 4, skb->len - (iph->ihl * 4 + tcph->doff * 4));
+	} else if (update < 0) {
+		/* odd sized option from peer shifts the payload word alignment */
 		skb_rcsum_tcpudp(skb);
+	} else if (update) {
+		natcap_tcp_csum_update(skb, diff);
 	}
 done:
 	return 0;
@@ -632,6 +1141,133 @@ int natcap_tcp_encode_fwdupdate(struct sk_buff *skb, struct tcphdr *tcph, const
 	return 0;
 }
 
+/* compiled cniplist: a read-only 16-8-8 multibit trie answering membership in
+ * at most three memory accesses. Prefixes are staged from natcap_ctl, built
+ * into a new table on commit and swapped in under RCU; when no table is
+ * loaded, lookups fall back to the ipset of the same name
+ */
+static struct natcap_lpm_table __rcu *natcap_cniplist_table = NULL;
+static struct natcap_lpm_prefix *natcap_cniplist_stage = NULL;
+static unsigned int natcap_cniplist_stage_len = 0;
+static unsigned int natcap_cniplist_stage_size = 0;
+static DEFINE_MUTEX(natcap_cniplist_mutex);
+
+/* return 1/0 for member/not, -1 when no table is loaded */
+int natcap_cniplist_test(__be32 ip)
+{
+	int ret = -1;
+	struct natcap_lpm_table *t;
+
+	rcu_read_lock();
+	t = rcu_dereference(natcap_cniplist_table);
+	if (t) {
+		ret = natcap_lpm_lookup(t, ntohl(ip));
+	}
+	rcu_read_unlock();
+
+	return ret;
+}
+
+int natcap_cniplist_add(__be32 ip, unsigned int cidr)
+{
+	int ret = 0;
+
+	if (cidr > 32)
+		return -EINVAL;
+
+	mutex_lock(&natcap_cniplist_mutex);
+	if (natcap_cniplist_stage_len == natcap_cniplist_stage_size) {
+		unsigned int size = natcap_cniplist_stage_size ? natcap_cniplist_stage_size * 2 : 4096;
+		struct natcap_lpm_prefix *p = vmalloc(size * sizeof(*p));
+		if (!p) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		if (natcap_cniplist_stage) {
+			memcpy(p, natcap_cniplist_stage, natcap_cniplist_stage_len * sizeof(*p));
+			vfree(natcap_cniplist_stage);
+		}
+		natcap_cniplist_stage = p;
+		natcap_cniplist_stage_size = size;
+	}
+	natcap_cniplist_stage[natcap_cniplist_stage_len].addr = cidr ? ntohl(ip) & (0xffffffff << (32 - cidr)) : 0;
+	natcap_cniplist_stage[natcap_cniplist_stage_len].cidr = cidr;
+	natcap_cniplist_stage_len++;
+out:
+	mutex_unlock(&natcap_cniplist_mutex);
+	return ret;
+}
+
+static void natcap_cniplist_swap(struct natcap_lpm_table *t)
+{
+	struct natcap_lpm_table *old;
+
+	old = rcu_dereference_protected(natcap_cniplist_table, lockdep_is_held(&natcap_cniplist_mutex));
+	rcu_assign_pointer(natcap_cniplist_table, t);
+	natcap_dst_cache_flush();
+	if (old) {
+		synchronize_rcu();
+		vfree(old);
+	}
+}
+
+static void natcap_cniplist_stage_free(void)
+{
+	if (natcap_cniplist_stage) {
+		vfree(natcap_cniplist_stage);
+		natcap_cniplist_stage = NULL;
+	}
+	natcap_cniplist_stage_len = 0;
+	natcap_cniplist_stage_size = 0;
+}
+
+/* build the staged prefixes and replace the live table with it */
+int natcap_cniplist_commit(void)
+{
+	struct natcap_lpm_table *t;
+
+	mutex_lock(&natcap_cniplist_mutex);
+	if (natcap_cniplist_stage_len == 0) {
+		mutex_unlock(&natcap_cniplist_mutex);
+		return -ENOENT;
+	}
+	t = natcap_lpm_build(natcap_cniplist_stage, natcap_cniplist_stage_len);
+	natcap_cniplist_stage_free();
+	if (IS_ERR(t)) {
+		mutex_unlock(&natcap_cniplist_mutex);
+		return PTR_ERR(t);
+	}
+	NATCAP_println("cniplist table loaded: %u prefixes, %u+%u chunks", t->nr_prefix, t->l2_used, t->l3_used);
+	natcap_cniplist_swap(t);
+	mutex_unlock(&natcap_cniplist_mutex);
+
+	return 0;
+}
+
+/* drop the staged prefixes and the live table, lookups go back to ipset */
+void natcap_cniplist_clean(void)
+{
+	mutex_lock(&natcap_cniplist_mutex);
+	natcap_cniplist_stage_free();
+	natcap_cniplist_swap(NULL);
+	mutex_unlock(&natcap_cniplist_mutex);
+}
+
+unsigned int natcap_cniplist_count(void)
+{
+	unsigned int n = 0;
+	struct natcap_lpm_table *t;
+
+	rcu_read_lock();
+	t = rcu_dereference(natcap_cniplist_table);
+	if (t) {
+		n = t->nr_prefix;
+	}
+	rcu_read_unlock();
+
+	return n;
+}
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 10, 0)
 int ip_set_test_src_ip(const struct nf_hook_state *state, struct sk_buff *skb, const char *ip_set_name)
 #else
@@ -653,6 +1289,14 @@ int ip_set_test_src_ip(const struct net_device *in, const struct net_device *out
 		net = dev_net(out);
 #endif
 
+	if (strcmp(ip_set_name, "cniplist") == 0) {
+		ret = natcap_cniplist_test(ip_hdr(skb)->saddr);
+		if (ret >= 0) {
+			return ret;
+		}
+		ret = 0;
+	}
+
 	memset(&opt, 0, sizeof(opt));
 	opt.family = NFPROTO_IPV4;
 	opt.dim = IPSET_DIM_ONE;
@@ -713,6 +1357,14 @@ int ip_set_test_dst_ip(const struct net_device *in, const struct net_device *out
 		net = dev_net(out);
 #endif
 
+	if (strcmp(ip_set_name, "cniplist") == 0) {
+		ret = natcap_cniplist_test(ip_hdr(skb)->daddr);
+		if (ret >= 0) {
+			return ret;
+		}
+		ret = 0;
+	}
+
 	memset(&opt, 0, sizeof(opt));
 	opt.family = NFPROTO_IPV4;
 	opt.dim = IPSET_DIM_ONE;
@@ -802,6 +1454,7 @@ int ip_set_add_src_ip(const struct net_device *in, const struct net_device *out,
 	}
 
 	ret = ip_set_add(id, skb, &par, &opt);
+	natcap_dst_cache_invalidate(ip_hdr(skb)->saddr);
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 13, 0)
 	ip_set_put_byindex(net, id);
@@ -862,6 +1515,7 @@ int ip_set_add_dst_ip(const struct net_device *in, const struct net_device *out,
 	}
 
 	ret = ip_set_add(id, skb, &par, &opt);
+	natcap_dst_cache_invalidate(ip_hdr(skb)->daddr);
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 13, 0)
 	ip_set_put_byindex(net, id);
@@ -922,6 +1576,7 @@ int ip_set_del_src_ip(const struct net_device *in, const struct net_device *out,
 	}
 
 	ret = ip_set_del(id, skb, &par, &opt);
+	natcap_dst_cache_invalidate(ip_hdr(skb)->saddr);
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 13, 0)
 	ip_set_put_byindex(net, id);
@@ -982,6 +1637,7 @@ int ip_set_del_dst_ip(const struct net_device *in, const struct net_device *out,
 	}
 
 	ret = ip_set_del(id, skb, &par, &opt);
+	natcap_dst_cache_invalidate(ip_hdr(skb)->daddr);
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 13, 0)
 	ip_set_put_byindex(net, id);
@@ -1238,23 +1894,22 @@ int natcap_udp_to_tcp_pack(struct sk_buff *skb, struct natcap_session *ns, int m
 		return -EINVAL;
 	}
 
-	if (!skb_make_writable(skb, iph->ihl * 4 + sizeof(struct tcphdr))) {
+	if (!skb_make_writable(skb, iph->ihl * 4 + sizeof(struct udphdr))) {
 		return -ENOMEM;
 	}
 
-	if (skb_tailroom(skb) < sizeof(struct tcphdr) - sizeof(struct udphdr) && pskb_expand_head(skb, 0, sizeof(struct tcphdr) - sizeof(struct udphdr), GFP_ATOMIC)) {
-		NATCAP_ERROR(DEBUG_FMT_PREFIX "pskb_expand_head failed\n", DEBUG_ARG_PREFIX);
+	if (natcap_skb_shim_push(skb, iph->ihl * 4 + sizeof(struct udphdr), sizeof(struct tcphdr) - sizeof(struct udphdr))) {
+		NATCAP_ERROR(DEBUG_FMT_PREFIX "natcap_skb_shim_push failed\n", DEBUG_ARG_PREFIX);
 		return -ENOMEM;
 	}
 	iph = ip_hdr(skb);
 	l4 = (void *)iph + iph->ihl * 4;
 
-	memmove((void *)UDPH(l4) + sizeof(struct tcphdr), (void *)UDPH(l4) + sizeof(struct udphdr), skb_tail_pointer(skb) - (unsigned char *)UDPH(l4) - sizeof(struct udphdr));
 	iph->tot_len = htons(ntohs(iph->tot_len) + sizeof(struct tcphdr) - sizeof(struct udphdr));
-	skb->len += sizeof(struct tcphdr) - sizeof(struct udphdr);
-	skb->tail += sizeof(struct tcphdr) - sizeof(struct udphdr);
 	iph->protocol = IPPROTO_TCP;
-	skb->ip_summed = CHECKSUM_UNNECESSARY;
+	if (skb->ip_summed != CHECKSUM_PARTIAL) {
+		skb->ip_summed = CHECKSUM_UNNECESSARY;
+	}
 
 	TCPH(l4)->seq = ns->current_seq == 0 ? htonl(jiffies) : ns->current_seq;
 	TCPH(l4)->ack_seq = (m == 0 && ns->current_seq == 0) ? 0 : htonl(ns->foreign_seq);
@@ -1497,6 +2152,8 @@ void natcap_common_exit(void)
 {
 	nf_unregister_hooks(common_hooks, ARRAY_SIZE(common_hooks));
 
+	natcap_cniplist_clean();
+
 	if (cone_nat_array) {
 		void *tmp = cone_nat_array;
 		cone_nat_array = NULL;
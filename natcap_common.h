@@ -161,10 +161,30 @@ extern char htp_confusion_host[64];
 
 extern void natcap_data_encode(unsigned char *buf, int len);
 extern void natcap_data_decode(unsigned char *buf, int len);
-extern void skb_data_hook(struct sk_buff *skb, int offset, int len, void (*update)(unsigned char *, int));
+extern void skb_data_encode(struct sk_buff *skb, int offset, int len);
+extern void skb_data_decode(struct sk_buff *skb, int offset, int len);
+extern int skb_data_encode_rcsum(struct sk_buff *skb, int offset, int len);
+extern int skb_data_decode_rcsum(struct sk_buff *skb, int offset, int len);
+extern int skb_payload_make_writable(struct sk_buff *skb);
+extern void natcap_writable_stat_get(unsigned long long *copied, unsigned long long *inplace);
 
 extern int skb_rcsum_verify(struct sk_buff *skb);
 extern int skb_rcsum_tcpudp(struct sk_buff *skb);
+extern int natcap_skb_shim_push(struct sk_buff *skb, int offset, int len);
+extern int natcap_skb_shim_pull(struct sk_buff *skb, int offset, int len);
+extern void skb_csum_offload_lost(struct sk_buff *skb);
+extern struct sk_buff *natcap_skb_gso_segment(struct sk_buff *skb);
+extern struct sk_buff *natcap_udpenc_pack_list(struct sk_buff *skb, unsigned long long *tx_bytes);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 4, 0)
+extern unsigned int natcap_gro_segment_reinject(struct sk_buff *skb, const struct nf_hook_state *state, int priority);
+#endif
+extern void natcap_csum_stat_get(unsigned long long *kept, unsigned long long *lost);
+
+extern int natcap_cniplist_test(__be32 ip);
+extern int natcap_cniplist_add(__be32 ip, unsigned int cidr);
+extern int natcap_cniplist_commit(void);
+extern void natcap_cniplist_clean(void);
+extern unsigned int natcap_cniplist_count(void);
 
 extern int natcap_tcpopt_setup(unsigned long status, struct sk_buff *skb, struct nf_conn *ct, struct natcap_TCPOPT *tcpopt, __be32 ip, __be16 port);
 extern int natcap_tcp_encode(struct nf_conn *ct, struct sk_buff *skb, const struct natcap_TCPOPT *tcpopt, int dir);
@@ -386,6 +406,17 @@ extern void natcap_common_exit(void);
 	} \
 } while (0)
 
+static inline void natcap_skb_list_dst_share(struct sk_buff *head)
+{
+	struct sk_buff *skb;
+
+	for (skb = head->next; skb; skb = skb->next) {
+		skb_dst_drop(skb);
+		skb_dst_set(skb, dst_clone(skb_dst(head)));
+		skb->dev = head->dev;
+	}
+}
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 13, 0)
 #define NF_OKFN(skb) do { \
 	if (okfn) { \
@@ -396,6 +427,8 @@ extern void natcap_common_exit(void);
 		NATCAP_println("NF_OKFN is null, drop pkt=%p", skb); \
 	} \
 } while (0)
+#define NF_OKFN_READY() (okfn)
+#define NF_OKFN_CALL(skb) okfn(skb)
 
 #elif LINUX_VERSION_CODE < KERNEL_VERSION(4, 1, 0)
 #define NF_OKFN(skb) do { \
@@ -407,6 +440,8 @@ extern void natcap_common_exit(void);
 		NATCAP_println("NF_OKFN is null, drop pkt=%p", skb); \
 	} \
 } while (0)
+#define NF_OKFN_READY() (okfn)
+#define NF_OKFN_CALL(skb) okfn(skb)
 
 #elif LINUX_VERSION_CODE < KERNEL_VERSION(4, 4, 0)
 #define NF_OKFN(skb) do { \
@@ -418,6 +453,8 @@ extern void natcap_common_exit(void);
 		NATCAP_println("NF_OKFN is null, drop pkt=%p", skb); \
 	} \
 } while (0)
+#define NF_OKFN_READY() (state->okfn)
+#define NF_OKFN_CALL(skb) state->okfn(state->sk, skb)
 
 #else
 #define NF_OKFN(skb) do { \
@@ -429,9 +466,44 @@ extern void natcap_common_exit(void);
 		NATCAP_println("NF_OKFN is null, drop pkt=%p", skb); \
 	} \
 } while (0)
+#define NF_OKFN_READY() (state->net && state->okfn)
+#define NF_OKFN_CALL(skb) state->okfn(state->net, state->sk, skb)
 
 #endif
 
+/* send a segment list back to back: the segments share one flow and already
+ * hold the dst of the packet they were cut from, so only when the reroute of
+ * the head picks a new dst is it handed to the rest of the list. On these
+ * kernels there is no list transmit; back to back segments reach the qdisc
+ * together, where bulk dequeue can send them with xmit_more
+ */
+#define NF_OKFN_LIST(skb) do { \
+	struct sk_buff *__nskb; \
+	struct dst_entry *__dst; \
+	if (NF_OKFN_READY()) { \
+		iph = ip_hdr(skb); \
+		__dst = skb_dst(skb); \
+		NF_GW_REROUTE(skb); \
+		if (skb_dst(skb) != __dst) { \
+			natcap_skb_list_dst_share(skb); \
+		} \
+		do { \
+			__nskb = skb->next; \
+			skb->next = NULL; \
+			NF_OKFN_CALL(skb); \
+			skb = __nskb; \
+		} while (skb); \
+	} else { \
+		NATCAP_println("NF_OKFN is null, drop pkt=%p", skb); \
+		do { \
+			__nskb = skb->next; \
+			skb->next = NULL; \
+			kfree_skb(skb); \
+			skb = __nskb; \
+		} while (skb); \
+	} \
+} while (0)
+
 static inline unsigned char get_byte1(const unsigned char *p)
 {
 	return p[0];
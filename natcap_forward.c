@@ -139,7 +139,7 @@ static unsigned int natcap_forward_pre_ct_in_hook(void *priv,
 
 __do_dnat:
 		if (!(IPS_NATCAP & ct->status) && !test_and_set_bit(IPS_NATCAP_BIT, &ct->status)) { /* first time in */
-			natcap_server_info_select(iph->daddr, TCPH(l4)->dest, &server);
+			natcap_server_info_select(iph->saddr, iph->daddr, TCPH(l4)->dest, &server);
 			if (server.ip == 0) {
 				NATCAP_DEBUG("(FPCI)" DEBUG_TCP_FMT ": no server found\n", DEBUG_TCP_ARG(iph,l4));
 				set_bit(IPS_NATCAP_BYPASS_BIT, &ct->status);
@@ -182,7 +182,7 @@ __do_dnat:
 			}
 
 			if (!(IPS_NATCAP & ct->status) && !test_and_set_bit(IPS_NATCAP_BIT, &ct->status)) { /* first time in */
-				natcap_server_info_select(iph->daddr, UDPH(l4)->dest, &server);
+				natcap_server_info_select(iph->saddr, iph->daddr, UDPH(l4)->dest, &server);
 				if (server.ip == 0) {
 					NATCAP_DEBUG("(FPCI)" DEBUG_UDP_FMT ": no server found\n", DEBUG_UDP_ARG(iph,l4));
 					set_bit(IPS_NATCAP_BYPASS_BIT, &ct->status);
@@ -219,7 +219,7 @@ __do_dnat:
 			}
 
 			if (!(IPS_NATCAP & ct->status) && !test_and_set_bit(IPS_NATCAP_BIT, &ct->status)) { /* first time in */
-				natcap_server_info_select(iph->daddr, UDPH(l4)->dest, &server);
+				natcap_server_info_select(iph->saddr, iph->daddr, UDPH(l4)->dest, &server);
 				if (server.ip == 0) {
 					NATCAP_DEBUG("(FPCI)" DEBUG_UDP_FMT ": no server found\n", DEBUG_UDP_ARG(iph,l4));
 					set_bit(IPS_NATCAP_BYPASS_BIT, &ct->status);
@@ -368,7 +368,7 @@ static unsigned int natcap_forward_post_out_hook(void *priv,
 		if (skb_is_gso(skb)) {
 			struct sk_buff *segs;
 
-			segs = skb_gso_segment(skb, 0);
+			segs = natcap_skb_gso_segment(skb);
 			if (IS_ERR(segs)) {
 				return NF_DROP;
 			}
@@ -377,38 +377,10 @@ static unsigned int natcap_forward_post_out_hook(void *priv,
 			skb = segs;
 		}
 
-		do {
-			int offlen;
-			struct sk_buff *nskb = skb->next;
-
-			if (skb_tailroom(skb) < 8 && pskb_expand_head(skb, 0, 8, GFP_ATOMIC)) {
-				consume_skb(skb);
-				skb = nskb;
-				NATCAP_ERROR("pskb_expand_head failed\n");
-				continue;
-			}
-
-			iph = ip_hdr(skb);
-			l4 = (void *)iph + iph->ihl * 4;
-
-			offlen = skb_tail_pointer(skb) - (unsigned char *)UDPH(l4) - 4;
-			BUG_ON(offlen < 0);
-			memmove((void *)UDPH(l4) + 4 + 8, (void *)UDPH(l4) + 4, offlen);
-			iph->tot_len = htons(ntohs(iph->tot_len) + 8);
-			UDPH(l4)->len = htons(ntohs(iph->tot_len) - iph->ihl * 4);
-			UDPH(l4)->check = CSUM_MANGLED_0;
-			skb->len += 8;
-			skb->tail += 8;
-			set_byte4((void *)UDPH(l4) + 8, __constant_htonl(0xFFFF0099));
-			iph->protocol = IPPROTO_UDP;
-			skb->ip_summed = CHECKSUM_UNNECESSARY;
-			skb_rcsum_tcpudp(skb);
-
-			skb->next = NULL;
-			NF_OKFN(skb);
-
-			skb = nskb;
-		} while (skb);
+		skb = natcap_udpenc_pack_list(skb, NULL);
+		if (skb) {
+			NF_OKFN_LIST(skb);
+		}
 
 		return NF_STOLEN;
 	}
@@ -416,6 +388,9 @@ static unsigned int natcap_forward_post_out_hook(void *priv,
 	return NF_ACCEPT;
 }
 
+/* shared with the hook table, GRO segments continue PRE_ROUTING from here */
+#define NATCAP_FORWARD_PRE_IN_PRIORITY (NF_IP_PRI_CONNTRACK - 5)
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 13, 0)
 static unsigned natcap_forward_pre_in_hook(unsigned int hooknum,
 		struct sk_buff *skb,
@@ -478,13 +453,19 @@ static unsigned int natcap_forward_pre_in_hook(void *priv,
 	l4 = (void *)iph + iph->ihl * 4;
 
 	if (skb_is_gso(skb)) {
+		if (get_byte4((void *)UDPH(l4) + 8) != __constant_htonl(0xFFFF0099)) {
+			return NF_ACCEPT;
+		}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 4, 0)
+		NATCAP_DEBUG("(FPI)" DEBUG_UDP_FMT ": gro skb, segment and reinject\n", DEBUG_UDP_ARG(iph,l4));
+		return natcap_gro_segment_reinject(skb, state, NATCAP_FORWARD_PRE_IN_PRIORITY);
+#else
 		NATCAP_ERROR("(FPI)" DEBUG_UDP_FMT ": skb_is_gso\n", DEBUG_UDP_ARG(iph,l4));
 		return NF_ACCEPT;
+#endif
 	}
 
 	if (get_byte4((void *)UDPH(l4) + 8) == __constant_htonl(0xFFFF0099)) {
-		int offlen;
-
 		if (skb->ip_summed == CHECKSUM_NONE) {
 			if (skb_rcsum_verify(skb) != 0) {
 				NATCAP_WARN("(FPI)" DEBUG_UDP_FMT ": skb_rcsum_verify fail\n", DEBUG_UDP_ARG(iph,l4));
@@ -505,12 +486,13 @@ static unsigned int natcap_forward_pre_in_hook(void *priv,
 		iph = ip_hdr(skb);
 		l4 = (void *)iph + iph->ihl * 4;
 
-		offlen = skb_tail_pointer(skb) - (unsigned char *)UDPH(l4) - 4 - 8;
-		BUG_ON(offlen < 0);
-		memmove((void *)UDPH(l4) + 4, (void *)UDPH(l4) + 4 + 8, offlen);
+		if (natcap_skb_shim_pull(skb, iph->ihl * 4 + 4, 8)) {
+			return NF_DROP;
+		}
+		iph = ip_hdr(skb);
+		l4 = (void *)iph + iph->ihl * 4;
+
 		iph->tot_len = htons(ntohs(iph->tot_len) - 8);
-		skb->len -= 8;
-		skb->tail -= 8;
 		iph->protocol = IPPROTO_TCP;
 		skb->ip_summed = CHECKSUM_UNNECESSARY;
 		skb_rcsum_tcpudp(skb);
@@ -544,7 +526,7 @@ static struct nf_hook_ops forward_hooks[] = {
 		.hook = natcap_forward_pre_in_hook,
 		.pf = PF_INET,
 		.hooknum = NF_INET_PRE_ROUTING,
-		.priority = NF_IP_PRI_CONNTRACK - 5,
+		.priority = NATCAP_FORWARD_PRE_IN_PRIORITY,
 	},
 	{
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 4, 0)
@@ -580,4 +562,5 @@ int natcap_forward_init(void)
 void natcap_forward_exit(void)
 {
 	nf_unregister_hooks(forward_hooks, ARRAY_SIZE(forward_hooks));
+	natcap_server_info_cleanup();
 }
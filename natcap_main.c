@@ -48,11 +48,127 @@ static struct class *natcap_class;
 static struct device *natcap_dev;
 
 static char natcap_ctl_buffer[PAGE_SIZE];
+
+/* snprintf returns the length it wanted, a long auth_http_redirect_url
+ * can push that past the buffer
+ */
+static inline void natcap_ctl_buffer_end(int n)
+{
+	if (n < 0) {
+		n = 0;
+	} else if (n > sizeof(natcap_ctl_buffer) - 1) {
+		n = sizeof(natcap_ctl_buffer) - 1;
+	}
+	natcap_ctl_buffer[n] = 0;
+}
+
+/* one server as its reload line, followed by its telemetry as a comment */
+static int natcap_server_line(loff_t idx)
+{
+	int n;
+	struct natcap_server_info_stat st;
+
+	if (natcap_server_info_stat_get(idx, &st) != 0) {
+		return -ENOENT;
+	}
+
+	n = snprintf(natcap_ctl_buffer,
+			sizeof(natcap_ctl_buffer) - 1,
+			"server " TUPLE_FMT "\n"
+			"#    flows_active=%llu flows_new=%llu flows_per_sec=%u tx_bytes=%llu rx_bytes=%llu"
+			" syn_timeouts=%llu rst=%llu srtt_us=%u loss=%u/1024 dead=%d race_won=%llu"
+			" rtt_ms=<10:%llu,<20:%llu,<40:%llu,<80:%llu,<160:%llu,<320:%llu,<640:%llu,>=640:%llu\n",
+			TUPLE_ARG(&st.server),
+			st.flows_active, st.flows_new, st.flows_per_sec, st.tx_bytes, st.rx_bytes,
+			st.syn_timeouts, st.rsts, st.srtt_us, st.loss, st.dead, st.race_won,
+			st.rtt_hist[0], st.rtt_hist[1], st.rtt_hist[2], st.rtt_hist[3],
+			st.rtt_hist[4], st.rtt_hist[5], st.rtt_hist[6], st.rtt_hist[7]);
+	natcap_ctl_buffer_end(n);
+
+	return 0;
+}
+
+/* the data path counters, a record of their own after the header */
+static void natcap_counters_line(void)
+{
+	int n;
+	unsigned long long csum_offload_kept, csum_offload_lost;
+	unsigned long long writable_copied_bytes, writable_inplace_bytes;
+	unsigned long long dst_cache_hit, dst_cache_miss;
+	unsigned long long race_learned, race_avoided, race_evicted;
+	unsigned long long syn_fallback_launched, syn_fallback_answered;
+	unsigned long long server_evicted;
+	unsigned long long server_race_launched, server_race_switched;
+	unsigned long long dns_cache_hit, dns_cache_miss, dns_cache_coalesced, dns_cache_evicted;
+
+	natcap_csum_stat_get(&csum_offload_kept, &csum_offload_lost);
+	natcap_writable_stat_get(&writable_copied_bytes, &writable_inplace_bytes);
+	natcap_dst_cache_stat_get(&dst_cache_hit, &dst_cache_miss);
+	natcap_race_stat_get(&race_learned, &race_avoided, &race_evicted);
+	natcap_syn_fallback_stat_get(&syn_fallback_launched, &syn_fallback_answered);
+	natcap_server_stat_get(&server_evicted);
+	natcap_server_race_stat_get(&server_race_launched, &server_race_switched);
+	natcap_dns_cache_stat_get(&dns_cache_hit, &dns_cache_miss, &dns_cache_coalesced, &dns_cache_evicted);
+
+	n = snprintf(natcap_ctl_buffer,
+			sizeof(natcap_ctl_buffer) - 1,
+			"# Counters:\n"
+			"#    csum_offload_kept=%llu\n"
+			"#    csum_offload_lost=%llu\n"
+			"#    writable_copied_bytes=%llu\n"
+			"#    writable_inplace_bytes=%llu\n"
+			"#    cniplist_table=%u\n"
+			"#    dst_cache_hit=%llu\n"
+			"#    dst_cache_miss=%llu\n"
+			"#    domain_table=%u\n"
+			"#    classifier=%s\n"
+			"#    race_learned=%llu\n"
+			"#    race_avoided=%llu\n"
+			"#    race_evicted=%llu\n"
+			"#    syn_fallback_launched=%llu\n"
+			"#    syn_fallback_answered=%llu\n"
+			"#    server_evicted=%llu\n"
+			"#    server_race_launched=%llu\n"
+			"#    server_race_switched=%llu\n"
+			"#    dns_cache_hit=%llu\n"
+			"#    dns_cache_miss=%llu\n"
+			"#    dns_cache_coalesced=%llu\n"
+			"#    dns_cache_evicted=%llu\n"
+			"#\n",
+			csum_offload_kept, csum_offload_lost,
+			writable_copied_bytes, writable_inplace_bytes,
+			natcap_cniplist_count(),
+			dst_cache_hit, dst_cache_miss,
+			natcap_domain_count(),
+			natcap_classifier_loaded() ? "bpf" : "builtin",
+			race_learned, race_avoided, race_evicted,
+			syn_fallback_launched, syn_fallback_answered,
+			server_evicted,
+			server_race_launched, server_race_switched,
+			dns_cache_hit, dns_cache_miss, dns_cache_coalesced, dns_cache_evicted);
+	natcap_ctl_buffer_end(n);
+}
+
+/* records after the header: the counters, then one per server */
+static void *natcap_record(loff_t pos)
+{
+	if (pos == 1) {
+		natcap_counters_line();
+		return natcap_ctl_buffer;
+	}
+	if (pos > 1 && natcap_server_line(pos - 2) == 0) {
+		return natcap_ctl_buffer;
+	}
+	return NULL;
+}
+
 static void *natcap_start(struct seq_file *m, loff_t *pos)
 {
 	int n = 0;
+	struct tuple dst;
 
 	if ((*pos) == 0) {
+		natcap_server_info_current(&dst);
 		n = snprintf(natcap_ctl_buffer,
 				sizeof(natcap_ctl_buffer) - 1,
 				"# Usage:\n"
@@ -63,7 +179,16 @@ static void *natcap_start(struct seq_file *m, loff_t *pos)
 				"#    server [ip]:[port]-[e/o] -- add one server\n"
 				"#    delete [ip]:[port]-[e/o] -- delete one server\n"
 				"#    clean -- remove all existing server(s)\n"
-				"#    change_server -- change current server\n"
+				"#    change_server -- change current server, no effect with server_affinity=1\n"
+				"#    cniplist_add=[ip]/[cidr] -- stage one prefix of the cniplist table\n"
+				"#    cniplist_commit -- build the staged prefixes and load the cniplist table\n"
+				"#    cniplist_clean -- unload the cniplist table, test ipset cniplist again\n"
+				"#    dst_cache_flush -- drop cached destination verdicts after reloading ipsets\n"
+				"#    domain_add=[suffix] -- stage one domain suffix routed to the server\n"
+				"#    domain_commit -- build the staged suffixes and load the domain table\n"
+				"#    domain_clean -- unload the domain table\n"
+				"#    classifier_bpf=[path] -- classify new flows with a pinned socket filter program\n"
+				"#    classifier_clean -- unload the classifier program, use the built-in chain\n"
 				"#\n"
 				"# Info:\n"
 				"#    mode=%s(%u)\n"
@@ -96,10 +221,19 @@ static void *natcap_start(struct seq_file *m, loff_t *pos)
 				"udp_encode_mode=%s\n"
 				"server_persist_timeout=%u\n"
 				"cnipwhitelist_mode=%u\n"
+				"dst_cache_timeout=%u\n"
+				"race_learn_timeout=%u\n"
+				"syn_fallback_ms=%u\n"
+				"server_dead_timeout=%u\n"
+				"server_dead_fails=%u\n"
+				"server_affinity=%u\n"
+				"server_race=%u\n"
+				"late_bind=%u\n"
+				"dns_cache=%u\n"
 				"dns_server=%pI4:%u\n"
 				"\n",
 				mode_str[mode], mode,
-				TUPLE_ARG(natcap_server_info_current()),
+				TUPLE_ARG(&dst),
 				default_mac_addr[0], default_mac_addr[1], default_mac_addr[2], default_mac_addr[3], default_mac_addr[4], default_mac_addr[5],
 				ntohl(default_u_hash),
 				server_seed, disabled, auth_enabled,
@@ -112,43 +246,19 @@ static void *natcap_start(struct seq_file *m, loff_t *pos)
 				macfilter_acl_str[macfilter], macfilter,
 				ipfilter_acl_str[ipfilter], ipfilter,
 				disabled, debug, encode_mode_str[encode_mode], encode_mode_str[udp_encode_mode], server_persist_timeout,
-				cnipwhitelist_mode, &dns_server, ntohs(dns_port));
-		natcap_ctl_buffer[n] = 0;
+				cnipwhitelist_mode, dst_cache_timeout, race_learn_timeout, syn_fallback_ms,
+				server_dead_timeout, server_dead_fails, server_affinity, server_race, late_bind, dns_cache, &dns_server, ntohs(dns_port));
+		natcap_ctl_buffer_end(n);
 		return natcap_ctl_buffer;
-	} else if ((*pos) > 0) {
-		struct tuple *dst = (struct tuple *)natcap_server_info_get((*pos) - 1);
-
-		if (dst) {
-			n = snprintf(natcap_ctl_buffer,
-					sizeof(natcap_ctl_buffer) - 1,
-					"server " TUPLE_FMT "\n",
-					TUPLE_ARG(dst));
-			natcap_ctl_buffer[n] = 0;
-			return natcap_ctl_buffer;
-		}
 	}
 
-	return NULL;
+	return natcap_record(*pos);
 }
 
 static void *natcap_next(struct seq_file *m, void *v, loff_t *pos)
 {
-	int n;
-	struct tuple *dst;
-
 	(*pos)++;
-	if ((*pos) > 0) {
-		dst = (struct tuple *)natcap_server_info_get((*pos) - 1);
-		if (dst) {
-			n = snprintf(natcap_ctl_buffer,
-					sizeof(natcap_ctl_buffer) - 1,
-					"server " TUPLE_FMT "\n",
-					TUPLE_ARG(dst));
-			natcap_ctl_buffer[n] = 0;
-			return natcap_ctl_buffer;
-		}
-	}
-	return NULL;
+	return natcap_record(*pos);
 }
 
 static void natcap_stop(struct seq_file *m, void *v)
@@ -335,9 +445,125 @@ static ssize_t natcap_write(struct file *file, const char __user *buf, size_t bu
 			n = sscanf(data, "cnipwhitelist_mode=%u", &d);
 			if (n == 1) {
 				cnipwhitelist_mode = d;
+				natcap_dst_cache_flush();
+				goto done;
+			}
+		}
+	} else if (strncmp(data, "dst_cache_timeout=", 18) == 0) {
+		if (mode == CLIENT_MODE || mode == MIXING_MODE) {
+			int d;
+			n = sscanf(data, "dst_cache_timeout=%u", &d);
+			if (n == 1) {
+				dst_cache_timeout = d;
+				natcap_dst_cache_flush();
 				goto done;
 			}
 		}
+	} else if (strncmp(data, "domain_add=", 11) == 0) {
+		if (mode == CLIENT_MODE || mode == MIXING_MODE) {
+			err = natcap_domain_add(data + 11);
+			if (err == 0) {
+				goto done;
+			}
+		}
+	} else if (strncmp(data, "domain_commit", 13) == 0) {
+		if (mode == CLIENT_MODE || mode == MIXING_MODE) {
+			err = natcap_domain_commit();
+			if (err == 0) {
+				goto done;
+			}
+		}
+	} else if (strncmp(data, "domain_clean", 12) == 0) {
+		natcap_domain_clean();
+		goto done;
+	} else if (strncmp(data, "classifier_bpf=", 15) == 0) {
+		if (mode == CLIENT_MODE || mode == MIXING_MODE) {
+			err = natcap_classifier_load(data + 15);
+			if (err == 0) {
+				goto done;
+			}
+		}
+	} else if (strncmp(data, "classifier_clean", 16) == 0) {
+		natcap_classifier_load(NULL);
+		goto done;
+	} else if (strncmp(data, "race_learn_timeout=", 19) == 0) {
+		if (mode == CLIENT_MODE || mode == MIXING_MODE) {
+			int d;
+			n = sscanf(data, "race_learn_timeout=%u", &d);
+			if (n == 1) {
+				race_learn_timeout = d;
+				goto done;
+			}
+		}
+	} else if (strncmp(data, "syn_fallback_ms=", 16) == 0) {
+		if (mode == CLIENT_MODE || mode == MIXING_MODE) {
+			int d;
+			n = sscanf(data, "syn_fallback_ms=%u", &d);
+			if (n == 1) {
+				syn_fallback_ms = d;
+				goto done;
+			}
+		}
+	} else if (strncmp(data, "server_dead_timeout=", 20) == 0) {
+		if (mode == CLIENT_MODE || mode == MIXING_MODE) {
+			int d;
+			n = sscanf(data, "server_dead_timeout=%u", &d);
+			if (n == 1) {
+				server_dead_timeout = d;
+				goto done;
+			}
+		}
+	} else if (strncmp(data, "server_dead_fails=", 18) == 0) {
+		if (mode == CLIENT_MODE || mode == MIXING_MODE) {
+			int d;
+			n = sscanf(data, "server_dead_fails=%u", &d);
+			if (n == 1) {
+				server_dead_fails = d;
+				goto done;
+			}
+		}
+	} else if (strncmp(data, "server_affinity=", 16) == 0) {
+		if (mode == CLIENT_MODE || mode == MIXING_MODE || mode == FORWARD_MODE) {
+			int d;
+			n = sscanf(data, "server_affinity=%u", &d);
+			if (n == 1) {
+				server_affinity = d;
+				goto done;
+			}
+		}
+	} else if (strncmp(data, "server_race=", 12) == 0) {
+		if (mode == CLIENT_MODE || mode == MIXING_MODE) {
+			int d;
+			n = sscanf(data, "server_race=%u", &d);
+			if (n == 1 && d >= 1 && d <= NATCAP_SERVER_RACE_MAX) {
+				server_race = d;
+				goto done;
+			}
+		}
+	} else if (strncmp(data, "late_bind=", 10) == 0) {
+		if (mode == CLIENT_MODE || mode == MIXING_MODE) {
+			int d;
+			n = sscanf(data, "late_bind=%u", &d);
+			if (n == 1) {
+				late_bind = d;
+				goto done;
+			}
+		}
+	} else if (strncmp(data, "dns_cache=", 10) == 0) {
+		if (mode == CLIENT_MODE || mode == MIXING_MODE) {
+			int d;
+			n = sscanf(data, "dns_cache=%u", &d);
+			if (n == 1) {
+				dns_cache = d;
+				if (!dns_cache) {
+					natcap_dns_cache_clean();
+				}
+				goto done;
+			}
+		}
+	} else if (strncmp(data, "dst_cache_flush", 15) == 0) {
+		natcap_dst_cache_flush();
+		goto done;
 	} else if (strncmp(data, "encode_http_only=", 17) == 0) {
 		if (mode == CLIENT_MODE || mode == MIXING_MODE) {
 			int d;
@@ -495,6 +721,27 @@ static ssize_t natcap_write(struct file *file, const char __user *buf, size_t bu
 	} else if (strncmp(data, "dns_server_node_clean", 21) == 0) {
 		dns_server_node_clean();
 		goto done;
+	} else if (strncmp(data, "cniplist_add=", 13) == 0) {
+		unsigned int a, b, c, d, e;
+		n = sscanf(data, "cniplist_add=%u.%u.%u.%u/%u", &a, &b, &c, &d, &e);
+		if ( (n == 5 && e <= 32) &&
+				(((a & 0xff) == a) &&
+				 ((b & 0xff) == b) &&
+				 ((c & 0xff) == c) &&
+				 ((d & 0xff) == d)) ) {
+			err = natcap_cniplist_add(htonl((a<<24)|(b<<16)|(c<<8)|(d<<0)), e);
+			if (err == 0) {
+				goto done;
+			}
+		}
+	} else if (strncmp(data, "cniplist_commit", 15) == 0) {
+		err = natcap_cniplist_commit();
+		if (err == 0) {
+			goto done;
+		}
+	} else if (strncmp(data, "cniplist_clean", 14) == 0) {
+		natcap_cniplist_clean();
+		goto done;
 	}
 
 	NATCAP_println("ignoring line[%s]", data);
@@ -1183,15 +1183,14 @@ do_dnat_setup:
 				if (!(IPS_NATFLOW_STOP & ct->status)) set_bit(IPS_NATFLOW_STOP_BIT, &ct->status);
 				return NF_ACCEPT;
 			} else if (NATCAP_UDP_GET_TYPE(get_byte2((void *)UDPH(l4) + sizeof(struct udphdr) + 10)) == 0x02) {
-				int offlen;
+				if (natcap_skb_shim_pull(skb, iph->ihl * 4 + sizeof(struct udphdr), 12)) {
+					return NF_DROP;
+				}
+				iph = ip_hdr(skb);
+				l4 = (void *)iph + iph->ihl * 4;
 
-				offlen = skb_tail_pointer(skb) - (unsigned char *)UDPH(l4) - sizeof(struct udphdr) - 12;
-				BUG_ON(offlen < 0);
-				memmove((void *)UDPH(l4) + sizeof(struct udphdr), (void *)UDPH(l4) + sizeof(struct udphdr) + 12, offlen);
 				iph->tot_len = htons(ntohs(iph->tot_len) - 12);
 				UDPH(l4)->len = htons(ntohs(iph->tot_len) - iph->ihl * 4);
-				skb->len -= 12;
-				skb->tail -= 12;
 				skb_rcsum_tcpudp(skb);
 			}
 		}
@@ -1201,12 +1200,13 @@ do_dnat_setup:
 
 		if ((IPS_NATCAP & ct->status)) {
 			if ((IPS_NATCAP_ENC & ct->status)) {
-				if (!skb_make_writable(skb, skb->len)) {
+				if (!skb_payload_make_writable(skb)) {
 					NATCAP_ERROR("(SPCI)" DEBUG_UDP_FMT ": natcap_udp_decode() failed\n", DEBUG_UDP_ARG(iph,l4));
 					return NF_DROP;
 				}
-				skb_data_hook(skb, iph->ihl * 4 + sizeof(struct udphdr), skb->len - (iph->ihl * 4 + sizeof(struct udphdr)), natcap_data_decode);
-				skb_rcsum_tcpudp(skb);
+				iph = ip_hdr(skb);
+				l4 = (void *)iph + iph->ihl * 4;
+				skb_data_decode_rcsum(skb, iph->ihl * 4 + sizeof(struct udphdr), skb->len - (iph->ihl * 4 + sizeof(struct udphdr)));
 			}
 
 			flow_total_rx_bytes += skb->len;
@@ -1355,7 +1355,7 @@ static unsigned int natcap_server_post_out_hook(void *priv,
 		if (skb_is_gso(skb)) {
 			struct sk_buff *segs;
 
-			segs = skb_gso_segment(skb, 0);
+			segs = natcap_skb_gso_segment(skb);
 			if (IS_ERR(segs)) {
 				return NF_DROP;
 			}
@@ -1364,49 +1364,22 @@ static unsigned int natcap_server_post_out_hook(void *priv,
 			skb = segs;
 		}
 
-		do {
-			int offlen;
-			struct sk_buff *nskb = skb->next;
-
-			if (skb_tailroom(skb) < 8 && pskb_expand_head(skb, 0, 8, GFP_ATOMIC)) {
-				consume_skb(skb);
-				skb = nskb;
-				NATCAP_ERROR(DEBUG_FMT_PREFIX "pskb_expand_head failed\n", DEBUG_ARG_PREFIX);
-				continue;
-			}
-
-			iph = ip_hdr(skb);
-			l4 = (void *)iph + iph->ihl * 4;
-
-			offlen = skb_tail_pointer(skb) - (unsigned char *)UDPH(l4) - 4;
-			BUG_ON(offlen < 0);
-			memmove((void *)UDPH(l4) + 4 + 8, (void *)UDPH(l4) + 4, offlen);
-			iph->tot_len = htons(ntohs(iph->tot_len) + 8);
-			UDPH(l4)->len = htons(ntohs(iph->tot_len) - iph->ihl * 4);
-			UDPH(l4)->check = CSUM_MANGLED_0;
-			skb->len += 8;
-			skb->tail += 8;
-			set_byte4((void *)UDPH(l4) + 8, __constant_htonl(0xFFFF0099));
-			iph->protocol = IPPROTO_UDP;
-			skb->ip_summed = CHECKSUM_UNNECESSARY;
-			skb_rcsum_tcpudp(skb);
-
-			skb->next = NULL;
-			NF_OKFN(skb);
-
-			skb = nskb;
-		} while (skb);
+		skb = natcap_udpenc_pack_list(skb, &flow_total_tx_bytes);
+		if (skb) {
+			NF_OKFN_LIST(skb);
+		}
 
 		return NF_STOLEN;
 	} else if (iph->protocol == IPPROTO_UDP) {
 		NATCAP_DEBUG("(SPO)" DEBUG_UDP_FMT ": pass data reply\n", DEBUG_UDP_ARG(iph,l4));
 		if ((IPS_NATCAP_ENC & ct->status)) {
-			if (!skb_make_writable(skb, skb->len)) {
+			if (!skb_payload_make_writable(skb)) {
 				NATCAP_ERROR("(SPO)" DEBUG_UDP_FMT ": natcap_udp_encode() failed\n", DEBUG_UDP_ARG(iph,l4));
 				return NF_DROP;
 			}
-			skb_data_hook(skb, iph->ihl * 4 + sizeof(struct udphdr), skb->len - (iph->ihl * 4 + sizeof(struct udphdr)), natcap_data_encode);
-			skb_rcsum_tcpudp(skb);
+			iph = ip_hdr(skb);
+			l4 = (void *)iph + iph->ihl * 4;
+			skb_data_encode_rcsum(skb, iph->ihl * 4 + sizeof(struct udphdr), skb->len - (iph->ihl * 4 + sizeof(struct udphdr)));
 		}
 
 		if ((IPS_NATCAP_TCPENC & ct->status)) {
@@ -1418,6 +1391,9 @@ static unsigned int natcap_server_post_out_hook(void *priv,
 	return NF_ACCEPT;
 }
 
+/* shared with the hook table, GRO segments continue PRE_ROUTING from here */
+#define NATCAP_SERVER_PRE_IN_PRIORITY (NF_IP_PRI_CONNTRACK - 10 + 1)
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 13, 0)
 static unsigned natcap_server_pre_in_hook(unsigned int hooknum,
 		struct sk_buff *skb,
@@ -1486,14 +1462,19 @@ static unsigned int natcap_server_pre_in_hook(void *priv,
 				skb->ip_summed = CHECKSUM_UNNECESSARY;
 			}
 
-			memmove((void *)UDPH(l4) + sizeof(struct udphdr), (void *)UDPH(l4) + sizeof(struct tcphdr), skb_tail_pointer(skb) - (unsigned char *)UDPH(l4) - sizeof(struct tcphdr));
+			if (natcap_skb_shim_pull(skb, iph->ihl * 4 + sizeof(struct udphdr), sizeof(struct tcphdr) - sizeof(struct udphdr))) {
+				return NF_DROP;
+			}
+			iph = ip_hdr(skb);
+			l4 = (void *)iph + iph->ihl * 4;
+
 			iph->tot_len = htons(ntohs(iph->tot_len) - (sizeof(struct tcphdr) - sizeof(struct udphdr)));
 			UDPH(l4)->len = htons(ntohs(iph->tot_len) - iph->ihl * 4);
 			UDPH(l4)->check = CSUM_MANGLED_0;
-			skb->len -= sizeof(struct tcphdr) - sizeof(struct udphdr);
-			skb->tail -= sizeof(struct tcphdr) - sizeof(struct udphdr);
 			iph->protocol = IPPROTO_UDP;
-			skb->ip_summed = CHECKSUM_UNNECESSARY;
+			if (skb->ip_summed != CHECKSUM_PARTIAL) {
+				skb->ip_summed = CHECKSUM_UNNECESSARY;
+			}
 			skb_rcsum_tcpudp(skb);
 
 			if (in)
@@ -1532,13 +1513,19 @@ static unsigned int natcap_server_pre_in_hook(void *priv,
 	l4 = (void *)iph + iph->ihl * 4;
 
 	if (skb_is_gso(skb)) {
+		if (get_byte4((void *)UDPH(l4) + 8) != __constant_htonl(0xFFFF0099)) {
+			return NF_ACCEPT;
+		}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 4, 0)
+		NATCAP_DEBUG("(SPI)" DEBUG_UDP_FMT ": gro skb, segment and reinject\n", DEBUG_UDP_ARG(iph,l4));
+		return natcap_gro_segment_reinject(skb, state, NATCAP_SERVER_PRE_IN_PRIORITY);
+#else
 		NATCAP_ERROR("(SPI)" DEBUG_UDP_FMT ": skb_is_gso\n", DEBUG_UDP_ARG(iph,l4));
 		return NF_ACCEPT;
+#endif
 	}
 
 	if (get_byte4((void *)UDPH(l4) + 8) == __constant_htonl(0xFFFF0099)) {
-		int offlen;
-
 		if (skb->ip_summed == CHECKSUM_NONE) {
 			if (skb_rcsum_verify(skb) != 0) {
 				NATCAP_WARN("(SPI)" DEBUG_UDP_FMT ": skb_rcsum_verify fail\n", DEBUG_UDP_ARG(iph,l4));
@@ -1559,12 +1546,13 @@ static unsigned int natcap_server_pre_in_hook(void *priv,
 		iph = ip_hdr(skb);
 		l4 = (void *)iph + iph->ihl * 4;
 
-		offlen = skb_tail_pointer(skb) - (unsigned char *)UDPH(l4) - 4 - 8;
-		BUG_ON(offlen < 0);
-		memmove((void *)UDPH(l4) + 4, (void *)UDPH(l4) + 4 + 8, offlen);
+		if (natcap_skb_shim_pull(skb, iph->ihl * 4 + 4, 8)) {
+			return NF_DROP;
+		}
+		iph = ip_hdr(skb);
+		l4 = (void *)iph + iph->ihl * 4;
+
 		iph->tot_len = htons(ntohs(iph->tot_len) - 8);
-		skb->len -= 8;
-		skb->tail -= 8;
 		iph->protocol = IPPROTO_TCP;
 		skb->ip_summed = CHECKSUM_UNNECESSARY;
 		skb_rcsum_tcpudp(skb);
@@ -1598,7 +1586,7 @@ static struct nf_hook_ops server_hooks[] = {
 		.hook = natcap_server_pre_in_hook,
 		.pf = PF_INET,
 		.hooknum = NF_INET_PRE_ROUTING,
-		.priority = NF_IP_PRI_CONNTRACK - 10 + 1,
+		.priority = NATCAP_SERVER_PRE_IN_PRIORITY,
 	},
 	{
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 4, 0)
@@ -48,6 +48,7 @@ static void server_timeout_cb(EV_P_ ev_timer *watcher, int revents);
 static remote_t *new_remote(int fd);
 static server_t *new_server(int fd, listen_ctx_t *listener);
 static remote_t *connect_to_remote(EV_P_ struct addrinfo *res, server_t *server);
+static void server_connect(EV_P_ server_t *server);
 
 static void free_remote(remote_t *remote);
 static void close_and_free_remote(EV_P_ remote_t *remote);
@@ -195,6 +196,9 @@ static remote_t *connect_to_remote(EV_P_ struct addrinfo *res, server_t *server)
 	setsockopt(sockfd, SOL_SOCKET, SO_NOSIGPIPE, &opt, sizeof(opt));
 #endif
 	setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+	if (server->mark) {
+		setsockopt(sockfd, SOL_SOCKET, SO_MARK, &server->mark, sizeof(server->mark));
+	}
 
 	// setup remote socks
 
@@ -240,12 +244,65 @@ static int getdestaddr(int fd, struct sockaddr_storage *destaddr)
 }
 #endif
 
+#ifdef NATCAP_CLIENT_MODE
+#include "natcapd_bind.h"
+
+static void server_parse(EV_P_ server_t *server)
+{
+	char host[256];
+	int ret;
+	buffer_t *buf = server->buf;
+
+	ssize_t r = recv(server->fd, buf->data + buf->len, BUF_SIZE - buf->len, 0);
+	if (r == 0 || (r == -1 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+		close_and_free_server(EV_A_ server);
+		return;
+	} else if (r == -1) {
+		return;
+	}
+	tx += r;
+	buf->len += r;
+
+	if (buf->data[0] == 0x16) {
+		ret = parse_tls_sni(buf->data, buf->len, host, sizeof(host));
+	} else {
+		ret = parse_http_host(buf->data, buf->len, host, sizeof(host));
+	}
+	if (ret == 0 && buf->len < BUF_SIZE) {
+		// wait for the rest of the request
+		return;
+	}
+
+	if (ret == 1) {
+		if (domain_list_match(&proxy_domains, host)) {
+			server->mark = NATCAP_BIND_MARK_PROXY;
+		} else if (domain_list_match(&bypass_domains, host)) {
+			server->mark = NATCAP_BIND_MARK_BYPASS;
+		}
+	}
+	if (verbose) {
+		printf("late bind %s mark=0x%x after %.3fms\n", ret == 1 ? host : "(none)", server->mark,
+				(ev_now(EV_A) - server->accepted) * 1000);
+	}
+
+	ev_io_stop(EV_A_ & server->recv_ctx->io);
+	server_connect(EV_A_ server);
+}
+#endif
+
 static void server_recv_cb(EV_P_ ev_io *w, int revents)
 {
 	server_ctx_t *server_recv_ctx = (server_ctx_t *)w;
 	server_t *server              = server_recv_ctx->server;
 	remote_t *remote              = server->remote;
 
+#ifdef NATCAP_CLIENT_MODE
+	if (server->stage == STAGE_PARSE) {
+		server_parse(EV_A_ server);
+		return;
+	}
+#endif
+
 	if (remote == NULL) {
 		printf("invalid remote\n");
 		close_and_free_server(EV_A_ server);
@@ -674,36 +731,56 @@ static void accept_cb(EV_P_ ev_io *w, int revents)
 	ev_timer_start(EV_A_ & server->recv_ctx->watcher);
 
 	if (server->stage == STAGE_INIT) {
-		struct sockaddr_in *addr;
-		struct addrinfo info;
-		struct sockaddr_storage storage;
-		memset(&info, 0, sizeof(struct addrinfo));
-		memset(&storage, 0, sizeof(struct sockaddr_storage));
-
-		if (getdestaddr(server->fd, &storage) != 0) {
+		if (getdestaddr(server->fd, &server->destaddr) != 0) {
 			perror("getdestaddr");
 			close_and_free_server(EV_A_ server);
 			return;
 		}
 
-		addr = (struct sockaddr_in *)&storage;
-		info.ai_family   = AF_INET;
-		info.ai_socktype = SOCK_STREAM;
-		info.ai_protocol = IPPROTO_TCP;
-		info.ai_addrlen  = sizeof(struct sockaddr_in);
-		info.ai_addr     = (struct sockaddr *)addr;
-
-		remote_t *remote = connect_to_remote(EV_A_ & info, server);
-		if (remote == NULL) {
-			printf("connect error\n");
-			close_and_free_server(EV_A_ server);
+#ifdef NATCAP_CLIENT_MODE
+		struct sockaddr_in *addr = (struct sockaddr_in *)&server->destaddr;
+		if ((proxy_domains.num || bypass_domains.num) &&
+				(addr->sin_port == htons(443) || addr->sin_port == htons(80))) {
+			server->stage = STAGE_PARSE;
+			server->accepted = ev_now(EV_A);
+			ev_io_start(EV_A_ & server->recv_ctx->io);
 			return;
-		} else {
-			server->remote = remote;
-			remote->server = server;
-			//ev_io_start(EV_A_ & remote->recv_ctx->io);
-			ev_io_start(EV_A_ & remote->send_ctx->io);
 		}
+#endif
+
+		server_connect(EV_A_ server);
+	}
+}
+
+static void server_connect(EV_P_ server_t *server)
+{
+	struct addrinfo info;
+	memset(&info, 0, sizeof(struct addrinfo));
+
+	info.ai_family   = AF_INET;
+	info.ai_socktype = SOCK_STREAM;
+	info.ai_protocol = IPPROTO_TCP;
+	info.ai_addrlen  = sizeof(struct sockaddr_in);
+	info.ai_addr     = (struct sockaddr *)&server->destaddr;
+
+	remote_t *remote = connect_to_remote(EV_A_ & info, server);
+	if (remote == NULL) {
+		printf("connect error\n");
+		close_and_free_server(EV_A_ server);
+		return;
+	} else {
+		server->remote = remote;
+		remote->server = server;
+		if (server->buf->len) {
+			// the payload held for late binding goes out first
+			memcpy(remote->buf->data, server->buf->data, server->buf->len);
+			remote->buf->len = server->buf->len;
+			remote->buf->idx = 0;
+			server->buf->len = 0;
+			server->stage = STAGE_INIT;
+		}
+		//ev_io_start(EV_A_ & remote->recv_ctx->io);
+		ev_io_start(EV_A_ & remote->send_ctx->io);
 	}
 }
 
@@ -715,6 +792,10 @@ void usage()
 	printf("  usage:\n\n");
 	printf("       [-l <local_port>]          Port number of your local server.\n");
 	printf("       [-t <timeout>]             Socket timeout in seconds.\n");
+#ifdef NATCAP_CLIENT_MODE
+	printf("       [-d <domain_file>]         Proxy web connects whose SNI/Host ends with a listed domain.\n");
+	printf("       [-b <domain_file>]         Bypass web connects whose SNI/Host ends with a listed domain.\n");
+#endif
 	printf("       [-v]                       Verbose mode.\n");
 	printf("       [-h, --help]               Print this message.\n");
 	printf("\n");
@@ -731,8 +812,20 @@ int main(int argc, char **argv)
 
 	opterr = 0;
 
-	while ((c = getopt_long(argc, argv, "l:t:hv", NULL, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "l:t:d:b:hv", NULL, NULL)) != -1) {
 		switch (c) {
+#ifdef NATCAP_CLIENT_MODE
+			case 'd':
+				if (domain_list_load(&proxy_domains, optarg) != 0) {
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'b':
+				if (domain_list_load(&bypass_domains, optarg) != 0) {
+					exit(EXIT_FAILURE);
+				}
+				break;
+#endif
 			case 'l':
 				server_port = optarg;
 				break;
@@ -3,6 +3,7 @@
 
 #include <stddef.h>
 #include <time.h>
+#include <sys/socket.h>
 #include <ev.h>
 #include "natcap.h"
 
@@ -30,6 +31,9 @@ typedef struct server_ctx {
 typedef struct server {
 	int fd;
 	int stage;
+	int mark;
+	ev_tstamp accepted;
+	struct sockaddr_storage destaddr;
 
 	buffer_t *buf;
 
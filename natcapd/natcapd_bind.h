@@ -0,0 +1,241 @@
+/*
+ * late binding: hold the first client payload, pick the path by SNI/Host.
+ * No libev in here, test/test_bind.c runs these in userspace
+ */
+#ifndef _NATCAPD_BIND_H
+#define _NATCAPD_BIND_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+/* suffixes are kept lowercase in a chained hash, a host is matched with one
+ * probe per label (as natcap_domain_match does in the module), so the cost
+ * does not grow with gfwlist sized lists
+ */
+typedef struct {
+	unsigned int hash;
+	unsigned int next; /* index + 1 of the next entry in the bucket, 0 ends */
+	unsigned int len;
+	char *name;
+} domain_entry_t;
+
+typedef struct {
+	unsigned int num;
+	unsigned int mask;
+	unsigned int *bucket;
+	domain_entry_t *e;
+} domain_list_t;
+
+/* FNV-1a */
+static unsigned int domain_hash(const char *s, unsigned int len)
+{
+	unsigned int h = 2166136261u;
+
+	while (len-- > 0) {
+		h ^= (unsigned char)*s++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static int domain_list_add(domain_list_t *list, const char *name, unsigned int len)
+{
+	domain_entry_t *e;
+
+	if ((list->num & (list->num - 1)) == 0) {
+		e = realloc(list->e, sizeof(domain_entry_t) * (list->num ? list->num * 2 : 256));
+		if (e == NULL) {
+			return -1;
+		}
+		list->e = e;
+	}
+	e = &list->e[list->num];
+	e->name = malloc(len + 1);
+	if (e->name == NULL) {
+		return -1;
+	}
+	for (unsigned int i = 0; i < len; i++) {
+		e->name[i] = tolower((unsigned char)name[i]);
+	}
+	e->name[len] = 0;
+	e->len = len;
+	e->hash = domain_hash(e->name, len);
+	list->num++;
+	return 0;
+}
+
+/* size the buckets to the list, about one entry per bucket */
+static int domain_list_rehash(domain_list_t *list)
+{
+	unsigned int nr_bucket = 256;
+	unsigned int *bucket;
+
+	while (nr_bucket < list->num) nr_bucket *= 2;
+	bucket = calloc(nr_bucket, sizeof(unsigned int));
+	if (bucket == NULL) {
+		return -1;
+	}
+	free(list->bucket);
+	list->bucket = bucket;
+	list->mask = nr_bucket - 1;
+	for (unsigned int i = 0; i < list->num; i++) {
+		domain_entry_t *e = &list->e[i];
+		e->next = bucket[e->hash & list->mask];
+		bucket[e->hash & list->mask] = i + 1;
+	}
+	return 0;
+}
+
+static int domain_list_load(domain_list_t *list, const char *path)
+{
+	char line[256];
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL) {
+		perror("fopen");
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		char *p = line;
+		size_t len;
+		while (*p == ' ' || *p == '\t' || *p == '.') p++;
+		len = strcspn(p, " \t\r\n#");
+		while (len > 0 && p[len - 1] == '.') len--;
+		if (len == 0) {
+			continue;
+		}
+		if (domain_list_add(list, p, len) != 0) {
+			break;
+		}
+	}
+
+	fclose(fp);
+	return domain_list_rehash(list);
+}
+
+static int domain_list_lookup(const domain_list_t *list, const char *s, unsigned int len)
+{
+	unsigned int hash = domain_hash(s, len);
+	unsigned int i = list->bucket[hash & list->mask];
+
+	while (i) {
+		const domain_entry_t *e = &list->e[i - 1];
+		if (e->hash == hash && e->len == len && memcmp(e->name, s, len) == 0) {
+			return 1;
+		}
+		i = e->next;
+	}
+	return 0;
+}
+
+/* host equals a suffix or ends with .suffix */
+static int domain_list_match(const domain_list_t *list, const char *host)
+{
+	char name[256];
+	unsigned int i, len;
+
+	if (list->num == 0) {
+		return 0;
+	}
+	for (len = 0; host[len] && len < sizeof(name); len++) {
+		name[len] = tolower((unsigned char)host[len]);
+	}
+	while (len > 0 && name[len - 1] == '.') len--;
+
+	for (i = 0; i < len; i++) {
+		if (i != 0 && name[i - 1] != '.') {
+			continue;
+		}
+		if (domain_list_lookup(list, name + i, len - i)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* return 1 with the name in host, 0 for more data, -1 when there is none */
+static int parse_tls_sni(const unsigned char *data, int len, char *host, int size)
+{
+	int pos, end, n;
+
+	if (len < 5) {
+		return 0;
+	}
+	if (data[0] != 0x16 || data[1] != 0x03) {
+		return -1;
+	}
+	end = 5 + ((data[3] << 8) | data[4]);
+	if (len < end) {
+		if (len < BUF_SIZE) {
+			return 0;
+		}
+		// a large hello, the name is usually within the first buffer
+		end = len;
+	}
+	if (end < 5 + 4 + 2 + 32 + 1 || data[5] != 0x01) {
+		return -1;
+	}
+
+	/* handshake header, version, random */
+	pos = 5 + 4 + 2 + 32;
+	/* session id */
+	pos += 1 + data[pos];
+	if (pos + 2 > end) return -1;
+	/* cipher suites */
+	pos += 2 + ((data[pos] << 8) | data[pos + 1]);
+	if (pos + 1 > end) return -1;
+	/* compression methods */
+	pos += 1 + data[pos];
+	if (pos + 2 > end) return -1;
+	/* extensions */
+	n = (data[pos] << 8) | data[pos + 1];
+	pos += 2;
+	if (pos + n < end) end = pos + n;
+
+	while (pos + 4 <= end) {
+		int type = (data[pos] << 8) | data[pos + 1];
+		int elen = (data[pos + 2] << 8) | data[pos + 3];
+		pos += 4;
+		if (pos + elen > end) return -1;
+		if (type == 0 && elen >= 5 && data[pos + 2] == 0) {
+			n = (data[pos + 3] << 8) | data[pos + 4];
+			if (n == 0 || n >= size || 5 + n > elen) return -1;
+			memcpy(host, data + pos + 5, n);
+			host[n] = 0;
+			return 1;
+		}
+		pos += elen;
+	}
+
+	return -1;
+}
+
+static int parse_http_host(const unsigned char *data, int len, char *host, int size)
+{
+	int pos, n;
+
+	for (pos = 0; pos + 6 <= len; pos++) {
+		if (data[pos] == '\r' && pos + 3 < len && data[pos + 1] == '\n' && data[pos + 2] == '\r' && data[pos + 3] == '\n') {
+			/* end of header without Host */
+			return -1;
+		}
+		if ((pos == 0 || data[pos - 1] == '\n') && strncasecmp((const char *)data + pos, "Host:", 5) == 0) {
+			pos += 5;
+			while (pos < len && (data[pos] == ' ' || data[pos] == '\t')) pos++;
+			for (n = 0; pos + n < len && data[pos + n] != '\r' && data[pos + n] != '\n' && data[pos + n] != ':'; n++);
+			if (pos + n == len) {
+				break;
+			}
+			if (n == 0 || n >= size) return -1;
+			memcpy(host, data + pos, n);
+			host[n] = 0;
+			return 1;
+		}
+	}
+
+	return len >= BUF_SIZE ? -1 : 0;
+}
+
+#endif /* _NATCAPD_BIND_H */
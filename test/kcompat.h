@@ -0,0 +1,103 @@
+/*
+ * the few kernel definitions natcap_algo.h needs, for userspace tests
+ */
+#ifndef _NATCAP_KCOMPAT_H_
+#define _NATCAP_KCOMPAT_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+
+#define BITS_PER_LONG (__SIZEOF_LONG__ * 8)
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef uint16_t __be16;
+typedef uint32_t __be32;
+typedef uint16_t __sum16;
+typedef uint32_t __wsum;
+#define __force
+
+/* generic versions of the kernel checksum helpers */
+static inline __wsum csum_add(__wsum csum, __wsum addend)
+{
+	u32 res = csum + addend;
+	return res + (res < addend);
+}
+
+static inline __wsum csum_sub(__wsum csum, __wsum addend)
+{
+	return csum_add(csum, ~addend);
+}
+
+static inline __wsum csum_unfold(__sum16 n)
+{
+	return n;
+}
+
+static inline __sum16 csum_fold(__wsum csum)
+{
+	u32 sum = csum;
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return (__sum16)~sum;
+}
+
+/* 16-bit words in memory order, an odd last byte padded with zero */
+static inline __wsum csum_partial(const void *buff, int len, __wsum sum)
+{
+	const u8 *p = buff;
+	u64 acc = sum;
+	u16 w;
+
+	for (; len > 1; p += 2, len -= 2) {
+		memcpy(&w, p, 2);
+		acc += w;
+	}
+	if (len) {
+		u8 pad[2] = {p[0], 0};
+		memcpy(&w, pad, 2);
+		acc += w;
+	}
+	while (acc >> 32)
+		acc = (acc & 0xffffffff) + (acc >> 32);
+
+	return (__wsum)acc;
+}
+
+#define vmalloc(size) malloc(size)
+#define vfree(p) free(p)
+#define ERR_PTR(err) ((void *)(long)(err))
+#define PTR_ERR(p) ((long)(p))
+#define IS_ERR(p) ((unsigned long)(p) >= (unsigned long)-4095)
+
+static inline void sort(void *base, size_t num, size_t size,
+		int (*cmp)(const void *, const void *), void (*swap)(void *, void *, int))
+{
+	(void)swap;
+	qsort(base, num, size, cmp);
+}
+
+#define ilog2(n) (31 - __builtin_clz(n))
+
+static inline double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		exit(1); \
+	} \
+} while (0)
+
+#endif /* _NATCAP_KCOMPAT_H_ */
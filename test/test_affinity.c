@@ -0,0 +1,108 @@
+/*
+ * natcap_affinity_key against the rendezvous score computed with libm: the
+ * same winner for almost every pair, shares of pairs that follow the weights,
+ * and a new server taking pairs only for itself. -b times one pick over
+ * 1000 servers
+ */
+#include <math.h>
+#include "kcompat.h"
+#include "../natcap_algo.h"
+
+#define NR_SERVER 16
+
+static u32 rand32(void)
+{
+	return ((u32)rand() << 16) ^ (u32)rand();
+}
+
+static int pick(u32 pair, const u32 *seed, const unsigned int *b, int n)
+{
+	u64 key, best_key = 0;
+	int i, best = -1;
+
+	for (i = 0; i < n; i++) {
+		key = natcap_affinity_key(pair, seed[i], b[i]);
+		if (best < 0 || key < best_key) {
+			best = i;
+			best_key = key;
+		}
+	}
+	return best;
+}
+
+static int pick_exact(u32 pair, const u32 *seed, const unsigned int *b, int n)
+{
+	double score, best_score = 0;
+	int i, best = -1;
+
+	for (i = 0; i < n; i++) {
+		u32 h = natcap_affinity_mix(pair ^ seed[i]) | 1;
+		score = ldexp(1, b[i]) / -log2(h / 4294967296.0);
+		if (best < 0 || score > best_score) {
+			best = i;
+			best_score = score;
+		}
+	}
+	return best;
+}
+
+int main(int argc, char **argv)
+{
+	u32 seed[NR_SERVER + 1];
+	unsigned int b[NR_SERVER + 1], total = 0, won[NR_SERVER] = { 0 };
+	unsigned int i, differ = 0, moved = 0, pairs = 400000;
+	int bench = argc > 1 && strcmp(argv[1], "-b") == 0;
+	double sec;
+
+	srand(1);
+	for (i = 0; i <= NR_SERVER; i++) {
+		seed[i] = rand32();
+		b[i] = 6 + i % 4;
+	}
+	for (i = 0; i < NR_SERVER; i++) {
+		total += 1U << b[i];
+	}
+
+	for (i = 0; i < pairs; i++) {
+		u32 pair = rand32();
+		int s = pick(pair, seed, b, NR_SERVER);
+		int s2 = pick(pair, seed, b, NR_SERVER + 1);
+
+		won[s]++;
+		differ += s != pick_exact(pair, seed, b, NR_SERVER);
+		if (s2 != s) {
+			CHECK(s2 == NR_SERVER);
+			moved++;
+		}
+	}
+	/* log2 is kept to 1/65536, near ties may go the other way */
+	CHECK(differ < pairs / 1000);
+	for (i = 0; i < NR_SERVER; i++) {
+		double share = (double)won[i] / pairs, want = (double)(1U << b[i]) / total;
+		CHECK(fabs(share - want) < want * 0.05);
+	}
+	total += 1U << b[NR_SERVER];
+	CHECK(fabs((double)moved / pairs - (double)(1U << b[NR_SERVER]) / total) < 0.01);
+	printf("test_affinity: shares follow the weights, %u of %u pairs moved to a new server, %u differ from libm\n",
+			moved, pairs, differ);
+
+	if (bench) {
+		static u32 bseed[1000];
+		static unsigned int bb[1000];
+		unsigned int sum = 0;
+
+		for (i = 0; i < 1000; i++) {
+			bseed[i] = rand32();
+			bb[i] = 4 + i % 12;
+		}
+		sec = now_sec();
+		for (i = 0; i < 100000; i++) {
+			sum += pick(i * 2654435761U, bseed, bb, 1000);
+		}
+		sec = now_sec() - sec;
+		printf("test_affinity: %.1f us per pick over 1000 servers, %.1f ns per server (%u)\n",
+				sec / 100000 * 1e6, sec / 100000 / 1000 * 1e9, sum);
+	}
+
+	return 0;
+}
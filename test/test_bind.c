@@ -0,0 +1,170 @@
+/*
+ * the late binding helpers of natcapd-client: the suffix hash of
+ * domain_list_match against the linear strcasecmp scan it replaced, on a
+ * gfwlist sized list, and the SNI/Host parsers on built requests. -b times a
+ * match and a whole parse plus match, the CPU part of the setup overhead
+ */
+#include <strings.h>
+#include <unistd.h>
+#include "kcompat.h"
+#define BUF_SIZE 2048
+#include "../natcapd/natcapd_bind.h"
+
+#define NR_DOMAIN 6000
+
+static int brute(const domain_list_t *list, const char *host)
+{
+	size_t hlen = strlen(host);
+
+	for (unsigned int i = 0; i < list->num; i++) {
+		size_t slen = list->e[i].len;
+		if (slen > hlen || strcasecmp(host + hlen - slen, list->e[i].name) != 0) {
+			continue;
+		}
+		if (slen == hlen || host[hlen - slen - 1] == '.') {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void rand_label(char *s)
+{
+	static const char tld[][5] = {"com", "net", "org", "io", "jp", "hk"};
+	int n = 2 + rand() % 10;
+
+	for (int i = 0; i < n; i++) {
+		s[i] = 'a' + rand() % 26;
+	}
+	sprintf(s + n, ".%s", tld[rand() % 6]);
+}
+
+/* a host near the list: listed, a subdomain, a case change, a glued prefix or unrelated */
+static void rand_host(const domain_list_t *list, char *host)
+{
+	const char *name = list->e[rand() % list->num].name;
+
+	switch (rand() % 5) {
+		case 0:
+			strcpy(host, name);
+			break;
+		case 1:
+			sprintf(host, "www.cdn%d.%s", rand() % 10, name);
+			break;
+		case 2:
+			strcpy(host, name);
+			host[0] = toupper((unsigned char)host[0]);
+			break;
+		case 3:
+			sprintf(host, "x%s", name);
+			break;
+		default:
+			rand_label(host);
+			break;
+	}
+}
+
+static int build_hello(unsigned char *p, const char *host)
+{
+	int n = strlen(host), pos = 0, ext;
+
+	p[pos++] = 0x16; p[pos++] = 0x03; p[pos++] = 0x01; pos += 2;
+	p[pos++] = 0x01; pos += 3;
+	p[pos++] = 0x03; p[pos++] = 0x03;
+	memset(p + pos, 0x5a, 32); pos += 32;
+	p[pos++] = 32; memset(p + pos, 0x11, 32); pos += 32;
+	p[pos++] = 0; p[pos++] = 4; p[pos++] = 0x13; p[pos++] = 0x01; p[pos++] = 0x13; p[pos++] = 0x02;
+	p[pos++] = 1; p[pos++] = 0;
+	ext = pos; pos += 2;
+	/* a padding extension ahead of server_name */
+	p[pos++] = 0x00; p[pos++] = 0x15; p[pos++] = 0; p[pos++] = 16; memset(p + pos, 0, 16); pos += 16;
+	p[pos++] = 0; p[pos++] = 0; p[pos++] = (n + 5) >> 8; p[pos++] = (n + 5) & 0xff;
+	p[pos++] = (n + 3) >> 8; p[pos++] = (n + 3) & 0xff; p[pos++] = 0;
+	p[pos++] = n >> 8; p[pos++] = n & 0xff; memcpy(p + pos, host, n); pos += n;
+	p[ext] = (pos - ext - 2) >> 8; p[ext + 1] = (pos - ext - 2) & 0xff;
+	p[3] = (pos - 5) >> 8; p[4] = (pos - 5) & 0xff;
+	p[6] = 0; p[7] = (pos - 9) >> 8; p[8] = (pos - 9) & 0xff;
+	return pos;
+}
+
+int main(int argc, char **argv)
+{
+	static domain_list_t list;
+	unsigned char req[BUF_SIZE];
+	char host[256], name[64], path[] = "/tmp/test_bind.XXXXXX";
+	unsigned int i, hits = 0;
+	int fd, len, bench = argc > 1 && strcmp(argv[1], "-b") == 0;
+	FILE *fp;
+	double sec;
+
+	/* the loader: leading dots, trailing dots, comments and blank lines */
+	fd = mkstemp(path);
+	CHECK(fd >= 0);
+	fp = fdopen(fd, "w");
+	fprintf(fp, "# comment\n\n.google.com\nYouTube.com.\n  t.co # short\n");
+	srand(1);
+	for (i = 3; i < NR_DOMAIN; i++) {
+		rand_label(name);
+		fprintf(fp, "%s%s\n", rand() % 3 == 0 ? "cdn." : "", name);
+	}
+	fclose(fp);
+	CHECK(domain_list_load(&list, path) == 0);
+	unlink(path);
+	CHECK(list.num == NR_DOMAIN);
+	CHECK(domain_list_match(&list, "www.google.com") == 1);
+	CHECK(domain_list_match(&list, "GOOGLE.COM.") == 1);
+	CHECK(domain_list_match(&list, "notgoogle.com") == 0);
+	CHECK(domain_list_match(&list, "m.youtube.com") == 1);
+	CHECK(domain_list_match(&list, "t.co") == 1);
+	CHECK(domain_list_match(&list, "co") == 0);
+
+	for (i = 0; i < 20000; i++) {
+		rand_host(&list, host);
+		CHECK(domain_list_match(&list, host) == brute(&list, host));
+	}
+	printf("test_bind: suffix hash matches the linear scan on %u domains\n", list.num);
+
+	for (i = 0; i < 1000; i++) {
+		rand_host(&list, host);
+		len = build_hello(req, host);
+		CHECK(parse_tls_sni(req, len, name, sizeof(name)) == 1 && strcmp(name, host) == 0);
+		CHECK(parse_tls_sni(req, len - 1, name, sizeof(name)) == 0);
+		len = sprintf((char *)req, "GET / HTTP/1.1\r\nUser-Agent: t\r\nHost: %s:8080\r\n\r\n", host);
+		CHECK(parse_http_host(req, len, name, sizeof(name)) == 1 && strcmp(name, host) == 0);
+	}
+	printf("test_bind: SNI and Host parsed from 1000 built requests\n");
+
+	if (bench) {
+		char hosts[1024][256];
+
+		for (i = 0; i < 1024; i++) {
+			rand_host(&list, hosts[i]);
+		}
+		sec = now_sec();
+		for (i = 0; i < 10000000; i++) {
+			hits += domain_list_match(&list, hosts[i & 1023]);
+		}
+		sec = now_sec() - sec;
+		printf("test_bind: %.1f ns per match on %u domains (%u hits)\n", sec / 10000000 * 1e9, list.num, hits);
+
+		hits = 0;
+		sec = now_sec();
+		for (i = 0; i < 10000; i++) {
+			hits += brute(&list, hosts[i & 1023]);
+		}
+		sec = now_sec() - sec;
+		printf("test_bind: %.1f ns per match with the linear scan (%u hits)\n", sec / 10000 * 1e9, hits);
+
+		len = build_hello(req, "www.example.youtube.com");
+		hits = 0;
+		sec = now_sec();
+		for (i = 0; i < 10000000; i++) {
+			CHECK(parse_tls_sni(req, len, host, sizeof(host)) == 1);
+			hits += domain_list_match(&list, host);
+		}
+		sec = now_sec() - sec;
+		printf("test_bind: %.1f ns per ClientHello parse and match (%u hits)\n", sec / 10000000 * 1e9, hits);
+	}
+
+	return 0;
+}
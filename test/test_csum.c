@@ -0,0 +1,179 @@
+/*
+ * the incremental TCP checksum of natcap_tcp_encode/natcap_tcp_decode
+ * against a full recomputation: insert or strip an option after the fixed
+ * header, shift seq/ack, then compare the two checksums
+ */
+#include <arpa/inet.h>
+#include "kcompat.h"
+#include "../natcap_algo.h"
+
+#define IPH_LEN 20
+#define TCPH_LEN 20
+#define TCPH_CHECK 16
+#define TCPH_FLAG_WORD 12
+
+static u16 get16(const u8 *p)
+{
+	u16 v;
+	memcpy(&v, p, 2);
+	return v;
+}
+
+static void put16(u8 *p, u16 v)
+{
+	memcpy(p, &v, 2);
+}
+
+static u32 get32(const u8 *p)
+{
+	u32 v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static void put32(u8 *p, u32 v)
+{
+	memcpy(p, &v, 4);
+}
+
+static int tot_len(const u8 *pkt)
+{
+	return ntohs(get16(pkt + 2));
+}
+
+static int doff(const u8 *pkt)
+{
+	return (pkt[IPH_LEN + 12] >> 4) * 4;
+}
+
+static __sum16 tcp_csum_full(const u8 *pkt)
+{
+	u8 tcp[65536];
+	u8 pseudo[12];
+	int len = tot_len(pkt) - IPH_LEN;
+
+	memcpy(pseudo, pkt + 12, 8);
+	pseudo[8] = 0;
+	pseudo[9] = 6;
+	put16(pseudo + 10, htons(len));
+	memcpy(tcp, pkt + IPH_LEN, len);
+	put16(tcp + TCPH_CHECK, 0);
+
+	return csum_fold(csum_partial(tcp, len, csum_partial(pseudo, 12, 0)));
+}
+
+static void build(u8 *pkt, int optlen, int paylen)
+{
+	int i;
+
+	memset(pkt, 0, IPH_LEN + TCPH_LEN);
+	pkt[0] = 0x45;
+	put16(pkt + 2, htons(IPH_LEN + TCPH_LEN + optlen + paylen));
+	for (i = 12; i < IPH_LEN; i++) {
+		pkt[i] = rand();
+	}
+	for (i = IPH_LEN; i < IPH_LEN + 12; i++) {
+		pkt[i] = rand();
+	}
+	pkt[IPH_LEN + 12] = ((TCPH_LEN + optlen) / 4) << 4;
+	pkt[IPH_LEN + 13] = rand();
+	for (i = IPH_LEN + TCPH_LEN; i < IPH_LEN + TCPH_LEN + optlen + paylen; i++) {
+		pkt[i] = rand();
+	}
+	put16(pkt + IPH_LEN + TCPH_CHECK, tcp_csum_full(pkt));
+}
+
+/* shift seq and ack the way a session offset does */
+static __wsum shift_seq_ack(u8 *pkt, __wsum diff)
+{
+	u8 *tcph = pkt + IPH_LEN;
+	u32 old;
+
+	old = get32(tcph + 4);
+	put32(tcph + 4, htonl(ntohl(old) - (rand() & 0xffff)));
+	diff = natcap_csum_diff(diff, (__force __wsum)old, (__force __wsum)get32(tcph + 4));
+	old = get32(tcph + 8);
+	put32(tcph + 8, htonl(ntohl(old) + (rand() & 0xffff)));
+	diff = natcap_csum_diff(diff, (__force __wsum)old, (__force __wsum)get32(tcph + 8));
+
+	return diff;
+}
+
+/* natcap_tcp_encode: push opsize bytes after the fixed header */
+static void encode(u8 *pkt, const u8 *opt, int opsize)
+{
+	u8 *tcph = pkt + IPH_LEN;
+	int len = tot_len(pkt);
+	__be16 old_word, old_len;
+	__wsum diff = 0;
+
+	memmove(tcph + TCPH_LEN + opsize, tcph + TCPH_LEN, len - IPH_LEN - TCPH_LEN);
+	memcpy(tcph + TCPH_LEN, opt, opsize);
+
+	old_word = get16(tcph + TCPH_FLAG_WORD);
+	old_len = htons(len - IPH_LEN);
+	tcph[12] = ((doff(pkt) + opsize) / 4) << 4 | (tcph[12] & 0x0f);
+	put16(pkt + 2, htons(len + opsize));
+
+	diff = csum_partial(opt, opsize, diff);
+	diff = natcap_csum_diff(diff, (__force __wsum)old_word, (__force __wsum)get16(tcph + TCPH_FLAG_WORD));
+	diff = natcap_csum_diff(diff, (__force __wsum)old_len, (__force __wsum)htons(tot_len(pkt) - IPH_LEN));
+	diff = shift_seq_ack(pkt, diff);
+
+	put16(tcph + TCPH_CHECK, natcap_csum_update(get16(tcph + TCPH_CHECK), diff));
+}
+
+/* natcap_tcp_decode: strip the opsize bytes after the fixed header */
+static void decode(u8 *pkt, int opsize)
+{
+	u8 *tcph = pkt + IPH_LEN;
+	int len = tot_len(pkt);
+	__be16 old_word, old_len;
+	__wsum diff = 0;
+	u8 opt[60];
+
+	memcpy(opt, tcph + TCPH_LEN, opsize);
+	memmove(tcph + TCPH_LEN, tcph + TCPH_LEN + opsize, len - IPH_LEN - TCPH_LEN - opsize);
+
+	old_word = get16(tcph + TCPH_FLAG_WORD);
+	old_len = htons(len - IPH_LEN);
+	tcph[12] = ((doff(pkt) - opsize) / 4) << 4 | (tcph[12] & 0x0f);
+	put16(pkt + 2, htons(len - opsize));
+
+	diff = csum_sub(diff, csum_partial(opt, opsize, 0));
+	diff = natcap_csum_diff(diff, (__force __wsum)old_word, (__force __wsum)get16(tcph + TCPH_FLAG_WORD));
+	diff = natcap_csum_diff(diff, (__force __wsum)old_len, (__force __wsum)htons(tot_len(pkt) - IPH_LEN));
+	diff = shift_seq_ack(pkt, diff);
+
+	put16(tcph + TCPH_CHECK, natcap_csum_update(get16(tcph + TCPH_CHECK), diff));
+}
+
+int main(void)
+{
+	static u8 pkt[IPH_LEN + 60 + 1500];
+	u8 opt[40];
+	int n, i;
+
+	srand(1);
+	for (n = 0; n < 200000; n++) {
+		int optlen = (rand() % 6) * 4;
+		int paylen = rand() % 1461;
+		int opsize = 4 * (1 + rand() % ((40 - optlen) / 4));
+
+		build(pkt, optlen, paylen);
+		for (i = 0; i < opsize; i++) {
+			opt[i] = rand();
+		}
+
+		encode(pkt, opt, opsize);
+		CHECK(get16(pkt + IPH_LEN + TCPH_CHECK) == tcp_csum_full(pkt));
+		CHECK(doff(pkt) == TCPH_LEN + optlen + opsize);
+
+		decode(pkt, opsize);
+		CHECK(get16(pkt + IPH_LEN + TCPH_CHECK) == tcp_csum_full(pkt));
+		CHECK(doff(pkt) == TCPH_LEN + optlen);
+	}
+	printf("test_csum: incremental checksum matches full recomputation for %d encode/decode pairs\n", n);
+
+	return 0;
+}
@@ -0,0 +1,137 @@
+/*
+ * the cniplist trie of natcap_lpm_build/natcap_lpm_lookup against a brute
+ * force scan of the prefixes, on random prefix sets and on every boundary
+ * address of each prefix. The real list in a file argument, ../cniplist.set
+ * by default, is checked too, -b times lookups on it
+ */
+#include <unistd.h>
+#include "kcompat.h"
+#include "../natcap_algo.h"
+
+static int brute(const struct natcap_lpm_prefix *p, unsigned int n, unsigned int addr)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		unsigned int mask = p[i].cidr ? 0xffffffff << (32 - p[i].cidr) : 0;
+		if ((addr & mask) == p[i].addr)
+			return 1;
+	}
+	return 0;
+}
+
+static unsigned int rand32(void)
+{
+	return ((unsigned int)rand() << 16) ^ (unsigned int)rand();
+}
+
+static void check_set(struct natcap_lpm_prefix *p, unsigned int n, int probes)
+{
+	struct natcap_lpm_prefix *copy;
+	struct natcap_lpm_table *t;
+	unsigned int i, addr;
+	int k;
+
+	/* build sorts its input, brute force uses its own copy */
+	copy = malloc(n * sizeof(*p) + 1);
+	memcpy(copy, p, n * sizeof(*p));
+	t = natcap_lpm_build(copy, n);
+	CHECK(!IS_ERR(t));
+
+	for (i = 0; i < n; i++) {
+		unsigned int last = p[i].addr | (p[i].cidr ? ~(0xffffffff << (32 - p[i].cidr)) : 0xffffffff);
+		CHECK(natcap_lpm_lookup(t, p[i].addr) == 1);
+		CHECK(natcap_lpm_lookup(t, last) == 1);
+		CHECK(natcap_lpm_lookup(t, p[i].addr - 1) == brute(p, n, p[i].addr - 1));
+		CHECK(natcap_lpm_lookup(t, last + 1) == brute(p, n, last + 1));
+	}
+	for (k = 0; k < probes; k++) {
+		addr = rand32();
+		CHECK(natcap_lpm_lookup(t, addr) == brute(p, n, addr));
+	}
+
+	free(t);
+	free(copy);
+}
+
+static unsigned int load(const char *file, struct natcap_lpm_prefix **pp)
+{
+	FILE *fp = fopen(file, "r");
+	unsigned int a, b, c, d, cidr;
+	unsigned int n = 0, size = 0;
+	struct natcap_lpm_prefix *p = NULL;
+	char line[128];
+
+	CHECK(fp != NULL);
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "%u.%u.%u.%u/%u", &a, &b, &c, &d, &cidr) != 5 || cidr > 32)
+			continue;
+		if (n == size) {
+			size = size ? size * 2 : 4096;
+			p = realloc(p, size * sizeof(*p));
+		}
+		p[n].addr = (a << 24 | b << 16 | c << 8 | d) & (cidr ? 0xffffffff << (32 - cidr) : 0);
+		p[n].cidr = cidr;
+		n++;
+	}
+	fclose(fp);
+	*pp = p;
+
+	return n;
+}
+
+int main(int argc, char **argv)
+{
+	struct natcap_lpm_prefix p[512];
+	struct natcap_lpm_prefix *list = NULL;
+	struct natcap_lpm_table *t;
+	unsigned int i, n, addr, hits = 0;
+	int round, bench = 0, argi = 1;
+	const char *file;
+	double sec;
+
+	if (argi < argc && strcmp(argv[argi], "-b") == 0) {
+		bench = 1;
+		argi++;
+	}
+
+	srand(1);
+	for (round = 0; round < 300; round++) {
+		n = 1 + rand() % 512;
+		for (i = 0; i < n; i++) {
+			/* mostly long prefixes clustered in a few /8s, so they nest and overlap */
+			unsigned int cidr = rand() % 4 == 0 ? rand() % 33 : 16 + rand() % 17;
+			unsigned int addr = (rand() % 4) << 24 | (rand32() & 0x00ffffff);
+			p[i].cidr = cidr;
+			p[i].addr = cidr ? addr & (0xffffffff << (32 - cidr)) : 0;
+		}
+		check_set(p, n, 2000);
+	}
+	printf("test_lpm: trie matches brute force on 300 random prefix sets\n");
+
+	file = argi < argc ? argv[argi] : "../cniplist.set";
+	if (access(file, R_OK) == 0) {
+		n = load(file, &list);
+		check_set(list, n, bench ? 0 : 200);
+		printf("test_lpm: trie matches brute force on %u prefixes of %s\n", n, file);
+
+		if (bench) {
+			t = natcap_lpm_build(list, n);
+			CHECK(!IS_ERR(t));
+			addr = 2463534242U;
+			sec = now_sec();
+			for (i = 0; i < 50000000; i++) {
+				addr ^= addr << 13;
+				addr ^= addr >> 17;
+				addr ^= addr << 5;
+				hits += natcap_lpm_lookup(t, addr);
+			}
+			sec = now_sec() - sec;
+			printf("test_lpm: %.1f ns per random address lookup (%u hits)\n", sec / 50000000 * 1e9, hits);
+			free(t);
+		}
+		free(list);
+	}
+
+	return 0;
+}
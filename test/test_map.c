@@ -0,0 +1,110 @@
+/*
+ * natcap_map_buf: a map and its inverse round trip for every length and
+ * alignment. -b also times it against the word at a time substitution it
+ * replaced
+ */
+#include "kcompat.h"
+#include "../natcap_algo.h"
+
+static unsigned char map[256], dmap[256];
+
+static inline unsigned long map_word(const unsigned char *m, unsigned long w)
+{
+	unsigned long r = 0;
+	int s;
+
+	for (s = 0; s < BITS_PER_LONG; s += 8) {
+		r |= (unsigned long)m[(w >> s) & 0xff] << s;
+	}
+	return r;
+}
+
+static void map_buf_word(const unsigned char *m, unsigned char *buf, int len)
+{
+	int i = 0;
+
+	while (i < len && ((unsigned long)(buf + i) & (sizeof(unsigned long) - 1))) {
+		buf[i] = m[buf[i]];
+		i++;
+	}
+	for (; i + 4 * (int)sizeof(unsigned long) <= len; i += 4 * sizeof(unsigned long)) {
+		unsigned long *p = (unsigned long *)(buf + i);
+		unsigned long w0 = p[0], w1 = p[1], w2 = p[2], w3 = p[3];
+		p[0] = map_word(m, w0);
+		p[1] = map_word(m, w1);
+		p[2] = map_word(m, w2);
+		p[3] = map_word(m, w3);
+	}
+	for (; i < len; i++) {
+		buf[i] = m[buf[i]];
+	}
+}
+
+static double bench(void (*fn)(const unsigned char *, unsigned char *, int), unsigned char *buf, int len, int rounds)
+{
+	double t;
+	int i;
+
+	t = now_sec();
+	for (i = 0; i < rounds; i++) {
+		fn(map, buf, len);
+		__asm__ __volatile__("" : : "r"(buf) : "memory");
+	}
+	t = now_sec() - t;
+
+	return (double)len * rounds / t / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+	static unsigned char a[2048 + 16], b[2048 + 16];
+	int i, off, len;
+	int sizes[] = {64, 512, 1460};
+
+	srand(1);
+	for (i = 0; i < 256; i++) {
+		map[i] = i;
+	}
+	for (i = 255; i > 0; i--) {
+		int j = rand() % (i + 1);
+		unsigned char c = map[i];
+		map[i] = map[j];
+		map[j] = c;
+	}
+	for (i = 0; i < 256; i++) {
+		dmap[map[i]] = i;
+	}
+
+	for (off = 0; off < 16; off++) {
+		for (len = 0; len <= 2048; len++) {
+			for (i = 0; i < len; i++) {
+				a[off + i] = b[off + i] = rand();
+			}
+			natcap_map_buf(map, a + off, len);
+			map_buf_word(map, b + off, len);
+			CHECK(memcmp(a + off, b + off, len) == 0);
+			natcap_map_buf(dmap, a + off, len);
+			map_buf_word(dmap, b + off, len);
+			CHECK(memcmp(a + off, b + off, len) == 0);
+		}
+	}
+	for (i = 0; i < 256; i++) {
+		a[i] = i;
+	}
+	natcap_map_buf(map, a, 256);
+	natcap_map_buf(dmap, a, 256);
+	for (i = 0; i < 256; i++) {
+		CHECK(a[i] == i);
+	}
+	printf("test_map: map/inverse round trip for len 0..2048 at 16 alignments\n");
+
+	if (argc > 1 && strcmp(argv[1], "-b") == 0) {
+		for (i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+			printf("test_map: len %4d: byte loop %7.1f MB/s, word at a time %7.1f MB/s\n", sizes[i],
+					bench(natcap_map_buf, a + 1, sizes[i], 2000000),
+					bench(map_buf_word, a + 1, sizes[i], 2000000));
+		}
+	}
+
+	return 0;
+}
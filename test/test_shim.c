@@ -0,0 +1,99 @@
+/*
+ * the byte moves of natcap_skb_shim_push/pull on a flat buffer with
+ * headroom, against opening the gap by moving the payload towards the
+ * tail as before: same resulting packet, and -b times both
+ */
+#include "kcompat.h"
+
+#define HEADROOM 64
+#define BUF_SIZE (HEADROOM + 1600)
+
+/* natcap_skb_shim_push: headers in front of offset go into the headroom */
+static unsigned char *shim_push(unsigned char *data, int pktlen, int offset, int len)
+{
+	(void)pktlen;
+	memmove(data - len, data, offset);
+	return data - len;
+}
+
+/* natcap_skb_shim_pull: headers in front of offset move forward over the gap */
+static unsigned char *shim_pull(unsigned char *data, int pktlen, int offset, int len)
+{
+	(void)pktlen;
+	memmove(data + len, data, offset);
+	return data + len;
+}
+
+/* the old way: everything behind offset moves towards the tail */
+static unsigned char *tail_push(unsigned char *data, int pktlen, int offset, int len)
+{
+	memmove(data + offset + len, data + offset, pktlen - offset);
+	return data;
+}
+
+static unsigned char *tail_pull(unsigned char *data, int pktlen, int offset, int len)
+{
+	memmove(data + offset, data + offset + len, pktlen - offset - len);
+	return data;
+}
+
+static double bench(unsigned char *(*push)(unsigned char *, int, int, int),
+		unsigned char *(*pull)(unsigned char *, int, int, int), int pktlen, int offset, int len, int rounds)
+{
+	static unsigned char buf[BUF_SIZE];
+	unsigned char *data = buf + HEADROOM;
+	double t;
+	int i;
+
+	t = now_sec();
+	for (i = 0; i < rounds; i++) {
+		data = push(data, pktlen, offset, len);
+		__asm__ __volatile__("" : : "r"(data) : "memory");
+		data = pull(data, pktlen + len, offset, len);
+		__asm__ __volatile__("" : : "r"(data) : "memory");
+	}
+	t = now_sec() - t;
+
+	return t / rounds * 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	static unsigned char a[BUF_SIZE], b[BUF_SIZE];
+	unsigned char *da, *db;
+	int n, i;
+	int sizes[] = {64, 512, 1460};
+
+	srand(1);
+	for (n = 0; n < 100000; n++) {
+		int offset = 20 + (rand() % 11) * 4;
+		int len = 4 + (rand() % 10) * 4;
+		int pktlen = offset + rand() % 1461;
+
+		for (i = 0; i < BUF_SIZE; i++) {
+			a[i] = b[i] = rand();
+		}
+		da = shim_push(a + HEADROOM, pktlen, offset, len);
+		db = tail_push(b + HEADROOM, pktlen, offset, len);
+		CHECK(memcmp(da, db, offset) == 0);
+		CHECK(memcmp(da + offset + len, db + offset + len, pktlen - offset) == 0);
+
+		memset(da + offset, 0x5a, len);
+		memset(db + offset, 0x5a, len);
+		da = shim_pull(da, pktlen + len, offset, len);
+		db = tail_pull(db, pktlen + len, offset, len);
+		CHECK(da == a + HEADROOM && db == b + HEADROOM);
+		CHECK(memcmp(da, db, pktlen) == 0);
+	}
+	printf("test_shim: header moves give the same packet as payload moves for %d push/pull pairs\n", n);
+
+	if (argc > 1 && strcmp(argv[1], "-b") == 0) {
+		for (i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+			printf("test_shim: payload %4d, 40 byte headers, 8 byte shim: headers %5.1f ns, payload %5.1f ns per push+pull\n", sizes[i],
+					bench(shim_push, shim_pull, 40 + sizes[i], 40, 8, 10000000),
+					bench(tail_push, tail_pull, 40 + sizes[i], 40, 8, 10000000));
+		}
+	}
+
+	return 0;
+}